@@ -0,0 +1,389 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include <rocksdb/db.h>
+
+#include <PersistentQueue.hpp>
+#include <QueueDbOptions.hpp>
+
+/*
+ * Throughput and latency benchmark of `PersistentQueue`.
+ *
+ * Every scenario of the matrix opens a fresh database, runs producer and consumer
+ * threads against one queue for a fixed duration and reports the successful operations
+ * per second and their p50/p99/p999 latency. Unsuccessful calls, pushes to a full queue
+ * and polls of an empty queue, are counted separately and are not part of the latency.
+ * Small key types wrap around their ID range many times per run, `wraparounds` reports
+ * how many times. Contention shows with producer and consumer numbers above the core
+ * number, e.g. `--producers=16,48 --consumers=16,48`, where the backoff policies differ
+ * most.
+ *
+ * Results are written as JSON to the standard output, so runs of different commits can
+ * be compared. The `perq_bench_stats` target is built with `perq_WITH_STATS`, comparing
+ * it to `perq_bench` shows the overhead of stats. Options, lists are comma separated:
+ *
+ *   --db=<path>                Database directory, removed before every scenario
+ *   --profile=<name>           default, throughput, latency or low_memory
+ *   --duration-ms=<number>     Duration of every scenario
+ *   --keys=<list>              u8, u16, u16p, u32, u32p, u64, u64p, `p` adds a uint8_t
+ *                              prefix
+ *   --producers=<list>         Producer thread numbers
+ *   --consumers=<list>         Consumer thread numbers
+ *   --value-sizes=<list>       Value sizes in bytes
+ *   --workloads=<list>         push_poll, top_pop, push_poll_batch, the last polls
+ *                              batches of up to `max_thread_number` items
+ *   --range-delete-min-count=<number>
+ *                              See `PersistentQueueOptions`, 0 disables range deletes,
+ *                              compare `push_poll_batch` with and without them
+ *   --backoffs=<list>          yield, spin, exponential, park, see `Backoff.hpp`
+ *
+ */
+
+namespace fs = boost::filesystem;
+
+using namespace perq;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Config {
+  std::string db_path = (fs::temp_directory_path() / "perq_bench").string();
+  std::string profile = "default";
+  std::chrono::milliseconds duration = std::chrono::milliseconds(500);
+  std::vector<std::string> keys = {"u8", "u16", "u16p", "u32", "u32p", "u64", "u64p"};
+  std::vector<size_t> producers = {1, 4};
+  std::vector<size_t> consumers = {1, 4};
+  std::vector<size_t> value_sizes = {16, 1024};
+  std::vector<std::string> workloads = {"push_poll", "top_pop"};
+  std::vector<std::string> backoffs = {"yield", "spin", "exponential", "park"};
+  size_t range_delete_min_count = 0;
+};
+
+struct Scenario {
+  std::string key;
+  std::string workload;
+  std::string backoff;
+  size_t producer_number;
+  size_t consumer_number;
+  size_t value_size;
+};
+
+// Latencies of the successful calls of one operation in nanoseconds
+struct Samples {
+  std::vector<uint64_t> latencies;
+  size_t failure_number = 0;
+
+  void Merge(Samples const& other) {
+    latencies.insert(latencies.end(), other.latencies.begin(), other.latencies.end());
+    failure_number += other.failure_number;
+  }
+};
+
+struct Result {
+  Scenario scenario;
+  double seconds = 0;
+  uint64_t wraparounds = 0;
+  std::vector<std::pair<std::string, Samples>> operations;
+};
+
+// Maximum number of concurrently reserved IDs, must stay below the smallest ID range
+const size_t max_thread_number = 16;
+
+template <typename TFunction>
+bool Measure(Samples& samples, TFunction&& function) {
+  const auto start = Clock::now();
+  const bool is_success = function();
+  const auto finish = Clock::now();
+  if (is_success) {
+    samples.latencies.push_back(static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(finish - start).count()));
+  }
+  else {
+    ++samples.failure_number;
+  }
+  return is_success;
+}
+
+// The queue profiles tune the prefix extractor for the queue's key prefix
+template <typename TPrefix>
+std::unique_ptr<rocksdb::DB> OpenDb(Config const& config) {
+  if (fs::exists(config.db_path))
+    fs::remove_all(config.db_path);
+
+  if (config.profile == "default") {
+    auto db = (rocksdb::DB*){};
+    rocksdb::Options options;
+    options.create_if_missing = true;
+    const auto status = rocksdb::DB::Open(options, config.db_path, &db);
+    if (!status.ok())
+      throw std::runtime_error("Failed to open the database: " + status.ToString());
+    return std::unique_ptr<rocksdb::DB>(db);
+  }
+
+  auto profile = QueueProfile::Throughput;
+  if (config.profile == "latency")
+    profile = QueueProfile::Latency;
+  else if (config.profile == "low_memory")
+    profile = QueueProfile::LowMemory;
+  else if (config.profile != "throughput")
+    throw std::runtime_error("Unknown profile: " + config.profile);
+  return OpenQueueDb<TPrefix>(config.db_path, profile);
+}
+
+template <typename TKey, typename TPrefix, typename TBackoff>
+Result Run(Config const& config, Scenario const& scenario) {
+  using Queue = PersistentQueue<TKey,
+                                TPrefix,
+                                (std::is_same<TPrefix, NoPrefix>() ? 0 : 7),
+                                TBackoff>;
+
+  auto db = OpenDb<TPrefix>(config);
+  auto options = PersistentQueueOptions();
+  options.max_thread_number = max_thread_number;
+  options.range_delete_min_count = config.range_delete_min_count;
+  auto queue = Queue(db.get(), options);
+  const auto value = std::string(scenario.value_size, 'v');
+  const auto is_top_pop = scenario.workload == "top_pop";
+  const auto is_batch = scenario.workload == "push_poll_batch";
+  if (!is_top_pop && !is_batch && scenario.workload != "push_poll")
+    throw std::runtime_error("Unknown workload: " + scenario.workload);
+
+  std::atomic<bool> is_stopped = {false};
+  std::vector<Samples> push_samples(scenario.producer_number);
+  std::vector<Samples> top_samples(scenario.consumer_number);
+  std::vector<Samples> consume_samples(scenario.consumer_number);
+  std::vector<std::thread> threads;
+
+  for (size_t i = 0; i < scenario.producer_number; ++i) {
+    threads.emplace_back([&, i] {
+      while (!is_stopped.load(std::memory_order_relaxed)) {
+        if (!Measure(push_samples[i], [&] { return queue.Push(value); }))
+          std::this_thread::yield();
+      }
+    });
+  }
+
+  for (size_t i = 0; i < scenario.consumer_number; ++i) {
+    threads.emplace_back([&, i] {
+      while (!is_stopped.load(std::memory_order_relaxed)) {
+        bool is_success;
+        if (is_top_pop) {
+          is_success = Measure(top_samples[i], [&] { return queue.Top().second; })
+            && Measure(consume_samples[i], [&] { return queue.Pop(); });
+        }
+        else if (is_batch) {
+          is_success = Measure(consume_samples[i], [&] {
+            return !queue.PollBatch(max_thread_number).empty();
+          });
+        }
+        else {
+          is_success = Measure(consume_samples[i], [&] { return queue.Poll().second; });
+        }
+        if (!is_success)
+          std::this_thread::yield();
+      }
+    });
+  }
+
+  const auto start = Clock::now();
+  std::this_thread::sleep_for(config.duration);
+  is_stopped = true;
+  for (auto& thread : threads)
+    thread.join();
+
+  auto result = Result();
+  result.scenario = scenario;
+  result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  auto merge = [](std::vector<Samples> const& samples) {
+    Samples merged;
+    for (auto const& s : samples)
+      merged.Merge(s);
+    return merged;
+  };
+  result.operations.emplace_back("push", merge(push_samples));
+  if (is_top_pop) {
+    result.operations.emplace_back("top", merge(top_samples));
+    result.operations.emplace_back("pop", merge(consume_samples));
+  }
+  else {
+    result.operations.emplace_back(is_batch ? "poll_batch" : "poll",
+                                   merge(consume_samples));
+  }
+
+  const uint64_t push_number = result.operations[0].second.latencies.size();
+  const uint64_t max_id = PrefixedNumericalKeyConverter<TKey, TPrefix>::GetMaxId();
+  result.wraparounds = (push_number > max_id) ? push_number / (max_id + 1) : 0;
+  return result;
+}
+
+template <typename TKey, typename TPrefix>
+Result Run(Config const& config, Scenario const& scenario) {
+  auto const& backoff = scenario.backoff;
+  if (backoff == "yield")
+    return Run<TKey, TPrefix, YieldBackoff<>>(config, scenario);
+  if (backoff == "spin")
+    return Run<TKey, TPrefix, SpinBackoff<>>(config, scenario);
+  if (backoff == "exponential")
+    return Run<TKey, TPrefix, ExponentialBackoff<>>(config, scenario);
+  if (backoff == "park")
+    return Run<TKey, TPrefix, ParkBackoff<>>(config, scenario);
+  throw std::runtime_error("Unknown backoff: " + backoff);
+}
+
+Result Run(Config const& config, Scenario const& scenario) {
+  auto const& key = scenario.key;
+  if (key == "u8")
+    return Run<uint8_t, NoPrefix>(config, scenario);
+  if (key == "u16")
+    return Run<uint16_t, NoPrefix>(config, scenario);
+  if (key == "u16p")
+    return Run<uint16_t, uint8_t>(config, scenario);
+  if (key == "u32")
+    return Run<uint32_t, NoPrefix>(config, scenario);
+  if (key == "u32p")
+    return Run<uint32_t, uint8_t>(config, scenario);
+  if (key == "u64")
+    return Run<uint64_t, NoPrefix>(config, scenario);
+  if (key == "u64p")
+    return Run<uint64_t, uint8_t>(config, scenario);
+  throw std::runtime_error("Unknown key type: " + key);
+}
+
+uint64_t Percentile(std::vector<uint64_t> const& sorted, double quantile) {
+  if (sorted.empty())
+    return 0;
+  const auto index = static_cast<size_t>(quantile * sorted.size());
+  return sorted[std::min(index, sorted.size() - 1)];
+}
+
+void Print(std::ostream& out, Result& result) {
+  auto const& s = result.scenario;
+  out << "    {\"key\": \"" << s.key << "\", \"workload\": \"" << s.workload
+      << "\", \"backoff\": \"" << s.backoff << "\", \"producers\": " << s.producer_number
+      << ", \"consumers\": " << s.consumer_number << ", \"value_size\": " << s.value_size
+      << ", \"seconds\": " << result.seconds
+      << ", \"wraparounds\": " << result.wraparounds << ", \"operations\": {";
+
+  bool is_first = true;
+  for (auto& operation : result.operations) {
+    auto& latencies = operation.second.latencies;
+    std::sort(latencies.begin(), latencies.end());
+    out << (is_first ? "" : ", ") << "\"" << operation.first << "\": {\"count\": "
+        << latencies.size() << ", \"failures\": " << operation.second.failure_number
+        << ", \"ops_per_sec\": " << latencies.size() / result.seconds
+        << ", \"p50_ns\": " << Percentile(latencies, 0.5)
+        << ", \"p99_ns\": " << Percentile(latencies, 0.99)
+        << ", \"p999_ns\": " << Percentile(latencies, 0.999) << "}";
+    is_first = false;
+  }
+  out << "}}";
+}
+
+std::vector<std::string> Split(std::string const& list) {
+  std::vector<std::string> items;
+  std::istringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ','))
+    if (!item.empty())
+      items.push_back(item);
+  return items;
+}
+
+std::vector<size_t> SplitNumbers(std::string const& list) {
+  std::vector<size_t> numbers;
+  for (auto const& item : Split(list))
+    numbers.push_back(std::stoul(item));
+  return numbers;
+}
+
+Config ParseArguments(int argc, char** argv) {
+  Config config;
+  for (int i = 1; i < argc; ++i) {
+    const auto argument = std::string(argv[i]);
+    const auto separator = argument.find('=');
+    if (argument.compare(0, 2, "--") != 0 || separator == std::string::npos)
+      throw std::runtime_error("Invalid argument: " + argument);
+    const auto name = argument.substr(2, separator - 2);
+    const auto value = argument.substr(separator + 1);
+
+    if (name == "db")
+      config.db_path = value;
+    else if (name == "profile")
+      config.profile = value;
+    else if (name == "duration-ms")
+      config.duration = std::chrono::milliseconds(std::stoul(value));
+    else if (name == "keys")
+      config.keys = Split(value);
+    else if (name == "producers")
+      config.producers = SplitNumbers(value);
+    else if (name == "consumers")
+      config.consumers = SplitNumbers(value);
+    else if (name == "value-sizes")
+      config.value_sizes = SplitNumbers(value);
+    else if (name == "workloads")
+      config.workloads = Split(value);
+    else if (name == "backoffs")
+      config.backoffs = Split(value);
+    else if (name == "range-delete-min-count")
+      config.range_delete_min_count = std::stoul(value);
+    else
+      throw std::runtime_error("Unknown argument: " + argument);
+  }
+  return config;
+}
+}
+
+int main(int argc, char** argv) {
+  try {
+    const auto config = ParseArguments(argc, argv);
+
+#if defined(perq_WITH_STATS)
+    const auto is_with_stats = true;
+#else
+    const auto is_with_stats = false;
+#endif
+
+    std::cout << "{\n  \"stats\": " << (is_with_stats ? "true" : "false")
+              << ",\n  \"profile\": \"" << config.profile
+              << "\",\n  \"duration_ms\": " << config.duration.count()
+              << ",\n  \"range_delete_min_count\": " << config.range_delete_min_count
+              << ",\n  \"results\": [\n";
+    bool is_first = true;
+    for (auto const& workload : config.workloads)
+      for (auto const& key : config.keys)
+        for (auto const& backoff : config.backoffs)
+          for (auto producer_number : config.producers)
+            for (auto consumer_number : config.consumers)
+              for (auto value_size : config.value_sizes) {
+                auto result = Run(config,
+                                  {key,
+                                   workload,
+                                   backoff,
+                                   producer_number,
+                                   consumer_number,
+                                   value_size});
+                std::cout << (is_first ? "" : ",\n");
+                Print(std::cout, result);
+                std::cout.flush();
+                is_first = false;
+              }
+    std::cout << "\n  ]\n}\n";
+  }
+  catch (std::exception const& e) {
+    std::cerr << "perq_bench: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
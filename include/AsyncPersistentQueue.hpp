@@ -0,0 +1,204 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <future>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <rocksdb/db.h>
+
+#include "Exception.hpp"
+
+/*
+ * Runs the RocksDB calls of a `PersistentQueue` on its own threads, so callers such as
+ * event loops do not block on the write-ahead log or on reads that miss the block cache.
+ * `PushAsync` and `PollAsync` queue a request and return a future of its result.
+ *
+ * One writer thread takes all queued pushes and writes them with one `PushBatch`, one
+ * reader thread takes all queued polls and serves them with one `PollBatch`, that is one
+ * `MultiGet` and one `WriteBatch`. Requests of each kind complete in the order they were
+ * made. The queue may be used directly at the same time.
+ *
+ */
+
+#define CurrentLocation perq_SourceLocation_CurrentLocation("AsyncPersistentQueue.hpp")
+
+namespace perq {
+template <typename TQueue>
+class AsyncPersistentQueue {
+public:
+  /*
+   * `queue` must outlive this object. At most `max_batch_size` requests are served at
+   * once, and at most `queue.max_thread_number()`, see `PushBatch` and `PollBatch`.
+   */
+  explicit AsyncPersistentQueue(TQueue& queue, size_t max_batch_size = 256)
+    : _queue(queue),
+      _max_push_batch_size(std::min(max_batch_size, queue.max_thread_number())),
+      _max_poll_batch_size(std::min(max_batch_size, queue.max_thread_number())) {
+    if (max_batch_size == 0)
+      throw Exception("Maximum batch size must be positive", CurrentLocation);
+
+    _pushes.thread = std::thread([this]() {
+      Run(_pushes, _max_push_batch_size, [this](std::vector<PushRequest>& requests) {
+        ProcessPushes(requests);
+      });
+    });
+    // The destructor does not run when the constructor throws
+    try {
+      _polls.thread = std::thread([this]() {
+        Run(_polls, _max_poll_batch_size, [this](std::vector<PollRequest>& requests) {
+          ProcessPolls(requests);
+        });
+      });
+    }
+    catch (...) {
+      Stop(_pushes);
+      throw;
+    }
+  }
+
+  AsyncPersistentQueue(AsyncPersistentQueue const&) = delete;
+  AsyncPersistentQueue& operator=(AsyncPersistentQueue const&) = delete;
+
+  // Completes all queued requests
+  ~AsyncPersistentQueue() {
+    Stop(_pushes);
+    Stop(_polls);
+  }
+
+  // The future is `false` if the queue is full
+  std::future<bool> PushAsync(std::string value) {
+    PushRequest request;
+    request.value = std::move(value);
+    return Submit(_pushes, std::move(request));
+  }
+
+  // The future is `{"", false}` if the queue is empty when the request is served
+  std::future<std::pair<std::string, bool>> PollAsync() {
+    return Submit(_polls, PollRequest());
+  }
+
+private:
+  struct PushRequest {
+    std::string value;
+    std::promise<bool> promise;
+  };
+
+  struct PollRequest {
+    std::promise<std::pair<std::string, bool>> promise;
+  };
+
+  template <typename TRequest>
+  struct Lane {
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<TRequest> requests;
+    bool is_stopped = false;
+    std::thread thread;
+  };
+
+  template <typename TRequest>
+  auto Submit(Lane<TRequest>& lane, TRequest&& request)
+    -> decltype(request.promise.get_future()) {
+    auto future = request.promise.get_future();
+    {
+      std::lock_guard<std::mutex> lock(lane.mutex);
+      if (lane.is_stopped)
+        throw Exception("AsyncPersistentQueue is stopped", CurrentLocation);
+      lane.requests.push_back(std::move(request));
+    }
+    lane.condition.notify_one();
+    return future;
+  }
+
+  // Serves requests of `lane` in batches until it is stopped and empty
+  template <typename TRequest, typename TProcess>
+  void Run(Lane<TRequest>& lane, size_t max_batch_size, TProcess process) {
+    std::vector<TRequest> batch;
+    std::unique_lock<std::mutex> lock(lane.mutex);
+    while (true) {
+      lane.condition.wait(lock, [&lane]() {
+        return lane.is_stopped || !lane.requests.empty();
+      });
+      if (lane.requests.empty())
+        return;
+
+      const auto number = std::min(max_batch_size, lane.requests.size());
+      std::move(lane.requests.begin(),
+                lane.requests.begin() + number,
+                std::back_inserter(batch));
+      lane.requests.erase(lane.requests.begin(), lane.requests.begin() + number);
+      lock.unlock();
+
+      process(batch);
+      batch.clear();
+
+      lock.lock();
+    }
+  }
+
+  template <typename TRequest>
+  void Stop(Lane<TRequest>& lane) {
+    {
+      std::lock_guard<std::mutex> lock(lane.mutex);
+      lane.is_stopped = true;
+    }
+    lane.condition.notify_all();
+    lane.thread.join();
+  }
+
+  void ProcessPushes(std::vector<PushRequest>& requests) {
+    size_t done = 0;
+    try {
+      std::vector<rocksdb::Slice> values;
+      values.reserve(requests.size());
+      for (auto const& request : requests)
+        values.emplace_back(request.value);
+
+      if (_queue.PushBatch(values)) {
+        for (; done < requests.size(); ++done)
+          requests[done].promise.set_value(true);
+        return;
+      }
+
+      // There is no room for the whole batch, every push gets its own answer
+      for (; done < requests.size(); ++done)
+        requests[done].promise.set_value(_queue.Push(requests[done].value));
+    }
+    catch (...) {
+      for (; done < requests.size(); ++done)
+        requests[done].promise.set_exception(std::current_exception());
+    }
+  }
+
+  void ProcessPolls(std::vector<PollRequest>& requests) {
+    size_t done = 0;
+    try {
+      auto values = _queue.PollBatch(requests.size());
+      for (; done < values.size(); ++done)
+        requests[done].promise.set_value({std::move(values[done]), true});
+      for (; done < requests.size(); ++done)
+        requests[done].promise.set_value({std::string(), false});
+    }
+    catch (...) {
+      for (; done < requests.size(); ++done)
+        requests[done].promise.set_exception(std::current_exception());
+    }
+  }
+
+  TQueue& _queue;
+  size_t _max_push_batch_size;
+  size_t _max_poll_batch_size;
+  Lane<PushRequest> _pushes;
+  Lane<PollRequest> _polls;
+};
+}
+
+#undef CurrentLocation
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <chrono>
+#include <thread>
+
+/*
+ * Backoff policies of the retry loops of `PersistentQueue`, selected by its `TBackoff`
+ * template parameter. Every call of a queue operation creates its own policy object and
+ * calls `Wait` before every pass of its loop. The first pass never waits. `Wait` returns
+ * true when the thread gave up its core, which stats count as a yield.
+ *
+ * `YieldBackoff` is the default. `SpinBackoff` and `ExponentialBackoff` keep the thread
+ * on its core, they suit hosts with a core for every queue thread. `ParkBackoff` sleeps,
+ * it suits hosts with many more queue threads than cores.
+ *
+ */
+
+namespace perq {
+namespace internal {
+// Tells the CPU that the thread spins, which saves power and lets a sibling hyperthread
+// run
+inline void CpuRelax() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  __builtin_ia32_pause();
+#elif defined(__GNUC__) && defined(__aarch64__)
+  asm volatile("yield" ::: "memory");
+#endif
+}
+}
+
+// Retries at once and yields after every `yieldAfter` passes
+template <unsigned yieldAfter = 10>
+class YieldBackoff {
+public:
+  bool Wait() {
+    if (_count++ < yieldAfter)
+      return false;
+    _count = 1;
+    std::this_thread::yield();
+    return true;
+  }
+
+private:
+  unsigned _count = 0;
+};
+
+/*
+ * Spins with a pause instruction between passes. Yields after every `yieldAfter` passes,
+ * so a preempted thread that holds up the others gets to run on oversubscribed hosts.
+ */
+template <unsigned yieldAfter = 1000>
+class SpinBackoff {
+public:
+  bool Wait() {
+    if (_count++ == 0)
+      return false;
+    if (_count <= yieldAfter) {
+      internal::CpuRelax();
+      return false;
+    }
+    _count = 1;
+    std::this_thread::yield();
+    return true;
+  }
+
+private:
+  unsigned _count = 0;
+};
+
+/*
+ * Spins with twice as many pause instructions on every pass, from `minSpinNumber` up to
+ * `maxSpinNumber`, and yields after every pass from then on. Contending threads spread
+ * their retries over time instead of colliding again on the next pass.
+ */
+template <unsigned minSpinNumber = 4, unsigned maxSpinNumber = 1024>
+class ExponentialBackoff {
+  static_assert(minSpinNumber > 0 && minSpinNumber <= maxSpinNumber,
+                "Spin numbers must satisfy 0 < min <= max");
+
+public:
+  bool Wait() {
+    if (_spin_number == 0) {
+      _spin_number = minSpinNumber;
+      return false;
+    }
+    for (unsigned i = 0; i < _spin_number; ++i)
+      internal::CpuRelax();
+    if (_spin_number < maxSpinNumber) {
+      _spin_number
+        = (_spin_number > maxSpinNumber / 2) ? maxSpinNumber : 2 * _spin_number;
+      return false;
+    }
+    std::this_thread::yield();
+    return true;
+  }
+
+private:
+  unsigned _spin_number = 0;
+};
+
+/*
+ * Retries at once for `spinNumber` passes, then parks the thread in the kernel with
+ * timed sleeps that double from `minSleepMicroseconds` up to `maxSleepMicroseconds`. The
+ * queue has no owner of the contended state to wake parked threads, so the sleep is
+ * timed instead of waiting on a futex.
+ */
+template <unsigned spinNumber = 10,
+          unsigned minSleepMicroseconds = 1,
+          unsigned maxSleepMicroseconds = 1000>
+class ParkBackoff {
+  static_assert(minSleepMicroseconds > 0 && minSleepMicroseconds <= maxSleepMicroseconds,
+                "Sleep durations must satisfy 0 < min <= max");
+
+public:
+  bool Wait() {
+    if (_count++ <= spinNumber)
+      return false;
+    std::this_thread::sleep_for(std::chrono::microseconds(_sleep_microseconds));
+    if (_sleep_microseconds < maxSleepMicroseconds) {
+      _sleep_microseconds = (_sleep_microseconds > maxSleepMicroseconds / 2)
+        ? maxSleepMicroseconds
+        : 2 * _sleep_microseconds;
+    }
+    return true;
+  }
+
+private:
+  unsigned _count = 0;
+  unsigned _sleep_microseconds = minSleepMicroseconds;
+};
+}
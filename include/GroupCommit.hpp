@@ -0,0 +1,61 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+#include <rocksdb/db.h>
+
+/*
+ * Coalesces syncs of the write-ahead log requested by concurrent writers. A writer calls
+ * `Commit` after its unsynced write has returned. The first writer becomes a leader and
+ * syncs the log once for every write committed before the sync started, the others wait
+ * for the leader. Writers that arrive during a sync are covered by the next leader.
+ *
+ */
+
+namespace perq {
+class GroupCommit {
+public:
+  /*
+   * Returns once `sync` covering the caller's write has succeeded. `sync` is a callable
+   * returning `rocksdb::Status`, it is never called concurrently. A failed status is
+   * returned to the leader only, its followers retry with a new leader.
+   */
+  template <typename TSync>
+  rocksdb::Status Commit(TSync&& sync) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    const auto ticket = ++_committed_ticket;
+
+    while (_synced_ticket < ticket) {
+      if (_is_syncing) {
+        _condition.wait(lock);
+        continue;
+      }
+
+      _is_syncing = true;
+      const auto target = _committed_ticket;
+      lock.unlock();
+      const rocksdb::Status status = sync();
+      lock.lock();
+      _is_syncing = false;
+
+      if (status.ok() && target > _synced_ticket)
+        _synced_ticket = target;
+      _condition.notify_all();
+
+      if (!status.ok())
+        return status;
+    }
+
+    return rocksdb::Status::OK();
+  }
+
+private:
+  std::mutex _mutex;
+  std::condition_variable _condition;
+  std::uint64_t _committed_ticket = 0;
+  std::uint64_t _synced_ticket = 0;
+  bool _is_syncing = false;
+};
+}
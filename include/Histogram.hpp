@@ -0,0 +1,213 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "ShardedCounter.hpp"
+
+/*
+ * Histogram of unsigned 64-bit values in a fixed number of logarithmic buckets, similar
+ * to an HDR histogram. Values below `sub_bucket_number` are counted exactly, every larger
+ * power of two is split into `sub_bucket_number` linear buckets, so a reported value is
+ * at most 1/`sub_bucket_number` greater than the recorded one.
+ *
+ * Recording is two relaxed atomic additions to the buckets and the sum of the calling
+ * thread's shard, like `ShardedCounter`, so threads recording the same common value do
+ * not bounce its bucket's cache line. A shard takes about 4 KiB, the shards are allocated
+ * by the first `Record`, so a histogram that records nothing takes no room for them.
+ * Queries sum the shards without locks and can run concurrently with recording, they see
+ * a slightly inconsistent picture then. `Snapshot` copies the buckets into a plain
+ * `HistogramSnapshot`, which also gives percentiles of an interval as the difference of
+ * two snapshots.
+ *
+ */
+
+namespace perq {
+struct HistogramSnapshot;
+
+class Histogram {
+public:
+  static constexpr unsigned sub_bucket_bits = 3;
+  static constexpr size_t sub_bucket_number = size_t(1) << sub_bucket_bits;
+  static constexpr size_t bucket_number = (64 - sub_bucket_bits + 1) * sub_bucket_number;
+  static constexpr size_t shard_number = 8;
+
+  Histogram() = default;
+  Histogram(Histogram const&) = delete;
+  Histogram& operator=(Histogram const&) = delete;
+
+  ~Histogram() { delete[] _shards.load(std::memory_order_relaxed); }
+
+  void Record(uint64_t value) {
+    auto& shard = AllocateShards()[internal::ThreadIndex() % shard_number];
+    shard.buckets[ToIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    shard.sum.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  uint64_t Count() const {
+    uint64_t count = 0;
+    const auto shards = _shards.load(std::memory_order_acquire);
+    for (size_t i = 0; shards && i < shard_number; ++i) {
+      for (auto const& bucket : shards[i].buckets)
+        count += bucket.load(std::memory_order_relaxed);
+    }
+    return count;
+  }
+
+  uint64_t Sum() const {
+    uint64_t sum = 0;
+    const auto shards = _shards.load(std::memory_order_acquire);
+    for (size_t i = 0; shards && i < shard_number; ++i)
+      sum += shards[i].sum.load(std::memory_order_relaxed);
+    return sum;
+  }
+
+  double Mean() const;
+
+  // The smallest bucket bound that covers `quantile` (0 to 1) of the values, 0 if empty
+  uint64_t Percentile(double quantile) const;
+
+  // Bound of the highest non-empty bucket, 0 if empty
+  uint64_t Max() const;
+
+  HistogramSnapshot Snapshot() const;
+
+  void Reset() {
+    const auto shards = _shards.load(std::memory_order_acquire);
+    for (size_t i = 0; shards && i < shard_number; ++i) {
+      for (auto& bucket : shards[i].buckets)
+        bucket.store(0, std::memory_order_relaxed);
+      shards[i].sum.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  static size_t ToIndex(uint64_t value) {
+    if (value < sub_bucket_number)
+      return static_cast<size_t>(value);
+    const auto exponent = Log2(value);
+    const auto sub_bucket
+      = (value >> (exponent - sub_bucket_bits)) & (sub_bucket_number - 1);
+    return (exponent - sub_bucket_bits + 1) * sub_bucket_number
+      + static_cast<size_t>(sub_bucket);
+  }
+
+  // The greatest value that falls into the bucket
+  static uint64_t ToUpperBound(size_t index) {
+    if (index < sub_bucket_number)
+      return index;
+    const auto shift = index / sub_bucket_number - 1;
+    const auto lower
+      = static_cast<uint64_t>(sub_bucket_number + index % sub_bucket_number) << shift;
+    return lower + ((uint64_t(1) << shift) - 1);
+  }
+
+private:
+  static unsigned Log2(uint64_t value) {
+#if defined(__GNUC__)
+    return 63 - static_cast<unsigned>(__builtin_clzll(value));
+#else
+    unsigned exponent = 0;
+    while (value >>= 1)
+      ++exponent;
+    return exponent;
+#endif
+  }
+
+  struct Shard {
+    std::array<std::atomic<uint64_t>, bucket_number> buckets = {};
+    std::atomic<uint64_t> sum = {0};
+    // Keeps the first buckets of the next shard off the line of this shard's sum
+    char padding[ShardedCounter<uint64_t>::cache_line_size];
+  };
+
+  // The first recording threads race to allocate, one allocation wins
+  Shard* AllocateShards() {
+    auto shards = _shards.load(std::memory_order_acquire);
+    if (shards)
+      return shards;
+
+    auto allocated = new Shard[shard_number];
+    if (_shards.compare_exchange_strong(
+          shards, allocated, std::memory_order_acq_rel, std::memory_order_acquire))
+      return allocated;
+
+    delete[] allocated;
+    return shards;
+  }
+
+  std::atomic<Shard*> _shards = {nullptr};
+};
+
+struct HistogramSnapshot {
+  std::array<uint64_t, Histogram::bucket_number> buckets = {};
+  uint64_t sum = 0;
+
+  uint64_t Count() const {
+    uint64_t count = 0;
+    for (auto bucket : buckets)
+      count += bucket;
+    return count;
+  }
+
+  double Mean() const {
+    const auto count = Count();
+    return count ? static_cast<double>(sum) / count : 0;
+  }
+
+  uint64_t Percentile(double quantile) const {
+    const auto count = Count();
+    if (count == 0)
+      return 0;
+
+    auto target = static_cast<uint64_t>(quantile * count + 0.5);
+    if (target == 0)
+      target = 1;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < Histogram::bucket_number; ++i) {
+      seen += buckets[i];
+      if (seen >= target)
+        return Histogram::ToUpperBound(i);
+    }
+    return Max();
+  }
+
+  uint64_t Max() const {
+    for (size_t i = Histogram::bucket_number; i > 0; --i) {
+      if (buckets[i - 1])
+        return Histogram::ToUpperBound(i - 1);
+    }
+    return 0;
+  }
+
+  // Values recorded since `previous` was taken from the same histogram
+  HistogramSnapshot Delta(HistogramSnapshot const& previous) const {
+    HistogramSnapshot delta;
+    for (size_t i = 0; i < Histogram::bucket_number; ++i)
+      delta.buckets[i] = buckets[i] - previous.buckets[i];
+    delta.sum = sum - previous.sum;
+    return delta;
+  }
+};
+
+inline double Histogram::Mean() const { return Snapshot().Mean(); }
+
+inline uint64_t Histogram::Percentile(double quantile) const {
+  return Snapshot().Percentile(quantile);
+}
+
+inline uint64_t Histogram::Max() const { return Snapshot().Max(); }
+
+inline HistogramSnapshot Histogram::Snapshot() const {
+  HistogramSnapshot snapshot;
+  const auto shards = _shards.load(std::memory_order_acquire);
+  for (size_t j = 0; shards && j < shard_number; ++j) {
+    for (size_t i = 0; i < bucket_number; ++i)
+      snapshot.buckets[i] += shards[j].buckets[i].load(std::memory_order_relaxed);
+    snapshot.sum += shards[j].sum.load(std::memory_order_relaxed);
+  }
+  return snapshot;
+}
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+
+#include <rocksdb/db.h>
+
+/*
+ * Bounded in-memory cache of queue values keyed by ID. It is a ring of slots, an ID
+ * always maps to the slot `id % capacity`, so a newer ID replaces an older one.
+ *
+ * Every slot is guarded by its own mutex. `Put` and `Get` never wait: when a slot is
+ * busy the value is not cached or the lookup is a miss. Only `Erase` waits for the slot,
+ * because a consumed item must never be returned from the cache after its ID is reused.
+ *
+ * Every value is tagged with the push sequence of its reservation. A slot keeps the
+ * sequence of its last value even after `Erase`, so a late `Put` of a producer that was
+ * stalled while its ID was consumed and reused cannot replace a newer value.
+ *
+ */
+
+namespace perq {
+template <typename TKey>
+class HotRingCache {
+  static_assert(std::is_unsigned<TKey>(), "Must be unsigned integer type");
+
+public:
+  HotRingCache() : _mask(0), _max_value_size(0) {}
+
+  // Zero capacity disables the cache
+  void Reset(size_t capacity, size_t max_value_size) {
+    if (capacity == 0) {
+      _slots.reset();
+      _mask = 0;
+      return;
+    }
+
+    size_t size = 1;
+    while (size < capacity)
+      size <<= 1;
+
+    _slots.reset(new Slot[size]);
+    _mask = size - 1;
+    _max_value_size = max_value_size;
+  }
+
+  bool IsEnabled() const { return static_cast<bool>(_slots); }
+
+  /*
+   * Caches `value` of `id` unless the slot holds a value of a later push `sequence`.
+   * `is_valid` is called while the slot is locked, the value is not cached when it
+   * returns `false` (e.g. the item was already consumed).
+   */
+  template <typename TIsValid>
+  void Put(TKey id,
+           uint64_t sequence,
+           rocksdb::Slice const& value,
+           TIsValid const& is_valid) {
+    Put(id, sequence, rocksdb::SliceParts(&value, 1), is_valid);
+  }
+
+  template <typename TIsValid>
+  void Put(TKey id,
+           uint64_t sequence,
+           rocksdb::SliceParts const& value,
+           TIsValid const& is_valid) {
+    size_t size = 0;
+    for (int i = 0; i < value.num_parts; ++i)
+      size += value.parts[i].size();
+    if (size > _max_value_size)
+      return;
+
+    auto& slot = GetSlot(id);
+    std::unique_lock<std::mutex> lock(slot.mutex, std::try_to_lock);
+    if (!lock.owns_lock() || slot.sequence > sequence || !is_valid())
+      return;
+    slot.value.clear();
+    for (int i = 0; i < value.num_parts; ++i)
+      slot.value.append(value.parts[i].data(), value.parts[i].size());
+    slot.id = id;
+    slot.sequence = sequence;
+    slot.is_set = true;
+  }
+
+  bool Get(TKey id, std::string& value) {
+    auto& slot = GetSlot(id);
+    std::unique_lock<std::mutex> lock(slot.mutex, std::try_to_lock);
+    if (!lock.owns_lock())
+      return false;
+    const auto is_hit = slot.is_set && slot.id == id;
+    if (is_hit)
+      value.assign(slot.value);
+    return is_hit;
+  }
+
+  bool Get(TKey id, rocksdb::PinnableSlice& value) {
+    auto& slot = GetSlot(id);
+    std::unique_lock<std::mutex> lock(slot.mutex, std::try_to_lock);
+    if (!lock.owns_lock())
+      return false;
+    const auto is_hit = slot.is_set && slot.id == id;
+    if (is_hit)
+      value.PinSelf(slot.value);
+    return is_hit;
+  }
+
+  bool Contains(TKey id) {
+    auto& slot = GetSlot(id);
+    std::unique_lock<std::mutex> lock(slot.mutex, std::try_to_lock);
+    return lock.owns_lock() && slot.is_set && slot.id == id;
+  }
+
+  void Erase(TKey id) {
+    auto& slot = GetSlot(id);
+    std::lock_guard<std::mutex> lock(slot.mutex);
+    if (slot.id == id)
+      slot.is_set = false;
+  }
+
+private:
+  struct Slot {
+    std::mutex mutex;
+    bool is_set = false;
+    TKey id = 0;
+    uint64_t sequence = 0;
+    std::string value;
+  };
+
+  Slot& GetSlot(TKey id) { return _slots[static_cast<size_t>(id) & _mask]; }
+
+  std::unique_ptr<Slot[]> _slots;
+  size_t _mask;
+  size_t _max_value_size;
+};
+}
@@ -0,0 +1,477 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <boost/endian/conversion.hpp>
+
+#include <rocksdb/db.h>
+
+#include "Exception.hpp"
+#include "PersistentQueue.hpp"
+#include "PersistentQueueOptions.hpp"
+
+/*
+ * Queue of small messages packed into segments, every segment is one item of the
+ * underlying `PersistentQueue` (`TQueue`). Many messages then share one key, one
+ * write-ahead log record and one tombstone.
+ *
+ * Pushed messages are appended to an open segment in memory. The segment is sealed, that
+ * is pushed to the underlying queue, by one of the producers waiting on it, so `Push`
+ * returns once its message is as durable as an item of the underlying queue. Producers
+ * that push while a segment is being sealed share the next one. With `is_push_batched`
+ * `Push` returns right away instead, the segment is sealed when it reaches
+ * `segment_max_number` messages or `segment_max_bytes`, on `Flush`, every
+ * `flush_interval`, or when a consumer finds no sealed segment. Messages of the open
+ * segment are lost on a crash then, `Flush` makes them durable.
+ *
+ * Consumers read the head segment once and hand out its messages one by one. The number
+ * of consumed messages of the head segment is persisted every `cursor_interval`
+ * messages and on destruction in an auxiliary record of the underlying queue, the
+ * cursor. The segment is deleted when all its messages are consumed, in the same write
+ * as the cursor, so a restart continues with the first message not consumed. After a
+ * crash up to `cursor_interval - 1` consumed messages of the head segment are delivered
+ * again.
+ * `Initialize` reads the message numbers of all sealed segments to restore `Size`. Polls
+ * are serialized, the underlying queue must not be consumed directly.
+ *
+ * Segment value: little-endian 32 bit number of messages, then every message as a
+ * little-endian 32 bit size followed by its bytes. Cursor value: little-endian 64 bit ID
+ * of the head segment and 32 bit number of its consumed messages.
+ *
+ */
+
+#define CurrentLocation perq_SourceLocation_CurrentLocation("PackedPersistentQueue.hpp")
+
+namespace perq {
+
+struct PackingOptions {
+  // An open segment is sealed when it reaches either limit
+  size_t segment_max_number = 256;
+  size_t segment_max_bytes = 64 << 10;
+
+  // `Push` returns before its message is sealed, the message is lost on a crash until
+  // the segment is sealed
+  bool is_push_batched = false;
+
+  // With `is_push_batched` a background thread seals the open segment this often. Zero
+  // disables the thread.
+  std::chrono::milliseconds flush_interval = std::chrono::milliseconds(0);
+
+  // The cursor is written once per this many consumed messages, at most this many minus
+  // one messages are delivered again after a crash. One writes it on every `Poll`/`Pop`.
+  size_t cursor_interval = 16;
+};
+
+template <typename TQueue>
+class PackedPersistentQueue {
+public:
+  PackedPersistentQueue()
+    : _size(0), _open_segment(std::make_shared<OpenSegment>()), _is_initialized(false) {}
+
+  PackedPersistentQueue(rocksdb::DB* db,
+                        PersistentQueueOptions const& options = PersistentQueueOptions(),
+                        PackingOptions const& packing_options = PackingOptions())
+    : PackedPersistentQueue() {
+    Initialize(db, db->DefaultColumnFamily(), options, packing_options);
+  }
+
+  PackedPersistentQueue(rocksdb::DB* db,
+                        rocksdb::ColumnFamilyHandle* column_family,
+                        PersistentQueueOptions const& options = PersistentQueueOptions(),
+                        PackingOptions const& packing_options = PackingOptions())
+    : PackedPersistentQueue() {
+    Initialize(db, column_family, options, packing_options);
+  }
+
+  PackedPersistentQueue(PackedPersistentQueue const&) = delete;
+  PackedPersistentQueue& operator=(PackedPersistentQueue const&) = delete;
+
+  /*
+   * Seals the open segment and writes the cursor, errors are ignored. With
+   * `is_push_batched` call `Flush` and check its result before, the open segment is lost
+   * if the queue is full.
+   */
+  ~PackedPersistentQueue() {
+    StopFlusher();
+    if (!_is_initialized)
+      return;
+
+    try {
+      Flush();
+      std::lock_guard<std::mutex> lock(_poll_mutex);
+      WriteCursor();
+    }
+    catch (...) {
+    }
+  }
+
+  void Initialize(rocksdb::DB* db,
+                  rocksdb::ColumnFamilyHandle* column_family,
+                  PersistentQueueOptions const& options = PersistentQueueOptions(),
+                  PackingOptions const& packing_options = PackingOptions()) {
+    if (packing_options.segment_max_number == 0
+        || packing_options.segment_max_number > std::numeric_limits<uint32_t>::max())
+      throw Exception("Maximum number of messages in a segment ("
+                        + std::to_string(packing_options.segment_max_number)
+                        + ") is out of range",
+                      CurrentLocation);
+    if (packing_options.cursor_interval == 0)
+      throw Exception("Cursor interval must be positive", CurrentLocation);
+
+    _queue.Initialize(db, column_family, options);
+    _packing_options = packing_options;
+
+    {
+      std::lock_guard<std::mutex> lock(_poll_mutex);
+      _size.store(CountStoredMessages(), std::memory_order_relaxed);
+    }
+    _is_initialized = true;
+
+    StartFlusher();
+  }
+
+  TQueue& queue() { return _queue; }
+
+  // Number of messages pushed and not consumed, including the open segment
+  size_t Size() { return _size.load(std::memory_order_acquire); }
+
+  /*
+   * Returns `false` if the queue is full: the segment of the message could not be sealed,
+   * or with `is_push_batched` the open segment is full and cannot be sealed.
+   */
+  bool Push(rocksdb::Slice const& value) {
+    if (value.size() > std::numeric_limits<uint32_t>::max())
+      throw Exception("Message size (" + std::to_string(value.size())
+                        + ") does not fit a segment",
+                      CurrentLocation);
+
+    std::unique_lock<std::mutex> lock(_push_mutex);
+    while (IsOpenSegmentFull()) {
+      if (_is_sealing)
+        _seal_condition.wait(lock);
+      else if (!Seal(lock))
+        return false;
+    }
+
+    const auto segment = _open_segment;
+    if (segment->number == 0)
+      segment->value.assign(sizeof(uint32_t), '\0');
+    AppendSize(segment->value, value.size());
+    segment->value.append(value.data(), value.size());
+    ++segment->number;
+    _size.fetch_add(1, std::memory_order_release);
+
+    if (_packing_options.is_push_batched) {
+      if (IsOpenSegmentFull() && !_is_sealing)
+        Seal(lock);
+      return true;
+    }
+
+    while (!segment->is_sealed) {
+      if (_is_sealing)
+        _seal_condition.wait(lock);
+      else
+        Seal(lock);
+    }
+    return segment->is_pushed;
+  }
+
+  // Seals the open segment, returns `false` if the queue is full
+  bool Flush() {
+    std::unique_lock<std::mutex> lock(_push_mutex);
+    _seal_condition.wait(lock, [this]() { return !_is_sealing; });
+    return Seal(lock);
+  }
+
+  std::pair<std::string, bool> Poll() {
+    auto ret = std::pair<std::string, bool>();
+    ret.second = Poll(ret.first);
+    return ret;
+  }
+
+  // Polls into `value` reusing its capacity, `value` is cleared when the queue is empty
+  bool Poll(std::string& value) {
+    std::lock_guard<std::mutex> lock(_poll_mutex);
+    if (!LoadSegment()) {
+      value.clear();
+      return false;
+    }
+
+    const auto size = ReadSize(_segment, _segment_offset);
+    value.assign(_segment.data() + _segment_offset + sizeof(uint32_t), size);
+    Consume(size);
+    return true;
+  }
+
+  bool Pop() {
+    std::lock_guard<std::mutex> lock(_poll_mutex);
+    if (!LoadSegment())
+      return false;
+
+    Consume(ReadSize(_segment, _segment_offset));
+    return true;
+  }
+
+private:
+  static constexpr char cursor_tag = 'P';
+  static constexpr size_t cursor_size = sizeof(uint64_t) + sizeof(uint32_t);
+
+  struct OpenSegment {
+    std::string value;
+    size_t number = 0;
+    bool is_sealed = false;
+    bool is_pushed = false;
+  };
+
+  bool IsOpenSegmentFull() {
+    return _open_segment->number >= _packing_options.segment_max_number
+      || _open_segment->value.size() >= _packing_options.segment_max_bytes;
+  }
+
+  /*
+   * Pushes the open segment to the underlying queue, `lock` of `_push_mutex` must be
+   * locked and no other seal in progress. The lock is released during the push, messages
+   * pushed meanwhile go to a new open segment.
+   *
+   * If the queue is full, the messages of a batched segment are put back in front of the
+   * open segment, otherwise they are dropped and their `Push` calls return `false`.
+   */
+  bool Seal(std::unique_lock<std::mutex>& lock) {
+    if (_open_segment->number == 0)
+      return true;
+
+    const auto segment = std::move(_open_segment);
+    _open_segment = std::make_shared<OpenSegment>();
+    const auto number
+      = boost::endian::native_to_little(static_cast<uint32_t>(segment->number));
+    std::memcpy(&segment->value[0], &number, sizeof(number));
+
+    _is_sealing = true;
+    lock.unlock();
+    auto is_pushed = false;
+    try {
+      is_pushed = _queue.Push(rocksdb::Slice(segment->value));
+    }
+    catch (...) {
+      lock.lock();
+      FinishSeal(*segment, false);
+      throw;
+    }
+    lock.lock();
+    FinishSeal(*segment, is_pushed);
+    return is_pushed;
+  }
+
+  // `_push_mutex` must be locked
+  void FinishSeal(OpenSegment& segment, bool is_pushed) {
+    _is_sealing = false;
+
+    if (!is_pushed && _packing_options.is_push_batched) {
+      // Pushed messages stay ahead of those appended during the seal
+      if (_open_segment->number != 0)
+        segment.value.append(_open_segment->value, sizeof(uint32_t), std::string::npos);
+      _open_segment->value = std::move(segment.value);
+      _open_segment->number += segment.number;
+    }
+    else {
+      if (!is_pushed)
+        _size.fetch_sub(segment.number, std::memory_order_release);
+      segment.is_sealed = true;
+      segment.is_pushed = is_pushed;
+    }
+
+    _seal_condition.notify_all();
+  }
+
+  // Makes sure the head segment has a message to consume, `_poll_mutex` must be locked
+  bool LoadSegment() {
+    if (_segment_consumed < _segment_number)
+      return true;
+
+    if (!_queue.Top(_segment_value)) {
+      // Messages of the open segment are not held back from an idle consumer
+      if (!Flush() || !_queue.Top(_segment_value))
+        return false;
+    }
+
+    _segment.assign(_segment_value.data(), _segment_value.size());
+    _segment_value.Reset();
+    _segment_id = internal::QueueAccess::HeadId(_queue);
+    _segment_number = ReadNumber(_segment);
+    _segment_consumed = 0;
+    _segment_offset = sizeof(uint32_t);
+    _cursor_consumed = 0;
+
+    // The cursor belongs to the head segment unless the underlying queue was consumed
+    // directly
+    std::string cursor;
+    if (internal::QueueAccess::ReadRecord(_queue, cursor_tag, cursor)
+        && cursor.size() == cursor_size) {
+      uint64_t id;
+      uint32_t consumed;
+      std::memcpy(&id, cursor.data(), sizeof(id));
+      std::memcpy(&consumed, cursor.data() + sizeof(id), sizeof(consumed));
+      id = boost::endian::little_to_native(id);
+      consumed = boost::endian::little_to_native(consumed);
+      if (id == _segment_id && consumed < _segment_number) {
+        for (; _segment_consumed < consumed; ++_segment_consumed)
+          _segment_offset += sizeof(uint32_t) + ReadSize(_segment, _segment_offset);
+        _cursor_consumed = consumed;
+      }
+    }
+
+    return _segment_consumed < _segment_number;
+  }
+
+  /*
+   * Consumes the message at `_segment_offset` of `size` bytes, the cursor is written
+   * every `cursor_interval` messages. The last message deletes the segment and the cursor
+   * in one write. Nothing is consumed if a write fails.
+   */
+  void Consume(size_t size) {
+    const auto consumed = _segment_consumed + 1;
+    if (consumed == _segment_number) {
+      if (!internal::QueueAccess::PopWithRecord(_queue, cursor_tag, nullptr))
+        throw Exception("Fatal logic failure: the head segment was consumed by another "
+                        "call, the underlying queue must not be consumed directly",
+                        CurrentLocation);
+    }
+    else if (consumed - _cursor_consumed >= _packing_options.cursor_interval) {
+      WriteCursor(consumed);
+    }
+
+    _segment_offset += sizeof(uint32_t) + size;
+    _segment_consumed = consumed;
+    _size.fetch_sub(1, std::memory_order_release);
+  }
+
+  // Writes the cursor of the head segment if it is behind, `_poll_mutex` must be locked
+  void WriteCursor() {
+    if (_segment_consumed > _cursor_consumed && _segment_consumed < _segment_number)
+      WriteCursor(_segment_consumed);
+  }
+
+  void WriteCursor(size_t consumed) {
+    const auto id = boost::endian::native_to_little(_segment_id);
+    const auto consumed_value
+      = boost::endian::native_to_little(static_cast<uint32_t>(consumed));
+    char cursor[cursor_size];
+    std::memcpy(cursor, &id, sizeof(id));
+    std::memcpy(cursor + sizeof(id), &consumed_value, sizeof(consumed_value));
+    internal::QueueAccess::WriteRecord(
+      _queue, cursor_tag, rocksdb::Slice(cursor, cursor_size));
+    _cursor_consumed = consumed;
+  }
+
+  // Messages of all sealed segments minus the consumed ones of the head segment
+  size_t CountStoredMessages() {
+    size_t count = 0;
+    if (LoadSegment())
+      count = _segment_number - _segment_consumed;
+
+    bool is_head = true;
+    internal::QueueAccess::ForEachValue(_queue, [&](rocksdb::Slice const& value) {
+      if (!is_head)
+        count += ReadNumber(value);
+      is_head = false;
+    });
+    return count;
+  }
+
+  void StartFlusher() {
+    if (_packing_options.flush_interval.count() == 0)
+      return;
+
+    _is_flusher_stopped = false;
+    _flusher_thread = std::thread([this]() {
+      std::unique_lock<std::mutex> lock(_flusher_mutex);
+      const auto interval = _packing_options.flush_interval;
+      while (!_flusher_condition.wait_for(
+        lock, interval, [this]() { return _is_flusher_stopped; })) {
+        lock.unlock();
+        // A full queue keeps the segment open, it is sealed on the next run
+        Flush();
+        lock.lock();
+      }
+    });
+  }
+
+  void StopFlusher() {
+    if (!_flusher_thread.joinable())
+      return;
+
+    {
+      std::lock_guard<std::mutex> lock(_flusher_mutex);
+      _is_flusher_stopped = true;
+    }
+    _flusher_condition.notify_all();
+    _flusher_thread.join();
+  }
+
+  static void AppendSize(std::string& segment, size_t size) {
+    const auto value = boost::endian::native_to_little(static_cast<uint32_t>(size));
+    segment.append(reinterpret_cast<char const*>(&value), sizeof(value));
+  }
+
+  static uint32_t ReadNumber(rocksdb::Slice const& segment) {
+    if (segment.size() < sizeof(uint32_t))
+      throw Exception("Fatal queue data state: a segment is shorter than its header",
+                      CurrentLocation);
+    uint32_t number;
+    std::memcpy(&number, segment.data(), sizeof(number));
+    return boost::endian::little_to_native(number);
+  }
+
+  static size_t ReadSize(std::string const& segment, size_t offset) {
+    uint32_t size;
+    if (offset + sizeof(size) > segment.size())
+      throw Exception("Fatal queue data state: a segment is truncated", CurrentLocation);
+    std::memcpy(&size, segment.data() + offset, sizeof(size));
+    size = boost::endian::little_to_native(size);
+    if (offset + sizeof(size) + size > segment.size())
+      throw Exception("Fatal queue data state: a segment is truncated", CurrentLocation);
+    return size;
+  }
+
+  TQueue _queue;
+  PackingOptions _packing_options;
+  std::atomic<size_t> _size;
+
+  // The open segment and whether a seal is in progress, `_push_mutex` guards them
+  std::mutex _push_mutex;
+  std::condition_variable _seal_condition;
+  std::shared_ptr<OpenSegment> _open_segment;
+  bool _is_sealing = false;
+
+  // The head segment, `_poll_mutex` guards it
+  std::mutex _poll_mutex;
+  rocksdb::PinnableSlice _segment_value;
+  std::string _segment;
+  uint64_t _segment_id = 0;
+  size_t _segment_number = 0;
+  size_t _segment_consumed = 0;
+  size_t _segment_offset = 0;
+
+  // Consumed messages of the head segment according to the persisted cursor
+  size_t _cursor_consumed = 0;
+
+  bool _is_initialized;
+
+  bool _is_flusher_stopped = false;
+  std::mutex _flusher_mutex;
+  std::condition_variable _flusher_condition;
+  std::thread _flusher_thread;
+};
+}
+
+#undef CurrentLocation
@@ -1,19 +1,36 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <cstring>
+#include <iterator>
 #include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <type_traits>
+#include <vector>
+
+#include <boost/endian/conversion.hpp>
 
 #include <rocksdb/db.h>
 
+#include "Backoff.hpp"
 #include "Exception.hpp"
+#include "GroupCommit.hpp"
+#include "HotRingCache.hpp"
 #include "PersistentQueueIdCorrector.hpp"
+#include "PersistentQueueOptions.hpp"
 #include "PrefixedNumericalKeyConverter.hpp"
+#include "QueueSnapshot.hpp"
+#include "RecoveryInfo.hpp"
+#include "ShardedCounter.hpp"
 #include "Stats.hpp"
 #include "TypeHelpers.hpp"
 
@@ -41,12 +58,17 @@
 #define CurrentLocation perq_SourceLocation_CurrentLocation("PersistentQueue.hpp")
 
 namespace perq {
+namespace internal {
+struct QueueAccess;
+}
+
 template <typename TKey,
           typename TPrefix = NoPrefix,
           typename std::conditional<std::is_same<TPrefix, NoPrefix>::value,
                                     typename NoPrefix::Type,
                                     TPrefix>::type prefixValue
-          = 0>
+          = 0,
+          typename TBackoff = YieldBackoff<>>
 class PersistentQueue {
 
   static_assert(sizeof(TKey) > internal::PrefixSize<TPrefix>::size,
@@ -56,138 +78,127 @@ class PersistentQueue {
                 "Key and prefix types must be unsigned");
 
 public:
-  PersistentQueue() : _db(), _max_thread_number(std::numeric_limits<size_t>::max()) {}
+  PersistentQueue()
+    : _db(), _column_family(), _max_thread_number(std::numeric_limits<size_t>::max()),
+      _durability(Durability::Async), _checkpoint_interval(),
+      _range_delete_min_count(0) {}
 
   PersistentQueue(rocksdb::DB* db, size_t max_thread_number = default_max_thread_number)
     : PersistentQueue() {
     Initialize(db, max_thread_number);
   }
 
-  void Initialize(rocksdb::DB* db, size_t max_thread_number = default_max_thread_number) {
-    if (_db)
-      throw Exception(
-        "Fatal error: attempt to initialize PersistentQueue for a second time",
-        CurrentLocation);
-
-    if (max_thread_number >= _conv.GetMaxId())
-      throw Exception("Maximum number of threads (" + std::to_string(max_thread_number)
-                        + ") is too large, no item would be able to exist in the queue",
-                      CurrentLocation);
-
-    _db = db;
-    _max_thread_number = max_thread_number;
-
-    auto it
-      = std::unique_ptr<rocksdb::Iterator>(_db->NewIterator(rocksdb::ReadOptions()));
-
-    TKey key = _conv.ToKey(0);
-    rocksdb::Slice slice = ToSlice(&key);
-
-    it->Seek(slice);
-
-    if (!it->Valid()) {
-      if (!it->status().ok())
-        throw Exception("Fatal error in RocksDB at `Iterator::Seek`: "
-                          + it->status().ToString(),
-                        CurrentLocation);
-
-      // Queue is empty, fine.
-      _head.store(0, std::memory_order_relaxed);
-      _next_tail.store(0, std::memory_order_relaxed);
-      return;
-    }
-
-    // Queue is not empty, we need to find the head and the tail
-
-    auto corrector = PersistentQueueIdCorrector<TKey>(
-      _conv.ToId(it->key()), _conv.GetMaxId(), _max_thread_number);
-
-    for (it->Next();; it->Next()) {
-      if (!it->Valid()) {
-        if (!it->status().ok())
-          throw Exception("Fatal error in RocksDB at `Iterator::Next`: "
-                            + it->status().ToString(),
-                          CurrentLocation);
-
-        if (!corrector.IsOverEnd())
-          break;
-
-        Seek(it, 0);
-      }
-
-      if (it->key().size() != sizeof(TKey))
-        throw Exception("Fatal queue data state: a found key size ("
-                          + std::to_string(it->key().size())
-                          + ") != the current key size ("
-                          + std::to_string(sizeof(TKey))
-                          + ")",
-                        CurrentLocation);
+  PersistentQueue(rocksdb::DB* db,
+                  rocksdb::ColumnFamilyHandle* column_family,
+                  size_t max_thread_number = default_max_thread_number)
+    : PersistentQueue() {
+    Initialize(db, column_family, max_thread_number);
+  }
 
-      const auto id = _conv.ToId(it->key());
+  PersistentQueue(rocksdb::DB* db, PersistentQueueOptions const& options)
+    : PersistentQueue() {
+    Initialize(db, options);
+  }
 
-      // Must happen at some point when the queue is over the end
-      if (id == corrector.head()) {
-        if (!corrector.IsOverEnd())
-          throw Exception(
-            "Fatal logic failure: tail has reached the queue's head while the queue is not over the end",
-            CurrentLocation);
-        break;
-      }
+  PersistentQueue(rocksdb::DB* db,
+                  rocksdb::ColumnFamilyHandle* column_family,
+                  PersistentQueueOptions const& options)
+    : PersistentQueue() {
+    Initialize(db, column_family, options);
+  }
 
-      // This `if` avoids a second check of IDs when the queue is over the end
-      if (corrector.IsOverEnd() && corrector.IsTailMax() && id == 0
-          && corrector.previous_checked_head() == 0) {
-        corrector.SetTailToPrevious();
-        break;
-      }
-      const auto next = corrector.FeedNext(id);
+  void Initialize(rocksdb::DB* db, size_t max_thread_number = default_max_thread_number) {
+    Initialize(db, db->DefaultColumnFamily(), max_thread_number);
+  }
 
-      // All good
-      if (id == next) {
-        continue;
-      }
+  void Initialize(rocksdb::DB* db, PersistentQueueOptions const& options) {
+    Initialize(db, db->DefaultColumnFamily(), options);
+  }
 
-      // Seems like there was a forcefull terminataion, some writes were not complete.
-      // We need to recover the queue's consistency by filling a gap in consecutive IDs.
-      ShiftUp(it, id, next);
-    }
+  void Initialize(rocksdb::DB* db,
+                  rocksdb::ColumnFamilyHandle* column_family,
+                  size_t max_thread_number = default_max_thread_number) {
+    auto options = PersistentQueueOptions();
+    options.max_thread_number = max_thread_number;
+    Initialize(db, column_family, options);
+  }
 
-    _head.store(corrector.head(), std::memory_order_relaxed);
-    if (corrector.IsTailMax())
-      _next_tail.store(0, std::memory_order_relaxed);
-    else
-      _next_tail.store(corrector.tail() + 1, std::memory_order_relaxed);
-    if (Size() > GetMaxSize())
-      throw Exception(
-        "Fatal queue data state: the queue is too full, cannot execute operations on this queue",
-        CurrentLocation);
+  /*
+   * Binds the queue to its own column family instead of sharing the default one with
+   * other queues. The queue gets its own memtables, compactions and options, and usually
+   * does not need a prefix (`TPrefix = NoPrefix`). Keys of the column family must not be
+   * used for anything else in the queue's key range. The handle must outlive the queue.
+   */
+  void Initialize(rocksdb::DB* db,
+                  rocksdb::ColumnFamilyHandle* column_family,
+                  PersistentQueueOptions const& options) {
+    Configure(db, column_family, options);
+    auto it = std::unique_ptr<rocksdb::Iterator>(
+      _db->NewIterator(rocksdb::ReadOptions(), _column_family));
+    Recover(*it);
   }
 
   PersistentQueue(PersistentQueue&& other)
-    : _db(other._db), _head(other._head.load(std::memory_order_relaxed)),
-      _next_tail(other._next_tail.load(std::memory_order_relaxed)) {}
+    : _db(other._db), _column_family(other._column_family),
+      _max_thread_number(other._max_thread_number), _durability(other._durability),
+      _checkpoint_interval(other._checkpoint_interval),
+      _recovery_info(other._recovery_info), _conv(other._conv),
+      _head(other._head.load(std::memory_order_relaxed)),
+      _next_tail(other._next_tail.load(std::memory_order_relaxed)),
+      _hot_cache(std::move(other._hot_cache)),
+      _lease_deadlines(std::move(other._lease_deadlines)),
+      _leases(std::move(other._leases)) {
+    other.StopMaintenance();
+    _range_delete_min_count = other._range_delete_min_count;
+    _compaction_threshold = other._compaction_threshold;
+    _compaction_check_interval = other._compaction_check_interval;
+    _drain_chunk_size = other._drain_chunk_size;
+    _drain_readahead_size = other._drain_readahead_size;
+    _stream_chunk_size = other._stream_chunk_size;
+    _next_stream_id.store(other._next_stream_id.load(std::memory_order_relaxed),
+                          std::memory_order_relaxed);
+    _push_sequence.store(other._push_sequence.load(std::memory_order_relaxed),
+                         std::memory_order_relaxed);
+    StartMaintenance();
+  }
+
+  // The queue must be destroyed before its database is closed
+  ~PersistentQueue() { StopMaintenance(); }
 
 #if defined(perq_WITH_STATS)
   Stats const& stats() { return _stats; };
 #endif
 
+  RecoveryInfo const& recovery_info() const { return _recovery_info; }
+
+  size_t max_thread_number() const { return _max_thread_number; }
+
   size_t Size() {
     const auto head = _head.load(std::memory_order_relaxed);
     const auto next_tail = _next_tail.load(std::memory_order_acquire);
-    if (next_tail < head)
-      return (_conv.GetMaxId() - head + 1) + next_tail;
-    else
-      return next_tail - head;
+    return Distance(head, next_tail);
   }
 
   std::pair<std::string, bool> Top() {
+    rocksdb::PinnableSlice value;
+    if (!Top(value))
+      return {"", false};
+    return {std::string(value.data(), value.size()), true};
+  }
+
+  /*
+   * Reads the head item into `value` without copying it, if possible the value stays
+   * pinned in the RocksDB block cache until `value` is reset or destroyed. Reusing the
+   * same `value` for consecutive calls avoids allocations.
+   */
+  bool Top(rocksdb::PinnableSlice& value) {
     TKey head;
     TKey key;
     rocksdb::Slice slice;
-    rocksdb::PinnableSlice pinned_value;
     rocksdb::Status status;
-    auto count = decltype(_yield_after){0};
+    auto backoff = TBackoff();
 
+    perq_TimeOperation(_stats.top_histograms);
     perq_LocalStats;
 
     while (true) {
@@ -195,24 +206,31 @@ public:
 
       if (head == _next_tail.load(std::memory_order_acquire)) {
         perq_MergeLocalStatsForTop;
-        return {"", false};
+        return false;
       }
 
-      if (count == _yield_after) {
+      if (backoff.Wait()) {
         perq_IncrementLocalYieldCount;
-        count = 0;
-        std::this_thread::yield();
       }
-      ++count;
+
+      value.Reset();
+
+      if (_hot_cache.IsEnabled()) {
+        if (_hot_cache.Get(head, value)) {
+          perq_IncrementLocalHotCacheHitCount;
+          perq_MergeLocalStatsForTop;
+          return true;
+        }
+        perq_IncrementLocalHotCacheMissCount;
+      }
 
       key = _conv.ToKey(head);
       slice = ToSlice(&key);
-      status = _db->Get(
-        rocksdb::ReadOptions(), _db->DefaultColumnFamily(), slice, &pinned_value);
+      status = CallDb(
+        [&] { return _db->Get(rocksdb::ReadOptions(), _column_family, slice, &value); });
 
       // If we picked up a key that just was deleted
       if (status.IsNotFound()) {
-        pinned_value.Reset();
         perq_IncrementLocalGetMissCount;
         continue;
       }
@@ -223,280 +241,2248 @@ public:
 
       perq_MergeLocalStatsForTop;
 
-      return {std::string(pinned_value.data(), pinned_value.size()), true};
+      return true;
     }
   }
 
-  bool Pop() {
-    TKey head;
-    TKey new_head;
-    TKey key;
-    rocksdb::Slice slice;
-    rocksdb::PinnableSlice pinned_value;
-    rocksdb::Status status;
-    auto count = decltype(_yield_after){0};
+  bool Pop() { return ConsumeOne(nullptr); }
 
-    head = _head.load(std::memory_order_relaxed);
+  std::pair<std::string, bool> Poll() {
+    auto ret = std::pair<std::string, bool>();
+    ret.second = Poll(ret.first);
+    return ret;
+  }
+
+  /*
+   * Polls the head item into `value` reusing its capacity. `value` is cleared when the
+   * queue is empty.
+   */
+  bool Poll(std::string& value) { return ConsumeOne(&value); }
+
+  /*
+   * Same as `Top`/`Poll`, but when the queue is empty the calling thread sleeps until an
+   * item is pushed or `timeout` expires. `Push` does not pay for waking up, unless there
+   * are waiting threads.
+   */
+  template <typename TRep, typename TPeriod>
+  std::pair<std::string, bool> TopWait(
+    std::chrono::duration<TRep, TPeriod> const& timeout) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (true) {
+      auto ret = Top();
+      if (ret.second || !WaitForItems(deadline))
+        return ret;
+    }
+  }
+
+  template <typename TRep, typename TPeriod>
+  std::pair<std::string, bool> PollWait(
+    std::chrono::duration<TRep, TPeriod> const& timeout) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (true) {
+      auto ret = Poll();
+      if (ret.second || !WaitForItems(deadline))
+        return ret;
+    }
+  }
+
+  /*
+   * Polls up to `max_number` items with one move of the head. Values are read with one
+   * `MultiGet` and removed with one `WriteBatch`, consumed IDs are deleted as a range
+   * when they do not go over the maximum ID. At most `max_thread_number` items are
+   * polled at once, see `ClaimBatch`.
+   */
+  std::vector<std::string> PollBatch(size_t max_number) {
+    std::vector<std::string> values;
+    ConsumeBatch(max_number, &values);
+    return values;
+  }
+
+  // Same as `PollBatch` above, but writes values to `out`, returns number of polled items
+  template <typename TOutputIterator>
+  size_t PollBatch(size_t max_number, TOutputIterator out) {
+    std::vector<std::string> values;
+    const auto number = ConsumeBatch(max_number, &values);
+    std::move(values.begin(), values.end(), out);
+    return number;
+  }
+
+  // Pops up to `max_number` items, returns number of popped items
+  size_t PopN(size_t max_number) { return ConsumeBatch(max_number, nullptr); }
+
+  /*
+   * Polls up to `max_number` items into `callback(rocksdb::Slice const& value)`, returns
+   * number of polled items. Meant for a single consumer catching up with a backlog: an
+   * iterator with read-ahead walks the consecutive keys from the head, instead of a `Get`
+   * per item. The head moves and consumed items are deleted once per chunk of
+   * `drain_chunk_size` items, at most `max_thread_number`, before their values are
+   * passed to `callback`, so a throwing `callback` loses the rest of its chunk like a
+   * failed `Poll` would.
+   *
+   * The drain stops at the tail seen when it started, or earlier at an item that is not
+   * written yet. Other consumers may run at the same time, they only make it slower: a
+   * chunk whose head they moved is read again from the new head, up to the tail seen
+   * then. Values are valid during the call of `callback` only.
+   */
+  template <typename TCallback>
+  size_t Drain(TCallback&& callback,
+               size_t max_number = std::numeric_limits<size_t>::max()) {
+    // Blocks read ahead are not worth keeping in the block cache, they are consumed
+    rocksdb::ReadOptions read_options;
+    read_options.readahead_size = _drain_readahead_size;
+    read_options.fill_cache = false;
+    read_options.pin_data = true;
+    std::unique_ptr<rocksdb::Iterator> it;
+
+    std::vector<rocksdb::Slice> values;
+    auto head = _head.load(std::memory_order_acquire);
+    auto next_tail = _next_tail.load(std::memory_order_acquire);
+    size_t drained = 0;
 
     perq_LocalStats;
 
-    do {
-      perq_IncrementLocalCasRepetitionCount;
+    while (drained < max_number) {
+      // The callback is not timed
+      {
+        perq_TimeOperation(_stats.drain_histograms);
 
-      if (head == _next_tail.load(std::memory_order_acquire)) {
-        perq_MergeLocalStatsForPop;
-        return false;
-      }
+        const auto number_to_tail = Distance(head, next_tail);
+        if (number_to_tail == 0)
+          break;
 
-      if (count == _yield_after) {
-        perq_IncrementLocalYieldCount;
-        count = 0;
-        std::this_thread::yield();
+        auto number = std::min(number_to_tail, max_number - drained);
+        number = std::min(number, _drain_chunk_size);
+
+        // Every chunk is read from a fresh snapshot, an older one might hold values of
+        // IDs that other consumers have consumed and producers have reused since
+        it.reset(_db->NewIterator(read_options, _column_family));
+
+        // Values of the run of existing items from the head
+        values.clear();
+        for (auto id = head; values.size() < number; id = Advance(id, 1)) {
+          auto key = _conv.ToKey(id);
+          if (values.empty() || id == 0)
+            it->Seek(ToSlice(&key));
+          else
+            it->Next();
+          if (!IsInRange(*it) || it->key() != ToSlice(&key))
+            break;
+          values.push_back(it->value());
+        }
+
+        if (values.empty())
+          break;
+
+        number = values.size();
+        perq_IncrementLocalCasRepetitionCount;
+        if (!std::atomic_compare_exchange_strong_explicit(&_head,
+                                                          &head,
+                                                          Advance(head, number),
+                                                          std::memory_order_acquire,
+                                                          std::memory_order_acquire)) {
+          // Other consumers moved the head, the tail is read again after it
+          next_tail = _next_tail.load(std::memory_order_acquire);
+          continue;
+        }
+
+        if (_hot_cache.IsEnabled()) {
+          for (size_t i = 0; i < number; ++i)
+            _hot_cache.Erase(Advance(head, i));
+        }
+
+        CountConsumed(number);
+
+        // The iterator keeps the values of deleted items
+        rocksdb::WriteBatch batch;
+        DeleteConsumed(batch, head, number);
+        const auto status
+          = CallDb([&] { return _db->Write(makeWriteOptions(), &batch); });
+        if (!status.ok())
+          throw Exception(
+            "Fatal error in RocksDB at `RocksDB::Write`: " + status.ToString(),
+            CurrentLocation);
+
+        CommitWrite();
+
+        drained += number;
+        head = Advance(head, number);
       }
-      ++count;
 
-      pinned_value.Reset();
+      for (auto const& value : values)
+        callback(value);
+    }
 
-      if (head == _conv.GetMaxId())
-        new_head = 0;
-      else
-        new_head = head + 1;
+    perq_MergeLocalStatsForPoll;
 
-      key = _conv.ToKey(head);
-      slice = ToSlice(&key);
-      status = _db->Get(
-        rocksdb::ReadOptions(), _db->DefaultColumnFamily(), slice, &pinned_value);
+    return drained;
+  }
 
-      // May happen in a case when `Push` has incremented `tail`, but
-      // has not started/finished the write operation or when other `Poll` deleted it already
-      if (status.IsNotFound()) {
-        perq_IncrementLocalGetMissCount;
-        continue;
+  /*
+   * Takes up to `max_number` items from the head for processing, returns their IDs and
+   * values. Every item is read once and moved to a lease record in the same
+   * `WriteBatch`, so several consumers can process items in parallel.
+   *
+   * A leased item must be confirmed with `Ack` or returned with `Nack`. If neither
+   * happens within `visibility_timeout`, the item is pushed to the tail again by a later
+   * `Lease` or `ReclaimExpiredLeases`. Lease records survive a restart, the next
+   * `Initialize` pushes all of them to the tail again.
+   *
+   * A leased ID blocks the head when the queue wraps around to it again, so leases should
+   * not be held while the whole ID space is being pushed.
+   */
+  template <typename TRep, typename TPeriod>
+  std::vector<std::pair<TKey, std::string>> Lease(
+    size_t max_number, std::chrono::duration<TRep, TPeriod> const& visibility_timeout) {
+    perq_TimeOperation(_stats.lease_histograms);
+
+    ReclaimExpiredLeases();
+
+    std::vector<std::pair<TKey, std::string>> items;
+    Claim claim;
+    const auto number = ClaimBatch(max_number, true, true, claim);
+    if (number == 0)
+      return items;
+
+    rocksdb::WriteBatch batch;
+    DeleteConsumed(batch, claim.head, number);
+    for (size_t i = 0; i < number; ++i)
+      batch.Put(_column_family, ToLeaseKey(Advance(claim.head, i)), claim.values[i]);
+
+    const auto status = CallDb([&] { return _db->Write(makeWriteOptions(), &batch); });
+    if (!status.ok()) {
+      {
+        std::lock_guard<std::mutex> lock(_lease_mutex);
+        for (size_t i = 0; i < number; ++i)
+          EraseLease(_leases.find(Advance(claim.head, i)));
       }
+      throw Exception("Fatal error in RocksDB at `RocksDB::Write`: " + status.ToString(),
+                      CurrentLocation);
+    }
 
-      if (!status.ok())
-        throw Exception("Fatal error in RocksDB at `RocksDB::Get`: " + status.ToString(),
-                        CurrentLocation);
+    CommitWrite();
 
-    } while (!std::atomic_compare_exchange_weak_explicit(
-      &_head, &head, new_head, std::memory_order_acquire, std::memory_order_acquire));
+    const auto deadline
+      = std::chrono::steady_clock::now()
+      + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          visibility_timeout);
 
-    pinned_value.Reset();
-    status = _db->Delete(makeWriteOptions(), slice);
-    if (!status.ok())
+    items.reserve(number);
+    {
+      std::lock_guard<std::mutex> lock(_lease_mutex);
+      for (size_t i = 0; i < number; ++i) {
+        const auto id = Advance(claim.head, i);
+        SetLeaseDeadline(_leases.find(id), deadline);
+        items.emplace_back(id, std::move(claim.values[i]));
+      }
+    }
+
+    return items;
+  }
+
+  /*
+   * Removes a leased item for good, returns `false` if `id` is not leased, e.g. its lease
+   * expired and the item is being pushed to the tail again.
+   */
+  bool Ack(TKey id) {
+    std::chrono::steady_clock::time_point deadline;
+    if (!AcquireLease(id, deadline))
+      return false;
+
+    const auto status = CallDb(
+      [&] { return _db->Delete(makeWriteOptions(), _column_family, ToLeaseKey(id)); });
+    if (!status.ok()) {
+      ReleaseLease(id, deadline);
       throw Exception("Fatal error in RocksDB at `RocksDB::Delete`: " + status.ToString(),
                       CurrentLocation);
+    }
 
-    perq_MergeLocalStatsForPop;
+    {
+      std::lock_guard<std::mutex> lock(_lease_mutex);
+      EraseLease(_leases.find(id));
+    }
+
+    CommitWrite();
 
     return true;
   }
 
-  std::pair<std::string, bool> Poll() {
-    TKey head;
-    TKey new_head;
-    TKey key;
-    rocksdb::Slice slice;
-    rocksdb::PinnableSlice pinned_value;
-    rocksdb::Status status;
-    auto count = decltype(_yield_after){0};
+  /*
+   * Pushes a leased item to the tail of the queue again. Returns `false` if `id` is not
+   * leased or the queue is full, the lease stays in place in the latter case.
+   */
+  bool Nack(TKey id) {
+    std::chrono::steady_clock::time_point deadline;
+    if (!AcquireLease(id, deadline))
+      return false;
 
-    head = _head.load(std::memory_order_relaxed);
+    if (!RequeueLease(id, deadline))
+      return false;
 
-    perq_LocalStats;
+    CommitWrite();
 
-    do {
-      perq_IncrementLocalCasRepetitionCount;
+    return true;
+  }
 
-      if (head == _next_tail.load(std::memory_order_acquire)) {
-        perq_MergeLocalStatsForPoll;
-        return {"", false};
+  /*
+   * Pushes leased items whose visibility timeout has passed to the tail again, returns
+   * their number. `Lease` calls it too, consumers that only `Ack` can call it
+   * periodically so expired items do not wait for the next `Lease`. Items stay leased
+   * while the queue is full.
+   */
+  size_t ReclaimExpiredLeases() {
+    std::vector<std::pair<TKey, std::chrono::steady_clock::time_point>> expired;
+    {
+      const auto now = std::chrono::steady_clock::now();
+      std::lock_guard<std::mutex> lock(_lease_mutex);
+      while (!_lease_deadlines.empty() && _lease_deadlines.begin()->first <= now) {
+        const auto it = _leases.find(_lease_deadlines.begin()->second);
+        expired.emplace_back(it->first, it->second->first);
+        SetLeaseDeadline(it, std::chrono::steady_clock::time_point::max());
       }
+    }
 
-      if (count == _yield_after) {
-        perq_IncrementLocalYieldCount;
-        count = 0;
-        std::this_thread::yield();
+    size_t requeued = 0;
+    for (size_t i = 0; i < expired.size(); ++i) {
+      try {
+        if (!RequeueLease(expired[i].first, expired[i].second)) {
+          // The queue is full, the rest stays expired for the next call
+          for (++i; i < expired.size(); ++i)
+            ReleaseLease(expired[i].first, expired[i].second);
+          break;
+        }
       }
-      ++count;
-
-      pinned_value.Reset();
+      catch (...) {
+        for (++i; i < expired.size(); ++i)
+          ReleaseLease(expired[i].first, expired[i].second);
+        throw;
+      }
+      ++requeued;
+    }
 
-      if (head == _conv.GetMaxId())
-        new_head = 0;
-      else
-        new_head = head + 1;
+    if (requeued)
+      CommitWrite();
 
-      key = _conv.ToKey(head);
-      slice = ToSlice(&key);
-      status = _db->Get(
-        rocksdb::ReadOptions(), _db->DefaultColumnFamily(), slice, &pinned_value);
+    return requeued;
+  }
 
-      // May happen in a case when `Push` has incremented `tail`, but
-      // has not started/finished the write operation or when other `Poll` deleted it already
-      if (status.IsNotFound()) {
-        perq_IncrementLocalGetMissCount;
-        continue;
-      }
+  // Number of leased items that are neither acknowledged nor returned yet
+  size_t LeaseSize() {
+    std::lock_guard<std::mutex> lock(_lease_mutex);
+    return _leases.size();
+  }
 
-      if (!status.ok())
-        throw Exception("Fatal error in RocksDB at `RocksDB::Get`: " + status.ToString(),
-                        CurrentLocation);
+  /*
+   * Copies the stats, the head, the tail and RocksDB properties of the column family,
+   * see `StatsExport.hpp` for exporters. Cheap enough to be called periodically while
+   * the queue is under load.
+   */
+  QueueSnapshot Snapshot() {
+    QueueSnapshot snapshot;
+    snapshot.time = std::chrono::steady_clock::now();
+    const auto head = _head.load(std::memory_order_relaxed);
+    const auto next_tail = _next_tail.load(std::memory_order_acquire);
+    snapshot.head = head;
+    snapshot.tail = next_tail;
+    snapshot.size = Distance(head, next_tail);
+    snapshot.lease_size = LeaseSize();
+
+    snapshot.pending_compaction_bytes
+      = GetIntProperty("rocksdb.estimate-pending-compaction-bytes");
+    snapshot.memtable_bytes = GetIntProperty("rocksdb.cur-size-all-mem-tables");
+    snapshot.memtable_delete_number
+      = GetIntProperty("rocksdb.num-deletes-active-mem-table")
+      + GetIntProperty("rocksdb.num-deletes-imm-mem-tables");
+    snapshot.estimated_key_number = GetIntProperty("rocksdb.estimate-num-keys");
 
-    } while (!std::atomic_compare_exchange_weak_explicit(
-      &_head, &head, new_head, std::memory_order_acquire, std::memory_order_acquire));
+#if defined(perq_WITH_STATS)
+    snapshot.is_with_stats = true;
+    snapshot.stats = _stats.Snapshot();
+#endif
 
-    auto ret = std::pair<std::string, bool>(
-      std::string(pinned_value.data(), pinned_value.size()), true);
-    pinned_value.Reset();
+    return snapshot;
+  }
 
-    status = _db->Delete(makeWriteOptions(), slice);
+  /*
+   * Persists the current head and tail, so the next `Initialize` checks only the IDs
+   * around them instead of scanning the whole queue. Should be called before a clean
+   * shutdown, with `checkpoint_interval` it is also called periodically by `Push`.
+   */
+  void Checkpoint() {
+    const TKey keys[] = {_conv.ToKey(_head.load(std::memory_order_acquire)),
+                         _conv.ToKey(_next_tail.load(std::memory_order_acquire))};
+    const auto value = rocksdb::Slice(reinterpret_cast<char const*>(keys), sizeof(keys));
+    const auto status = CallDb([&] {
+      return _db->Put(makeWriteOptions(), _column_family, ToAuxiliaryKey('C'), value);
+    });
     if (!status.ok())
-      throw Exception("Fatal error in RocksDB at `RocksDB::Delete`: " + status.ToString(),
+      throw Exception("Fatal error in RocksDB at `RocksDB::Put`: " + status.ToString(),
                       CurrentLocation);
 
-    perq_MergeLocalStatsForPoll;
-
-    return ret;
+    CommitWrite();
   }
 
-  bool Push(const std::string& value) {
-    TKey next_tail;
-    TKey new_next_tail;
-    auto count = decltype(_yield_after){0};
-
-    next_tail = _next_tail.load(std::memory_order_relaxed);
-
-    perq_LocalStats;
+  bool Push(const std::string& value) { return Push(rocksdb::Slice(value)); }
 
-    do {
-      perq_IncrementLocalCasRepetitionCount;
+  bool Push(std::string&& value) { return Push(rocksdb::Slice(value)); }
 
-      if (count == _yield_after) {
-        perq_IncrementLocalYieldCount;
-        count = 0;
-        std::this_thread::yield();
-      }
-      ++count;
+  bool Push(char const* value) { return Push(rocksdb::Slice(value)); }
 
-      if (next_tail == _conv.GetMaxId())
-        new_next_tail = 0;
-      else
-        new_next_tail = next_tail + 1;
+  bool Push(char const* data, size_t size) { return Push(rocksdb::Slice(data, size)); }
 
-      auto head = _head.load(std::memory_order_acquire);
+  bool Push(rocksdb::Slice const& value) {
+    TKey id;
+    uint64_t sequence = 0;
 
-      auto size = size_t{0};
-      if (next_tail < head)
-        size = (_conv.GetMaxId() - head + 1) + next_tail;
-      else
-        size = next_tail - head;
+    perq_TimeOperation(_stats.push_histograms);
+    perq_RecordValueSize(value.size());
 
-      if ((size + 1) >= GetMaxSize()) {
-        perq_MergeLocalStatsForPush;
-        return false;
-      }
-    } while (!std::atomic_compare_exchange_weak_explicit(&_next_tail,
-                                                         &next_tail,
-                                                         new_next_tail,
-                                                         std::memory_order_acquire,
-                                                         std::memory_order_acquire));
+    if (!Reserve(1, id, sequence))
+      return false;
 
-    next_tail = _conv.ToKey(next_tail);
-    const auto status = _db->Put(makeWriteOptions(), ToSlice(&next_tail), value);
+    auto key = _conv.ToKey(id);
+    const auto status = CallDb(
+      [&] { return _db->Put(makeWriteOptions(), _column_family, ToSlice(&key), value); });
     if (!status.ok())
       throw Exception("Fatal error in RocksDB at `RocksDB::Put`: " + status.ToString(),
                       CurrentLocation);
 
-    perq_MergeLocalStatsForPush;
+    CommitWrite();
+
+    CacheValue(id, sequence, value);
+    NotifyWaiters();
+    CheckpointPeriodically(id, 1);
 
     return true;
   }
 
-private:
-  void ShiftUp(std::unique_ptr<rocksdb::Iterator>& it, TKey from_id, TKey to_id) {
-    auto from_key = _conv.ToKey(from_id);
-    auto to_key = _conv.ToKey(to_id);
-    Move(from_key, to_key);
-    Seek(it, to_key);
-    perq_IncrementShiftUpCount;
-  }
+  /*
+   * Pushes one value gathered from several parts (e.g. a header and a body) without
+   * concatenating them first.
+   */
+  bool Push(rocksdb::SliceParts const& value) {
+    TKey id;
+    uint64_t sequence = 0;
 
-  void Move(TKey sourceKey, TKey destinationKey) {
-    auto sourceKeySlice = ToSlice(&sourceKey);
-    auto destinationKeySlice = ToSlice(&destinationKey);
-    std::string value;
-    auto status = _db->Get(rocksdb::ReadOptions(), sourceKeySlice, &value);
-    if (!status.ok())
-      throw Exception("Fatal error in RocksDB at `RocksDB::Get`: " + status.ToString(),
-                      CurrentLocation);
+    perq_TimeOperation(_stats.push_histograms);
+    perq_RecordValueSize(ToSize(value));
+
+    if (!Reserve(1, id, sequence))
+      return false;
+
+    auto key = _conv.ToKey(id);
+    const auto key_slice = ToSlice(&key);
     rocksdb::WriteBatch batch;
-    batch.Delete(sourceKeySlice);
-    batch.Put(destinationKeySlice, value);
-    rocksdb::WriteOptions write_options = {};
-    write_options.sync = true;
-    status = _db->Write(write_options, &batch);
+    batch.Put(_column_family, rocksdb::SliceParts(&key_slice, 1), value);
+    const auto status = CallDb([&] { return _db->Write(makeWriteOptions(), &batch); });
     if (!status.ok())
       throw Exception("Fatal error in RocksDB at `RocksDB::Write`: " + status.ToString(),
                       CurrentLocation);
+
+    CommitWrite();
+
+    CacheValue(id, sequence, value);
+    NotifyWaiters();
+    CheckpointPeriodically(id, 1);
+
+    return true;
   }
 
-  void Seek(std::unique_ptr<rocksdb::Iterator>& it, TKey key) {
-    // Better to reset iterator, recommended by RocksDB development
-    it.reset(_db->NewIterator(rocksdb::ReadOptions()));
-    it->Seek(ToSlice(&key));
-    if (!it->Valid())
-      throw Exception("Fatal logic failure: failed to seek a key that must exist",
+  /*
+   * Pushes all values of the range with one reservation of consecutive IDs and one
+   * `WriteBatch`. Either all values are pushed or none, `false` is returned when the
+   * queue has no room for the whole range.
+   *
+   * The batch is written atomically, so a crash can leave at most a gap of the batch
+   * size in IDs. Crash recovery tolerates gaps of up to `max_thread_number` IDs in total,
+   * so `max_thread_number` must account for all IDs that can be reserved concurrently
+   * (e.g. number of producers multiplied by the largest batch size).
+   */
+  template <typename TIterator>
+  bool PushBatch(TIterator first, TIterator last) {
+    const auto number = static_cast<size_t>(std::distance(first, last));
+    if (number == 0)
+      return true;
+
+    if (number > _max_thread_number)
+      throw Exception("Batch size (" + std::to_string(number)
+                        + ") is greater than the maximum number of threads ("
+                        + std::to_string(_max_thread_number)
+                        + "), the queue would not be recoverable after a crash",
                       CurrentLocation);
-  }
 
-  rocksdb::Slice ToSlice(TKey* key) {
-    return rocksdb::Slice(reinterpret_cast<char*>(key), sizeof(TKey));
-  }
+    TKey first_id;
+    uint64_t sequence = 0;
 
-  rocksdb::WriteOptions makeWriteOptions() {
-    rocksdb::WriteOptions options;
+    perq_TimeOperation(_stats.push_batch_histograms);
 
-    // From RocksDB doc:
-    // By default, each write to leveldb is asynchronous: it returns after pushing the
-    // write from the process into the operating system. The transfer from operating
-    // system memory to the underlying persistent storage happens asynchronously. The
+    if (!Reserve(number, first_id, sequence))
+      return false;
+
+    rocksdb::WriteBatch batch;
+    TKey key;
+    auto id = first_id;
+    for (auto it = first; it != last; ++it) {
+      key = _conv.ToKey(id);
+      batch.Put(_column_family, ToSlice(&key), *it);
+      perq_RecordValueSize(ToSize(*it));
+      id = Advance(id, 1);
+    }
+
+    const auto status = CallDb([&] { return _db->Write(makeWriteOptions(), &batch); });
+    if (!status.ok())
+      throw Exception("Fatal error in RocksDB at `RocksDB::Write`: " + status.ToString(),
+                      CurrentLocation);
+
+    CommitWrite();
+
+    if (_hot_cache.IsEnabled()) {
+      id = first_id;
+      for (auto it = first; it != last; ++it) {
+        CacheValue(id, sequence++, *it);
+        id = Advance(id, 1);
+      }
+    }
+
+    NotifyWaiters();
+    CheckpointPeriodically(first_id, number);
+
+    return true;
+  }
+
+  template <typename TRange>
+  bool PushBatch(TRange const& values) {
+    return PushBatch(std::begin(values), std::end(values));
+  }
+
+  /*
+   * Pushes a value read from `source` in chunks of `stream_chunk_size` bytes, the whole
+   * value is never held in memory. `source(char* data, size_t size)` fills `data` with
+   * up to `size` bytes and returns their number, zero at the end of the value.
+   *
+   * Chunks are written under a stream ID of their own before an item ID is reserved, so
+   * consumers are not held back by a long upload. The item refers to the chunks and is
+   * written together with the removal of the stream's pending mark, chunks of a stream
+   * left pending by a crash are deleted by the next `Initialize`. Returns `false` if the
+   * queue is full, the chunks are deleted then.
+   *
+   * Items of streams must be read with `PollStream`. Other consumers, `Poll`,
+   * `PollBatch`, `Drain` and `Lease`, are not supported for them: they return the stream
+   * reference as the value and leave the chunks, which are deleted by the next
+   * `Initialize`.
+   */
+  template <typename TSource>
+  bool PushStream(TSource&& source) {
+    if (Size() + 1 >= GetMaxSize())
+      return false;
+
+    const auto stream_id = _next_stream_id.fetch_add(1, std::memory_order_relaxed);
+    StreamReference reference = {stream_id, 0, 0};
+
+    WriteStreamMark(stream_id);
+    try {
+      auto buffer = std::string(_stream_chunk_size, '\0');
+      while (true) {
+        size_t filled = 0;
+        while (filled < buffer.size()) {
+          const auto number = source(&buffer[filled], buffer.size() - filled);
+          if (number == 0)
+            break;
+          filled += number;
+        }
+        if (filled == 0)
+          break;
+
+        if (reference.chunk_number == std::numeric_limits<uint32_t>::max())
+          throw Exception("Stream has too many chunks", CurrentLocation);
+
+        // Not synced: the write-ahead log is synced in order, so the synced write of the
+        // item also persists its chunks. Chunks without an item are deleted on recovery.
+        const auto status = CallDb([&] {
+          return _db->Put(makeUnsyncedWriteOptions(),
+                          _column_family,
+                          ToStreamChunkKey(stream_id, reference.chunk_number),
+                          rocksdb::Slice(buffer.data(), filled));
+        });
+        if (!status.ok())
+          throw Exception(
+            "Fatal error in RocksDB at `RocksDB::Put`: " + status.ToString(),
+            CurrentLocation);
+
+        ++reference.chunk_number;
+        reference.size += filled;
+        if (filled < buffer.size())
+          break;
+      }
+
+      TKey id;
+      uint64_t sequence = 0;
+      if (!Reserve(1, id, sequence)) {
+        DeleteStream(stream_id);
+        return false;
+      }
+
+      const auto value = EncodeStreamReference(reference);
+      auto key = _conv.ToKey(id);
+      rocksdb::WriteBatch batch;
+      batch.Put(_column_family, ToSlice(&key), value);
+      batch.Put(_column_family, ToStreamRecordKey(stream_id), ToSlice(&key));
+      batch.Delete(_column_family, ToStreamMarkKey(stream_id));
+      const auto status = CallDb([&] { return _db->Write(makeWriteOptions(), &batch); });
+      if (!status.ok())
+        throw Exception(
+          "Fatal error in RocksDB at `RocksDB::Write`: " + status.ToString(),
+          CurrentLocation);
+
+      CommitWrite();
+
+      CacheValue(id, sequence, rocksdb::Slice(value));
+      NotifyWaiters();
+      CheckpointPeriodically(id, 1);
+    }
+    catch (...) {
+      DeleteStream(stream_id);
+      throw;
+    }
+
+    return true;
+  }
+
+  /*
+   * Polls the head item pushed with `PushStream`, `sink(rocksdb::Slice chunk)` receives
+   * its chunks in order, one chunk is in memory at a time. Returns `false` if the queue
+   * is empty, throws without consuming it if the head item was not pushed with
+   * `PushStream`.
+   *
+   * Like `Poll` the item is removed before it is delivered: its removal and a pending
+   * mark of its stream are written together, the chunks are deleted after the last one
+   * is passed to `sink` or when `sink` throws, after a crash by the next `Initialize`.
+   */
+  template <typename TSink>
+  bool PollStream(TSink&& sink) {
+    TKey head;
+    StreamReference reference;
+    if (!ClaimStream(head, reference))
+      return false;
+
+    rocksdb::WriteBatch batch;
+    DeleteConsumed(batch, head, 1);
+    batch.Put(_column_family, ToStreamMarkKey(reference.stream_id), rocksdb::Slice());
+    const auto status = CallDb([&] { return _db->Write(makeWriteOptions(), &batch); });
+    if (!status.ok())
+      throw Exception("Fatal error in RocksDB at `RocksDB::Write`: " + status.ToString(),
+                      CurrentLocation);
+
+    CommitWrite();
+
+    try {
+      // Chunks are read once, they would only evict hot blocks from the block cache
+      rocksdb::ReadOptions read_options;
+      read_options.fill_cache = false;
+      rocksdb::PinnableSlice chunk;
+      for (uint32_t i = 0; i < reference.chunk_number; ++i) {
+        chunk.Reset();
+        const auto chunk_status = CallDb([&] {
+          return _db->Get(read_options,
+                          _column_family,
+                          ToStreamChunkKey(reference.stream_id, i),
+                          &chunk);
+        });
+        if (!chunk_status.ok())
+          throw Exception("Fatal error in RocksDB at `RocksDB::Get` of a stream chunk: "
+                            + chunk_status.ToString(),
+                          CurrentLocation);
+        sink(rocksdb::Slice(chunk.data(), chunk.size()));
+      }
+    }
+    catch (...) {
+      DeleteStream(reference.stream_id);
+      throw;
+    }
+
+    DeleteStream(reference.stream_id);
+    return true;
+  }
+
+private:
+  friend struct internal::QueueAccess;
+
+  /*
+   * Initializes a queue of `QueueRegistry`, a level of `PriorityPersistentQueue` or a
+   * shard of `ShardedPersistentQueue`: `prefix` replaces `prefixValue`, and the queue is
+   * recovered with the owner's iterator, which goes over the prefixes of all its queues.
+   */
+  void Initialize(rocksdb::DB* db,
+                  rocksdb::ColumnFamilyHandle* column_family,
+                  PersistentQueueOptions const& options,
+                  TPrefix prefix,
+                  rocksdb::Iterator& it) {
+    Configure(db, column_family, options);
+    _conv = PrefixedNumericalKeyConverter<TKey, TPrefix>(prefix);
+    Recover(it);
+  }
+
+  void Configure(rocksdb::DB* db,
+                 rocksdb::ColumnFamilyHandle* column_family,
+                 PersistentQueueOptions const& options) {
+    if (_db)
+      throw Exception(
+        "Fatal error: attempt to initialize PersistentQueue for a second time",
+        CurrentLocation);
+
+    const auto max_thread_number = options.max_thread_number
+      ? options.max_thread_number
+      : default_max_thread_number;
+
+    if (max_thread_number >= _conv.GetMaxId())
+      throw Exception("Maximum number of threads (" + std::to_string(max_thread_number)
+                        + ") is too large, no item would be able to exist in the queue",
+                      CurrentLocation);
+
+    _db = db;
+    _column_family = column_family;
+    _max_thread_number = max_thread_number;
+    _durability = options.durability;
+    _hot_cache.Reset(options.hot_cache_capacity, options.hot_cache_max_value_size);
+
+    _checkpoint_interval = options.checkpoint_interval;
+    _range_delete_min_count = options.range_delete_min_count;
+    _compaction_threshold = options.compaction_threshold;
+    _compaction_check_interval = options.compaction_check_interval;
+    // A chunk moves the head like a claim of `ClaimBatch`
+    _drain_chunk_size = std::min(
+      options.drain_chunk_size ? options.drain_chunk_size : size_t(1), max_thread_number);
+    _drain_readahead_size = options.drain_readahead_size;
+    _stream_chunk_size = options.stream_chunk_size ? options.stream_chunk_size : 1;
+  }
+
+  // Finds the head and the tail, `it` is only used within the queue's key range
+  void Recover(rocksdb::Iterator& it) {
+    const auto start = std::chrono::steady_clock::now();
+    _recovery_info = RecoveryInfo();
+    _recovery_info.is_from_checkpoint = InitializeFromCheckpoint(it);
+    if (!_recovery_info.is_from_checkpoint)
+      InitializeFromScan(it);
+    _recovery_info.duration = std::chrono::steady_clock::now() - start;
+
+    if (Size() > GetMaxSize())
+      throw Exception(
+        "Fatal queue data state: the queue is too full, cannot execute operations on this queue",
+        CurrentLocation);
+
+    LoadLeases(it);
+    RecoverStreams(it);
+    ReclaimExpiredLeases();
+
+    if (_checkpoint_interval)
+      Checkpoint();
+
+    StartMaintenance();
+  }
+
+  // Reserves `number` consecutive IDs starting from the current tail, `first_id` receives
+  // the first reserved ID and `sequence` the push sequence of the first ID. The sequence
+  // is only counted with the hot cache.
+  bool Reserve(size_t number, TKey& first_id, uint64_t& sequence) {
+    TKey next_tail;
+    TKey new_next_tail;
+    auto backoff = TBackoff();
+
+    next_tail = _next_tail.load(std::memory_order_relaxed);
+
+    perq_LocalStats;
+
+    do {
+      perq_IncrementLocalCasRepetitionCount;
+
+      if (backoff.Wait()) {
+        perq_IncrementLocalYieldCount;
+      }
+
+      new_next_tail = Advance(next_tail, number);
+
+      const auto head = _head.load(std::memory_order_acquire);
+
+      if ((Distance(head, next_tail) + number) >= GetMaxSize()) {
+        perq_MergeLocalStatsForPush;
+        return false;
+      }
+
+      // Taken after `next_tail` is loaded, so a later reservation of the same ID always
+      // gets a greater sequence
+      if (_hot_cache.IsEnabled())
+        sequence = _push_sequence.fetch_add(number, std::memory_order_relaxed);
+    } while (!std::atomic_compare_exchange_weak_explicit(&_next_tail,
+                                                         &next_tail,
+                                                         new_next_tail,
+                                                         std::memory_order_seq_cst,
+                                                         std::memory_order_acquire));
+
+    perq_MergeLocalStatsForPush;
+
+    first_id = next_tail;
+    return true;
+  }
+
+  // Consumes the head item. Polls if `value` is provided, otherwise pops. The delete of
+  // the item is added to `batch` if provided, so it is written with the caller's records.
+  bool ConsumeOne(std::string* value, rocksdb::WriteBatch* batch = nullptr) {
+    TKey head;
+    TKey new_head;
+    TKey key;
+    rocksdb::Slice slice;
+    std::string self_space;
+    // Values that cannot be pinned are read directly into the caller's buffer
+    rocksdb::PinnableSlice pinned_value(value ? value : &self_space);
+    rocksdb::Status status;
+    auto backoff = TBackoff();
+
+    perq_TimeOperation(value ? _stats.poll_histograms : _stats.pop_histograms);
+
+    head = _head.load(std::memory_order_relaxed);
+
+    perq_LocalStats;
+
+    while (true) {
+      if (head == _next_tail.load(std::memory_order_acquire)) {
+        if (value) {
+          value->clear();
+          perq_MergeLocalStatsForPoll;
+        }
+        else {
+          perq_MergeLocalStatsForPop;
+        }
+        return false;
+      }
+
+      if (backoff.Wait()) {
+        perq_IncrementLocalYieldCount;
+      }
+
+      pinned_value.Reset();
+
+      new_head = Advance(head, 1);
+
+      key = _conv.ToKey(head);
+      slice = ToSlice(&key);
+
+      if (_hot_cache.IsEnabled()) {
+        if (value ? _hot_cache.Get(head, *value) : _hot_cache.Contains(head)) {
+          perq_IncrementLocalHotCacheHitCount;
+          perq_IncrementLocalCasRepetitionCount;
+          if (std::atomic_compare_exchange_weak_explicit(&_head,
+                                                         &head,
+                                                         new_head,
+                                                         std::memory_order_acquire,
+                                                         std::memory_order_acquire))
+            break;
+          continue;
+        }
+        perq_IncrementLocalHotCacheMissCount;
+      }
+
+      status = CallDb([&] {
+        return _db->Get(rocksdb::ReadOptions(), _column_family, slice, &pinned_value);
+      });
+
+      // May happen in a case when `Push` has incremented `tail`, but
+      // has not started/finished the write operation or when other `Poll` deleted it
+      // already. The head must not be moved over an item that does not exist yet.
+      if (status.IsNotFound()) {
+        perq_IncrementLocalGetMissCount;
+        head = _head.load(std::memory_order_acquire);
+        continue;
+      }
+
+      if (!status.ok())
+        throw Exception("Fatal error in RocksDB at `RocksDB::Get`: " + status.ToString(),
+                        CurrentLocation);
+
+      perq_IncrementLocalCasRepetitionCount;
+
+      if (std::atomic_compare_exchange_weak_explicit(&_head,
+                                                     &head,
+                                                     new_head,
+                                                     std::memory_order_acquire,
+                                                     std::memory_order_acquire))
+        break;
+    }
+
+    if (value && pinned_value.IsPinned())
+      value->assign(pinned_value.data(), pinned_value.size());
+    pinned_value.Reset();
+
+    if (_hot_cache.IsEnabled())
+      _hot_cache.Erase(head);
+
+    CountConsumed(1);
+
+    rocksdb::WriteBatch own_batch;
+    auto& write_batch = batch ? *batch : own_batch;
+    DeleteConsumed(write_batch, head, 1);
+    status = CallDb([&] { return _db->Write(makeWriteOptions(), &write_batch); });
+    if (!status.ok())
+      throw Exception("Fatal error in RocksDB at `RocksDB::Write`: " + status.ToString(),
+                      CurrentLocation);
+
+    CommitWrite();
+
+    if (value) {
+      perq_MergeLocalStatsForPoll;
+    }
+    else {
+      perq_MergeLocalStatsForPop;
+    }
+
+    return true;
+  }
+
+  // Consumes a run of up to `max_number` items from the head. Polls if `values` is
+  // provided, otherwise pops.
+  size_t ConsumeBatch(size_t max_number, std::vector<std::string>* values) {
+    perq_TimeOperation(values ? _stats.poll_batch_histograms
+                              : _stats.pop_batch_histograms);
+
+    Claim claim;
+    const auto number = ClaimBatch(max_number, values != nullptr, false, claim);
+    if (number == 0)
+      return 0;
+
+    if (values) {
+      if (values->empty())
+        values->swap(claim.values);
+      else
+        std::move(claim.values.begin(), claim.values.end(), std::back_inserter(*values));
+    }
+
+    rocksdb::WriteBatch batch;
+    DeleteConsumed(batch, claim.head, number);
+
+    const auto status = CallDb([&] { return _db->Write(makeWriteOptions(), &batch); });
+    if (!status.ok())
+      throw Exception("Fatal error in RocksDB at `RocksDB::Write`: " + status.ToString(),
+                      CurrentLocation);
+
+    CommitWrite();
+
+    return number;
+  }
+
+  /*
+   * Adds deletes of `number` consumed IDs from `head` to `batch`. Runs of at least
+   * `range_delete_min_count` IDs are deleted with one range tombstone instead of a
+   * tombstone per key, a run over the maximum ID needs two of them.
+   */
+  void DeleteConsumed(rocksdb::WriteBatch& batch, TKey head, size_t number) {
+    if (_range_delete_min_count == 0 || number < _range_delete_min_count) {
+      TKey key;
+      for (size_t i = 0; i < number; ++i) {
+        key = _conv.ToKey(Advance(head, i));
+        batch.Delete(_column_family, ToSlice(&key));
+      }
+      return;
+    }
+
+    auto begin_key = _conv.ToKey(head);
+    const auto left = Distance(head, _conv.GetMaxId());
+    if (number <= left) {
+      auto end_key = _conv.ToKey(Advance(head, number));
+      batch.DeleteRange(_column_family, ToSlice(&begin_key), ToSlice(&end_key));
+      perq_IncrementRangeDeleteCount;
+      return;
+    }
+
+    // Up to the maximum ID inclusive, auxiliary records are not affected
+    batch.DeleteRange(_column_family, ToSlice(&begin_key), ToEndKey());
+    begin_key = _conv.ToKey(0);
+    auto end_key = _conv.ToKey(Advance(head, number));
+    batch.DeleteRange(_column_family, ToSlice(&begin_key), ToSlice(&end_key));
+    perq_IncrementRangeDeleteCount;
+    perq_IncrementRangeDeleteCount;
+  }
+
+  // A run of items taken from the head by `ClaimBatch`
+  struct Claim {
+    TKey head = 0;
+    std::vector<TKey> keys;
+    std::vector<std::string> values;
+  };
+
+  /*
+   * Moves the head over a run of up to `max_number` existing items and reads their
+   * values, returns the number of items. Removing the items from RocksDB is up to the
+   * caller. With `is_lease` the run stops before an ID that is still leased. `is_poll`
+   * selects stats.
+   *
+   * The run is at most `_max_thread_number` long: claimed IDs that are not deleted yet
+   * leave a gap at the head after a crash, recovery tells the head from the tail only
+   * while every gap is within `_max_thread_number`, see the top of this file.
+   */
+  size_t ClaimBatch(size_t max_number, bool is_poll, bool is_lease, Claim& claim) {
+    TKey head;
+    TKey new_head;
+    size_t number;
+    std::vector<rocksdb::Slice> slices;
+    std::vector<rocksdb::ColumnFamilyHandle*> column_families;
+    std::vector<rocksdb::Status> statuses;
+    auto& keys = claim.keys;
+    auto& read_values = claim.values;
+    auto backoff = TBackoff();
+
+    (void)is_poll;
+
+    max_number = std::min(max_number, _max_thread_number);
+    if (max_number == 0)
+      return 0;
+
+    head = _head.load(std::memory_order_relaxed);
+
+    perq_LocalStats;
+
+    while (true) {
+      number = Distance(head, _next_tail.load(std::memory_order_acquire));
+
+      if (number > max_number)
+        number = max_number;
+
+      if (is_lease && number > 0) {
+        std::lock_guard<std::mutex> lock(_lease_mutex);
+        number = CountNotLeased(head, number);
+      }
+
+      if (number == 0) {
+        if (is_poll) {
+          perq_MergeLocalStatsForPoll;
+        }
+        else {
+          perq_MergeLocalStatsForPop;
+        }
+        return 0;
+      }
+
+      if (backoff.Wait()) {
+        perq_IncrementLocalYieldCount;
+      }
+
+      keys.resize(number);
+      slices.resize(number);
+      column_families.resize(number, _column_family);
+      for (size_t i = 0; i < number; ++i) {
+        keys[i] = _conv.ToKey(Advance(head, i));
+        slices[i] = ToSlice(&keys[i]);
+      }
+
+      statuses = CallDb([&] {
+        return _db->MultiGet(
+          rocksdb::ReadOptions(), column_families, slices, &read_values);
+      });
+
+      // Only a run of existing items from the head can be consumed. The rest may not be
+      // written yet by `Push` or could be deleted already by other consumers.
+      size_t found = 0;
+      for (; found < number && statuses[found].ok(); ++found)
+        ;
+
+      if (found < number && !statuses[found].IsNotFound())
+        throw Exception("Fatal error in RocksDB at `RocksDB::MultiGet`: "
+                          + statuses[found].ToString(),
+                        CurrentLocation);
+
+      if (found == 0) {
+        perq_IncrementLocalGetMissCount;
+        head = _head.load(std::memory_order_acquire);
+        continue;
+      }
+
+      number = found;
+
+      perq_IncrementLocalCasRepetitionCount;
+
+      if (is_lease) {
+        // Leased IDs are entered together with the move of the head, so a `Lease` of an
+        // ID reused after a wraparound stops before it instead of overwriting its record
+        std::lock_guard<std::mutex> lock(_lease_mutex);
+        number = CountNotLeased(head, number);
+        if (number == 0) {
+          head = _head.load(std::memory_order_acquire);
+          continue;
+        }
+
+        new_head = Advance(head, number);
+        if (std::atomic_compare_exchange_weak_explicit(&_head,
+                                                       &head,
+                                                       new_head,
+                                                       std::memory_order_acquire,
+                                                       std::memory_order_acquire)) {
+          for (size_t i = 0; i < number; ++i)
+            SetLeaseDeadline(
+              _leases.emplace(Advance(head, i), _lease_deadlines.end()).first,
+              std::chrono::steady_clock::time_point::max());
+          break;
+        }
+        continue;
+      }
+
+      new_head = Advance(head, number);
+      if (std::atomic_compare_exchange_weak_explicit(&_head,
+                                                     &head,
+                                                     new_head,
+                                                     std::memory_order_acquire,
+                                                     std::memory_order_acquire))
+        break;
+    }
+
+    keys.resize(number);
+    read_values.resize(number);
+    claim.head = head;
+    CountConsumed(number);
+
+    if (_hot_cache.IsEnabled()) {
+      for (size_t i = 0; i < number; ++i)
+        _hot_cache.Erase(Advance(head, i));
+    }
+
+    if (is_poll) {
+      perq_MergeLocalStatsForPoll;
+    }
+    else {
+      perq_MergeLocalStatsForPop;
+    }
+
+    return number;
+  }
+
+  // Number of IDs from `head` up to the first leased one, at most `number`.
+  // `_lease_mutex` must be locked.
+  size_t CountNotLeased(TKey head, size_t number) {
+    if (_leases.empty())
+      return number;
+    for (size_t i = 0; i < number; ++i) {
+      if (_leases.count(Advance(head, i)))
+        return i;
+    }
+    return number;
+  }
+
+  /*
+   * Leases are indexed by ID and by deadline. A deadline of `time_point::max()` marks a
+   * lease that is being written, acknowledged or requeued, `Ack` and `Nack` skip it and
+   * it never expires. `_lease_mutex` must be locked for all of these.
+   */
+  using LeaseDeadlines = std::multimap<std::chrono::steady_clock::time_point, TKey>;
+  using Leases = std::map<TKey, typename LeaseDeadlines::iterator>;
+
+  void SetLeaseDeadline(typename Leases::iterator it,
+                        std::chrono::steady_clock::time_point deadline) {
+    if (it->second != _lease_deadlines.end())
+      _lease_deadlines.erase(it->second);
+    it->second = _lease_deadlines.emplace(deadline, it->first);
+  }
+
+  void EraseLease(typename Leases::iterator it) {
+    _lease_deadlines.erase(it->second);
+    _leases.erase(it);
+  }
+
+  // Takes a lease for `Ack` or `Nack`, `deadline` receives its deadline for
+  // `ReleaseLease`
+  bool AcquireLease(TKey id, std::chrono::steady_clock::time_point& deadline) {
+    std::lock_guard<std::mutex> lock(_lease_mutex);
+    const auto it = _leases.find(id);
+    if (it == _leases.end()
+        || it->second->first == std::chrono::steady_clock::time_point::max())
+      return false;
+
+    deadline = it->second->first;
+    SetLeaseDeadline(it, std::chrono::steady_clock::time_point::max());
+    return true;
+  }
+
+  // Puts back a lease taken by `AcquireLease` or `ReclaimExpiredLeases`
+  void ReleaseLease(TKey id, std::chrono::steady_clock::time_point deadline) {
+    std::lock_guard<std::mutex> lock(_lease_mutex);
+    SetLeaseDeadline(_leases.find(id), deadline);
+  }
+
+  /*
+   * Moves the value of a taken lease record to a new tail ID and removes the lease.
+   * Returns `false` and puts the lease back if the queue is full. The caller commits the
+   * write.
+   */
+  bool RequeueLease(TKey lease_id, std::chrono::steady_clock::time_point deadline) {
+    TKey id;
+    uint64_t sequence = 0;
+    std::string value;
+    try {
+      const auto lease_key = ToLeaseKey(lease_id);
+      auto status = CallDb([&] {
+        return _db->Get(rocksdb::ReadOptions(), _column_family, lease_key, &value);
+      });
+      if (!status.ok())
+        throw Exception(
+          "Fatal error in RocksDB at `RocksDB::Get`: " + status.ToString(),
+          CurrentLocation);
+
+      if (!Reserve(1, id, sequence)) {
+        ReleaseLease(lease_id, deadline);
+        return false;
+      }
+
+      auto key = _conv.ToKey(id);
+      rocksdb::WriteBatch batch;
+      batch.Delete(_column_family, lease_key);
+      batch.Put(_column_family, ToSlice(&key), value);
+      status = CallDb([&] { return _db->Write(makeWriteOptions(), &batch); });
+      if (!status.ok())
+        throw Exception(
+          "Fatal error in RocksDB at `RocksDB::Write`: " + status.ToString(),
+          CurrentLocation);
+    }
+    catch (...) {
+      ReleaseLease(lease_id, deadline);
+      throw;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(_lease_mutex);
+      EraseLease(_leases.find(lease_id));
+    }
+
+    CacheValue(id, sequence, rocksdb::Slice(value));
+    NotifyWaiters();
+
+    return true;
+  }
+
+  // Lease records left by a previous run are expired, their consumers are gone
+  void LoadLeases(rocksdb::Iterator& it) {
+    const auto prefix = ToLeaseKey(0).substr(0, sizeof(TKey) + 1);
+
+    std::lock_guard<std::mutex> lock(_lease_mutex);
+    for (it.Seek(prefix); it.Valid() && it.key().starts_with(prefix); it.Next()) {
+      if (it.key().size() != prefix.size() + sizeof(TKey))
+        throw Exception("Fatal queue data state: a lease key size ("
+                          + std::to_string(it.key().size())
+                          + ") != the expected size ("
+                          + std::to_string(prefix.size() + sizeof(TKey))
+                          + ")",
+                        CurrentLocation);
+
+      TKey key;
+      std::memcpy(&key, it.key().data() + prefix.size(), sizeof(TKey));
+      SetLeaseDeadline(_leases.emplace(_conv.ToId(key), _lease_deadlines.end()).first,
+                       std::chrono::steady_clock::time_point::min());
+    }
+
+    if (!it.status().ok())
+      throw Exception("Fatal error in RocksDB at `Iterator`: " + it.status().ToString(),
+                      CurrentLocation);
+  }
+
+  /*
+   * Auxiliary records of the queue are stored right after its last item key: the key of
+   * the maximum ID followed by a tag byte and a payload. They are longer than item keys,
+   * so they stay out of the queue's key range and of other prefixes' key ranges.
+   */
+  std::string ToAuxiliaryKey(char tag) {
+    auto max_key = _conv.ToKey(_conv.GetMaxId());
+    auto key = ToSlice(&max_key).ToString();
+    key.push_back(tag);
+    return key;
+  }
+
+  // The smallest key after the item key of the maximum ID, records never use tag zero
+  std::string ToEndKey() { return ToAuxiliaryKey('\0'); }
+
+  std::string ToLeaseKey(TKey id) {
+    auto key = ToAuxiliaryKey('L');
+    auto id_key = _conv.ToKey(id);
+    key.append(reinterpret_cast<char const*>(&id_key), sizeof(TKey));
+    return key;
+  }
+
+  /*
+   * Item value of a stream: a tag, its stream ID, number of chunks and size,
+   * little-endian.
+   * A value only refers to a stream if the stream's record, see `ToStreamRecordKey`,
+   * holds the key of the item, so user values that look like references are never taken
+   * for one.
+   */
+  struct StreamReference {
+    uint64_t stream_id;
+    uint32_t chunk_number;
+    uint64_t size;
+  };
+
+  static rocksdb::Slice StreamReferenceTag() {
+    return rocksdb::Slice("\0perq:stream", 12);
+  }
+
+  static constexpr size_t stream_reference_size
+    = 12 + 2 * sizeof(uint64_t) + sizeof(uint32_t);
+
+  static std::string EncodeStreamReference(StreamReference const& reference) {
+    const auto tag = StreamReferenceTag();
+    const auto stream_id = boost::endian::native_to_little(reference.stream_id);
+    const auto chunk_number = boost::endian::native_to_little(reference.chunk_number);
+    const auto size = boost::endian::native_to_little(reference.size);
+    auto value = tag.ToString();
+    value.append(reinterpret_cast<char const*>(&stream_id), sizeof(stream_id));
+    value.append(reinterpret_cast<char const*>(&chunk_number), sizeof(chunk_number));
+    value.append(reinterpret_cast<char const*>(&size), sizeof(size));
+    return value;
+  }
+
+  static bool DecodeStreamReference(rocksdb::Slice value, StreamReference& reference) {
+    const auto tag = StreamReferenceTag();
+    if (value.size() != stream_reference_size || !value.starts_with(tag))
+      return false;
+    value.remove_prefix(tag.size());
+    std::memcpy(&reference.stream_id, value.data(), sizeof(reference.stream_id));
+    value.remove_prefix(sizeof(reference.stream_id));
+    std::memcpy(&reference.chunk_number, value.data(), sizeof(reference.chunk_number));
+    value.remove_prefix(sizeof(reference.chunk_number));
+    std::memcpy(&reference.size, value.data(), sizeof(reference.size));
+    reference.stream_id = boost::endian::little_to_native(reference.stream_id);
+    reference.chunk_number = boost::endian::little_to_native(reference.chunk_number);
+    reference.size = boost::endian::little_to_native(reference.size);
+    return true;
+  }
+
+  // Chunks of a stream are ordered by the stream ID and the chunk index, big-endian
+  std::string ToStreamChunkKey(uint64_t stream_id, uint32_t chunk) {
+    auto key = ToAuxiliaryKey('S');
+    const auto stream_id_key = boost::endian::native_to_big(stream_id);
+    const auto chunk_key = boost::endian::native_to_big(chunk);
+    key.append(reinterpret_cast<char const*>(&stream_id_key), sizeof(stream_id_key));
+    key.append(reinterpret_cast<char const*>(&chunk_key), sizeof(chunk_key));
+    return key;
+  }
+
+  // Record of a pushed stream, its value is the key of the item referring to the stream
+  std::string ToStreamRecordKey(uint64_t stream_id) {
+    auto key = ToAuxiliaryKey('R');
+    const auto stream_id_key = boost::endian::native_to_big(stream_id);
+    key.append(reinterpret_cast<char const*>(&stream_id_key), sizeof(stream_id_key));
+    return key;
+  }
+
+  // Whether `value` of the item with `key` refers to a stream, read into `reference`
+  bool IsStreamItem(rocksdb::Slice key,
+                    rocksdb::Slice value,
+                    StreamReference& reference) {
+    if (!DecodeStreamReference(value, reference))
+      return false;
+
+    std::string record;
+    const auto status = CallDb([&] {
+      return _db->Get(rocksdb::ReadOptions(),
+                      _column_family,
+                      ToStreamRecordKey(reference.stream_id),
+                      &record);
+    });
+    if (status.IsNotFound())
+      return false;
+    if (!status.ok())
+      throw Exception("Fatal error in RocksDB at `RocksDB::Get`: " + status.ToString(),
+                      CurrentLocation);
+    return rocksdb::Slice(record) == key;
+  }
+
+  /*
+   * Moves the head over the head item like `ConsumeOne` if it refers to a stream. Returns
+   * `false` if the queue is empty, throws if the head item is not a stream item.
+   */
+  bool ClaimStream(TKey& head, StreamReference& reference) {
+    TKey key;
+    rocksdb::Slice slice;
+    rocksdb::PinnableSlice value;
+    rocksdb::Status status;
+    auto backoff = TBackoff();
+
+    head = _head.load(std::memory_order_relaxed);
+
+    while (true) {
+      if (head == _next_tail.load(std::memory_order_acquire))
+        return false;
+
+      backoff.Wait();
+
+      value.Reset();
+      key = _conv.ToKey(head);
+      slice = ToSlice(&key);
+
+      if (!_hot_cache.IsEnabled() || !_hot_cache.Get(head, value)) {
+        status = CallDb([&] {
+          return _db->Get(rocksdb::ReadOptions(), _column_family, slice, &value);
+        });
+
+        // Not written yet or consumed by another call, as in `ConsumeOne`
+        if (status.IsNotFound()) {
+          head = _head.load(std::memory_order_acquire);
+          continue;
+        }
+
+        if (!status.ok())
+          throw Exception(
+            "Fatal error in RocksDB at `RocksDB::Get`: " + status.ToString(),
+            CurrentLocation);
+      }
+
+      if (!IsStreamItem(slice, value, reference)) {
+        // The item is left in the queue unless another call consumed it meanwhile
+        const auto current_head = _head.load(std::memory_order_acquire);
+        if (current_head != head) {
+          head = current_head;
+          continue;
+        }
+        throw Exception("The head item was not pushed with `PushStream`",
+                        CurrentLocation);
+      }
+
+      if (std::atomic_compare_exchange_weak_explicit(&_head,
+                                                     &head,
+                                                     Advance(head, 1),
+                                                     std::memory_order_acquire,
+                                                     std::memory_order_acquire))
+        break;
+    }
+
+    if (_hot_cache.IsEnabled())
+      _hot_cache.Erase(head);
+
+    CountConsumed(1);
+    return true;
+  }
+
+  // Marks a stream whose chunks are not referred to by an item
+  std::string ToStreamMarkKey(uint64_t stream_id) {
+    auto key = ToAuxiliaryKey('W');
+    const auto stream_id_key = boost::endian::native_to_big(stream_id);
+    key.append(reinterpret_cast<char const*>(&stream_id_key), sizeof(stream_id_key));
+    return key;
+  }
+
+  // Not synced: a lost mark can only belong to chunks written after it, which are lost
+  // too
+  void WriteStreamMark(uint64_t stream_id) {
+    const auto status = CallDb([&] {
+      return _db->Put(makeUnsyncedWriteOptions(),
+                      _column_family,
+                      ToStreamMarkKey(stream_id),
+                      rocksdb::Slice());
+    });
+    if (!status.ok())
+      throw Exception("Fatal error in RocksDB at `RocksDB::Put`: " + status.ToString(),
+                      CurrentLocation);
+  }
+
+  // Deletes all chunks of a stream with one range tombstone, its record and pending mark
+  void DeleteStream(uint64_t stream_id) {
+    rocksdb::WriteBatch batch;
+    DeleteStream(batch, stream_id);
+    const auto status = CallDb([&] { return _db->Write(makeWriteOptions(), &batch); });
+    if (!status.ok())
+      throw Exception("Fatal error in RocksDB at `RocksDB::Write`: " + status.ToString(),
+                      CurrentLocation);
+
+    CommitWrite();
+  }
+
+  void DeleteStream(rocksdb::WriteBatch& batch, uint64_t stream_id) {
+    const auto begin_key = ToStreamChunkKey(stream_id, 0);
+    auto end_key = ToAuxiliaryKey('S');
+    const auto end_stream_id_key = boost::endian::native_to_big(stream_id + 1);
+    end_key.append(reinterpret_cast<char const*>(&end_stream_id_key),
+                   sizeof(end_stream_id_key));
+    // The end key of the maximum stream ID wraps around, the rest of the range is empty
+    if (stream_id == std::numeric_limits<uint64_t>::max())
+      end_key = ToAuxiliaryKey('T');
+    batch.DeleteRange(_column_family, begin_key, end_key);
+    batch.Delete(_column_family, ToStreamRecordKey(stream_id));
+    batch.Delete(_column_family, ToStreamMarkKey(stream_id));
+  }
+
+  /*
+   * Deletes streams left pending by a previous run, they were neither pushed nor fully
+   * polled, and streams whose items were consumed by other calls than `PollStream`.
+   * Continues stream IDs after the largest one found.
+   */
+  void RecoverStreams(rocksdb::Iterator& it) {
+    const auto mark_prefix = ToAuxiliaryKey('W');
+    const auto record_prefix = ToAuxiliaryKey('R');
+    const auto chunk_prefix = ToAuxiliaryKey('S');
+    uint64_t next_stream_id = 0;
+
+    rocksdb::WriteBatch batch;
+    for (it.Seek(mark_prefix); it.Valid() && it.key().starts_with(mark_prefix);
+         it.Next()) {
+      if (it.key().size() != mark_prefix.size() + sizeof(uint64_t))
+        throw Exception("Fatal queue data state: a stream mark key size ("
+                          + std::to_string(it.key().size())
+                          + ") != the expected size ("
+                          + std::to_string(mark_prefix.size() + sizeof(uint64_t))
+                          + ")",
+                        CurrentLocation);
+
+      uint64_t stream_id;
+      std::memcpy(&stream_id, it.key().data() + mark_prefix.size(), sizeof(stream_id));
+      stream_id = boost::endian::big_to_native(stream_id);
+      DeleteStream(batch, stream_id);
+      next_stream_id = std::max(next_stream_id, stream_id + 1);
+    }
+
+    if (!it.status().ok())
+      throw Exception("Fatal error in RocksDB at `Iterator`: " + it.status().ToString(),
+                      CurrentLocation);
+
+    std::string value;
+    StreamReference reference;
+    for (it.Seek(record_prefix); it.Valid() && it.key().starts_with(record_prefix);
+         it.Next()) {
+      if (it.key().size() != record_prefix.size() + sizeof(uint64_t))
+        throw Exception("Fatal queue data state: a stream record key size ("
+                          + std::to_string(it.key().size())
+                          + ") != the expected size ("
+                          + std::to_string(record_prefix.size() + sizeof(uint64_t))
+                          + ")",
+                        CurrentLocation);
+
+      uint64_t stream_id;
+      std::memcpy(&stream_id, it.key().data() + record_prefix.size(), sizeof(stream_id));
+      stream_id = boost::endian::big_to_native(stream_id);
+      next_stream_id = std::max(next_stream_id, stream_id + 1);
+
+      const auto status = _db->Get(
+        rocksdb::ReadOptions(), _column_family, it.value(), &value);
+      if (!status.ok() && !status.IsNotFound())
+        throw Exception("Fatal error in RocksDB at `RocksDB::Get`: " + status.ToString(),
+                        CurrentLocation);
+      if (status.IsNotFound() || !DecodeStreamReference(value, reference)
+          || reference.stream_id != stream_id)
+        DeleteStream(batch, stream_id);
+    }
+
+    if (!it.status().ok())
+      throw Exception("Fatal error in RocksDB at `Iterator`: " + it.status().ToString(),
+                      CurrentLocation);
+
+    it.SeekForPrev(ToAuxiliaryKey('T'));
+    if (it.Valid() && it.key().starts_with(chunk_prefix)
+        && it.key().size() >= chunk_prefix.size() + sizeof(uint64_t)) {
+      uint64_t stream_id;
+      std::memcpy(&stream_id, it.key().data() + chunk_prefix.size(), sizeof(stream_id));
+      stream_id = boost::endian::big_to_native(stream_id);
+      next_stream_id = std::max(next_stream_id, stream_id + 1);
+    }
+
+    if (!it.status().ok())
+      throw Exception("Fatal error in RocksDB at `Iterator`: " + it.status().ToString(),
+                      CurrentLocation);
+
+    _next_stream_id.store(next_stream_id, std::memory_order_relaxed);
+
+    if (batch.Count() == 0)
+      return;
+
+    const auto status = _db->Write(makeWriteOptions(), &batch);
+    if (!status.ok())
+      throw Exception("Fatal error in RocksDB at `RocksDB::Write`: " + status.ToString(),
+                      CurrentLocation);
+
+    CommitWrite();
+  }
+
+  // Must be called after the value is written to RocksDB, `sequence` is the push sequence
+  // of `id` from `Reserve`
+  template <typename TValue>
+  void CacheValue(TKey id, uint64_t sequence, TValue const& value) {
+    if (!_hot_cache.IsEnabled())
+      return;
+
+    // Checked under the slot lock: a consumer erases the slot after moving the head, so
+    // either the moved head is seen here or the consumer's `Erase` follows this `Put`.
+    // The item is not cached when it was already consumed, or when its ID could have been
+    // reserved again by a later push.
+    _hot_cache.Put(id, sequence, value, [&] {
+      if (_push_sequence.load(std::memory_order_acquire) - sequence > _conv.GetMaxId())
+        return false;
+      const auto head = _head.load(std::memory_order_acquire);
+      return Distance(head, id)
+        < Distance(head, _next_tail.load(std::memory_order_acquire));
+    });
+  }
+
+  // Writes a checkpoint when pushed IDs cross a multiple of `checkpoint_interval`
+  void CheckpointPeriodically(TKey first_id, size_t number) {
+    if (!_checkpoint_interval)
+      return;
+
+    const auto offset = static_cast<size_t>(first_id) % _checkpoint_interval;
+    if (offset == 0 || offset + number > _checkpoint_interval)
+      Checkpoint();
+  }
+
+  /*
+   * Consumed IDs leave tombstones in front of the head, reads of the head and `Seek`s
+   * have to skip them until compaction removes them. The maintenance thread compacts
+   * the consumed key range after the head has moved over `compaction_threshold` IDs.
+   */
+  void StartMaintenance() {
+    if (!_db || _compaction_threshold == 0)
+      return;
+
+    _is_maintenance_stopped = false;
+    _compacted_head = _head.load(std::memory_order_relaxed);
+    _compacted_number = _consumed_number.load(std::memory_order_relaxed);
+    _maintenance_thread = std::thread([this]() {
+      std::unique_lock<std::mutex> lock(_maintenance_mutex);
+      while (!_maintenance_condition.wait_for(lock, _compaction_check_interval, [this]() {
+        return _is_maintenance_stopped;
+      })) {
+        lock.unlock();
+        CompactConsumed();
+        lock.lock();
+      }
+    });
+  }
+
+  void StopMaintenance() {
+    if (!_maintenance_thread.joinable())
+      return;
+
+    {
+      std::lock_guard<std::mutex> lock(_maintenance_mutex);
+      _is_maintenance_stopped = true;
+    }
+    _maintenance_condition.notify_all();
+    _maintenance_thread.join();
+  }
+
+  void CompactConsumed() {
+    const auto consumed_number = _consumed_number.load(std::memory_order_relaxed);
+    const auto number = consumed_number - _compacted_number;
+    if (number < _compaction_threshold)
+      return;
+
+    const auto head = _head.load(std::memory_order_acquire);
+
+    // The head went around the whole ring since the last compaction
+    if (number > _conv.GetMaxId())
+      _compacted_head = head;
+
+    auto begin_key = _conv.ToKey(_compacted_head);
+    auto end_key = _conv.ToKey(head);
+    auto begin = ToSlice(&begin_key);
+    auto end = ToSlice(&end_key);
+    const rocksdb::CompactRangeOptions options;
+    rocksdb::Status status;
+    if (_compacted_head < head) {
+      status = _db->CompactRange(options, _column_family, &begin, &end);
+    }
+    else {
+      const auto max_end_key = ToEndKey();
+      const auto max_end = rocksdb::Slice(max_end_key);
+      status = _db->CompactRange(options, _column_family, &begin, &max_end);
+      if (status.ok()) {
+        auto zero_key = _conv.ToKey(0);
+        begin = ToSlice(&zero_key);
+        status = _db->CompactRange(options, _column_family, &begin, &end);
+      }
+    }
+
+    // Exceptions cannot leave the thread, the range is compacted again on the next run
+    if (!status.ok()) {
+      perq_IncrementCompactionFailureCount;
+      return;
+    }
+
+    perq_AddCompactionStats(number);
+    _compacted_head = head;
+    _compacted_number = consumed_number;
+  }
+
+  void CountConsumed(size_t number) {
+    if (_compaction_threshold)
+      _consumed_number.fetch_add(number, std::memory_order_relaxed);
+  }
+
+  // Returns `false` if the queue is still empty at `deadline`
+  bool WaitForItems(std::chrono::steady_clock::time_point const& deadline) {
+    std::unique_lock<std::mutex> lock(_wait_mutex);
+
+    // Sequential consistency with `Reserve` and `NotifyWaiters` guarantees that either
+    // the waiter sees the moved tail, or the producer sees the waiter
+    _waiter_number.fetch_add(1, std::memory_order_seq_cst);
+    const auto is_ready = _wait_condition.wait_until(lock, deadline, [this]() {
+      return _head.load(std::memory_order_seq_cst)
+        != _next_tail.load(std::memory_order_seq_cst);
+    });
+    _waiter_number.fetch_sub(1, std::memory_order_relaxed);
+
+    return is_ready;
+  }
+
+  void NotifyWaiters() {
+    if (_waiter_number.load(std::memory_order_seq_cst) == 0)
+      return;
+
+    // Waiters check the queue under the lock, taking it here makes sure that the
+    // notification is not sent between their check and their wait
+    { std::lock_guard<std::mutex> lock(_wait_mutex); }
+    _wait_condition.notify_all();
+  }
+
+  // Moves `id` forward by `number` IDs wrapping around the maximum ID
+  TKey Advance(TKey id, size_t number) {
+    const auto left = static_cast<size_t>(_conv.GetMaxId() - id);
+    if (number <= left)
+      return static_cast<TKey>(id + number);
+    return static_cast<TKey>(number - left - 1);
+  }
+
+  // Moves `id` back by `number` IDs wrapping around the maximum ID
+  TKey Retreat(TKey id, size_t number) {
+    if (number <= id)
+      return static_cast<TKey>(id - number);
+    return static_cast<TKey>(_conv.GetMaxId() - (number - id - 1));
+  }
+
+  // Number of IDs from `from` (inclusive) to `to` (exclusive) wrapping around the maximum
+  // ID
+  size_t Distance(TKey from, TKey to) {
+    if (to < from)
+      return (_conv.GetMaxId() - from + 1) + to;
+    else
+      return to - from;
+  }
+
+  // Moves of items planned by recovery
+  struct Relocation {
+    rocksdb::WriteBatch batch;
+
+    // Original IDs of moved items and their new IDs
+    std::map<TKey, TKey> ids;
+  };
+
+  /*
+   * Finds the head and the tail by iterating over all keys of the queue. Gaps are closed
+   * by moves written in large batches while the iterator keeps its view of the data from
+   * before the moves.
+   */
+  void InitializeFromScan(rocksdb::Iterator& it) {
+    TKey key = _conv.ToKey(0);
+    rocksdb::Slice slice = ToSlice(&key);
+
+    it.Seek(slice);
+
+    if (!IsInRange(it)) {
+      // Queue is empty, fine.
+      _head.store(0, std::memory_order_relaxed);
+      _next_tail.store(0, std::memory_order_relaxed);
+      return;
+    }
+
+    // Queue is not empty, we need to find the head and the tail
+
+    auto corrector = PersistentQueueIdCorrector<TKey>(
+      _conv.ToId(it.key()), _conv.GetMaxId(), _max_thread_number);
+    Relocation relocation;
+
+    for (it.Next();; it.Next()) {
+      if (!IsInRange(it)) {
+        if (!corrector.IsOverEnd())
+          break;
+
+        Seek(it, _conv.ToKey(0));
+      }
+
+      if (it.key().size() != sizeof(TKey))
+        throw Exception("Fatal queue data state: a found key size ("
+                          + std::to_string(it.key().size())
+                          + ") != the current key size ("
+                          + std::to_string(sizeof(TKey))
+                          + ")",
+                        CurrentLocation);
+
+      const auto original_id = _conv.ToId(it.key());
+
+      // When the queue is over the end, some items are visited for the second time, they
+      // must be seen at their new places
+      const auto moved = relocation.ids.find(original_id);
+      const auto id = (moved == relocation.ids.end()) ? original_id : moved->second;
+
+      // Must happen at some point when the queue is over the end
+      if (id == corrector.head()) {
+        if (!corrector.IsOverEnd())
+          throw Exception(
+            "Fatal logic failure: tail has reached the queue's head while the queue is not over the end",
+            CurrentLocation);
+        break;
+      }
+
+      // This `if` avoids a second check of IDs when the queue is over the end
+      if (corrector.IsOverEnd() && corrector.IsTailMax() && id == 0
+          && corrector.previous_checked_head() == 0) {
+        corrector.SetTailToPrevious();
+        break;
+      }
+      const auto next = corrector.FeedNext(id);
+
+      // All good
+      if (id == next) {
+        continue;
+      }
+
+      // Seems like there was a forcefull terminataion, some writes were not complete.
+      // We need to recover the queue's consistency by filling a gap in consecutive IDs.
+      Relocate(relocation, id, next, it.value());
+      relocation.ids[original_id] = next;
+    }
+
+    FlushRelocation(relocation);
+
+    _head.store(corrector.head(), std::memory_order_relaxed);
+    if (corrector.IsTailMax())
+      _next_tail.store(0, std::memory_order_relaxed);
+    else
+      _next_tail.store(corrector.tail() + 1, std::memory_order_relaxed);
+  }
+
+  /*
+   * Finds the head and the tail starting from the checkpoint's tail instead of the
+   * beginning. Items before the checkpoint's tail are consecutive, except:
+   * - crash gaps of unfinished pushes within `max_thread_number` IDs before the tail at
+   *   the time of the crash;
+   * - items that were claimed but not deleted by consumers at the time of the crash,
+   *   they are expected within `max_thread_number` IDs after the head.
+   * Only these windows are checked and fixed. A stale checkpoint makes the walk to the
+   * tail longer, but does not break it. Returns `false` if there is no usable checkpoint.
+   */
+  bool InitializeFromCheckpoint(rocksdb::Iterator& it) {
+    std::string value;
+    const auto status
+      = _db->Get(rocksdb::ReadOptions(), _column_family, ToAuxiliaryKey('C'), &value);
+    if (status.IsNotFound())
+      return false;
+    if (!status.ok())
+      throw Exception("Fatal error in RocksDB at `RocksDB::Get`: " + status.ToString(),
+                      CurrentLocation);
+
+    if (value.size() != 2 * sizeof(TKey) || 2 * _max_thread_number + 1 >= GetMaxSize())
+      return false;
+
+    // Only the tail is needed to find the queue, the head is checked for consistency
+    TKey head_key;
+    TKey next_tail_key;
+    std::memcpy(&head_key, value.data(), sizeof(TKey));
+    std::memcpy(&next_tail_key, value.data() + sizeof(TKey), sizeof(TKey));
+    const auto checkpoint_head = _conv.ToId(head_key);
+    const auto checkpoint_next_tail = _conv.ToId(next_tail_key);
+    if (_conv.ToKey(checkpoint_head) != head_key
+        || _conv.ToKey(checkpoint_next_tail) != next_tail_key
+        || Distance(checkpoint_head, checkpoint_next_tail) > GetMaxSize())
+      return false;
+
+    // Unfinished pushes may leave the last existing item up to `max_thread_number` IDs
+    // before the checkpoint's tail, and crash gaps are up to `max_thread_number` IDs
+    // before that item
+    const auto start_id = Retreat(checkpoint_next_tail, 2 * _max_thread_number + 1);
+    if (!SeekInRing(it, start_id)) {
+      // Queue is empty
+      _head.store(checkpoint_next_tail, std::memory_order_relaxed);
+      _next_tail.store(checkpoint_next_tail, std::memory_order_relaxed);
+      return true;
+    }
+
+    const auto first_id = ToCheckedId(it.key());
+    auto tail = first_id;
+    Relocation relocation;
+
+    // Walks to the tail closing crash gaps, the gap after the tail is the free part of
+    // the ring that is followed by the head
+    while (true) {
+      if (!NextInRing(it))
+        throw Exception("Fatal logic failure: failed to find a key that must exist",
+                        CurrentLocation);
+
+      const auto id = ToCheckedId(it.key());
+      const auto distance = Distance(tail, id);
+      if (distance > _max_thread_number)
+        break;
+
+      // Nothing looks like a gap between the tail and the head
+      if (id == first_id)
+        return false;
+
+      tail = Advance(tail, 1);
+      if (distance > 1)
+        Relocate(relocation, id, tail, it.value());
+    }
+
+    const auto head = CloseHeadGaps(it, ToCheckedId(it.key()), first_id, relocation);
+
+    // Planned moves are dropped, the full scan will find them again
+    if (Distance(head, tail) >= GetMaxSize())
+      return false;
+
+    FlushRelocation(relocation);
+
+    _head.store(head, std::memory_order_relaxed);
+    _next_tail.store(Advance(tail, 1), std::memory_order_relaxed);
+    return true;
+  }
+
+  /*
+   * Closes gaps left by consumers in the first `max_thread_number` IDs after `head` by
+   * moving preceding items up, so their order is kept. `it` points to `head`. Items from
+   * `end_id` are checked already. Returns the new head.
+   */
+  TKey CloseHeadGaps(rocksdb::Iterator& it,
+                     TKey head,
+                     TKey end_id,
+                     Relocation& relocation) {
+    std::vector<TKey> ids = {head};
+    std::vector<std::string> values = {it.value().ToString()};
+    auto last_gap = ids.size();
+
+    while (ids.back() != end_id && Distance(head, ids.back()) <= _max_thread_number) {
+      if (!NextInRing(it))
+        break;
+      const auto id = ToCheckedId(it.key());
+      if (id == head)
+        break;
+      if (Distance(ids.back(), id) > 1)
+        last_gap = ids.size();
+      ids.push_back(id);
+      values.push_back(it.value().ToString());
+    }
+
+    if (last_gap == ids.size())
+      return head;
+
+    // Items before the last gap are moved to end right before the item after the gap
+    for (auto i = last_gap; i-- > 0;) {
+      const auto target = Retreat(ids[last_gap], last_gap - i);
+      if (target != ids[i])
+        Relocate(relocation, ids[i], target, values[i]);
+    }
+
+    return Retreat(ids[last_gap], last_gap);
+  }
+
+  // Seeks the first key at or after `id` wrapping around the maximum ID
+  bool SeekInRing(rocksdb::Iterator& it, TKey id) {
+    auto key = _conv.ToKey(id);
+    it.Seek(ToSlice(&key));
+    if (IsInRange(it))
+      return true;
+    key = _conv.ToKey(0);
+    it.Seek(ToSlice(&key));
+    return IsInRange(it);
+  }
+
+  bool NextInRing(rocksdb::Iterator& it) {
+    it.Next();
+    if (IsInRange(it))
+      return true;
+    auto key = _conv.ToKey(0);
+    it.Seek(ToSlice(&key));
+    return IsInRange(it);
+  }
+
+  TKey ToCheckedId(rocksdb::Slice const& key) {
+    if (key.size() != sizeof(TKey))
+      throw Exception("Fatal queue data state: a found key size ("
+                        + std::to_string(key.size())
+                        + ") != the current key size ("
+                        + std::to_string(sizeof(TKey))
+                        + ")",
+                      CurrentLocation);
+    return _conv.ToId(key);
+  }
+
+  // Adds a move of an item to the batch, writes the batch when it is large enough. Every
+  // move is written as a whole, so a crash during recovery leaves a recoverable state.
+  void Relocate(Relocation& relocation, TKey from_id, TKey to_id, rocksdb::Slice value) {
+    auto from_key = _conv.ToKey(from_id);
+    auto to_key = _conv.ToKey(to_id);
+    relocation.batch.Delete(_column_family, ToSlice(&from_key));
+    relocation.batch.Put(_column_family, ToSlice(&to_key), value);
+    ++_recovery_info.moved_number;
+    perq_IncrementShiftUpCount;
+
+    if (relocation.batch.GetDataSize() >= _relocation_batch_size)
+      FlushRelocation(relocation);
+  }
+
+  void FlushRelocation(Relocation& relocation) {
+    if (relocation.batch.Count() == 0)
+      return;
+
+    rocksdb::WriteOptions write_options = {};
+    write_options.sync = true;
+    const auto status = _db->Write(write_options, &relocation.batch);
+    if (!status.ok())
+      throw Exception("Fatal error in RocksDB at `RocksDB::Write`: " + status.ToString(),
+                      CurrentLocation);
+    relocation.batch.Clear();
+  }
+
+  void Seek(rocksdb::Iterator& it, TKey key) {
+    it.Seek(ToSlice(&key));
+    if (!IsInRange(it))
+      throw Exception("Fatal logic failure: failed to seek a key that must exist",
+                      CurrentLocation);
+  }
+
+  // Whether the iterator points to a key in this queue's key range. Keys of other
+  // prefixes sharing the column family lie outside of the range.
+  bool IsInRange(rocksdb::Iterator const& it) {
+    if (!it.Valid()) {
+      if (!it.status().ok())
+        throw Exception("Fatal error in RocksDB at `Iterator`: " + it.status().ToString(),
+                        CurrentLocation);
+      return false;
+    }
+
+    auto max_key = _conv.ToKey(_conv.GetMaxId());
+    return it.key().compare(ToSlice(&max_key)) <= 0;
+  }
+
+  rocksdb::Slice ToSlice(TKey* key) {
+    return rocksdb::Slice(reinterpret_cast<char*>(key), sizeof(TKey));
+  }
+
+  // In the group commit mode waits until the caller's write is synced to the disk
+  void CommitWrite() {
+    if (_durability != Durability::GroupCommit)
+      return;
+
+    // Waiting for the sync of another writer counts as RocksDB time too
+    const auto status = CallDb(
+      [this] { return _group_commit.Commit([this]() { return _db->SyncWAL(); }); });
+    if (!status.ok())
+      throw Exception(
+        "Fatal error in RocksDB at `RocksDB::SyncWAL`: " + status.ToString(),
+        CurrentLocation);
+  }
+
+  // Calls RocksDB, stats record the time spent there apart from the queue protocol
+  template <typename TCall>
+  auto CallDb(TCall&& call) -> decltype(call()) {
+#if defined(perq_WITH_STATS) && !defined(preq_DISABLE_STATS_OPERATIONS)
+    const auto start = std::chrono::steady_clock::now();
+    auto result = call();
+    const auto duration = std::chrono::steady_clock::now() - start;
+    internal::DbNanoseconds() += static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+    return result;
+#else
+    return call();
+#endif
+  }
+
+  static size_t ToSize(rocksdb::Slice const& value) { return value.size(); }
+
+  static size_t ToSize(rocksdb::SliceParts const& value) {
+    size_t size = 0;
+    for (int i = 0; i < value.num_parts; ++i)
+      size += value.parts[i].size();
+    return size;
+  }
+
+  template <typename TValue>
+  static size_t ToSize(TValue const& value) {
+    return rocksdb::Slice(value).size();
+  }
+
+  // Zero if the property is not available
+  uint64_t GetIntProperty(char const* property) {
+    uint64_t value = 0;
+    if (!_db->GetIntProperty(_column_family, property, &value))
+      return 0;
+    return value;
+  }
+
+  rocksdb::WriteOptions makeWriteOptions() {
+    rocksdb::WriteOptions options;
+
+    // From RocksDB doc:
+    // By default, each write to leveldb is asynchronous: it returns after pushing the
+    // write from the process into the operating system. The transfer from operating
+    // system memory to the underlying persistent storage happens asynchronously. The
     // sync flag can be turned on for a particular write to make the write operation
     // not return until the data being written has been pushed all the way to
     // persistent storage. (On Posix systems, this is implemented by calling either
     // fsync(...) or fdatasync(...) or msync(..., MS_SYNC) before the write operation
     // returns.)
-    options.sync = false;
+    options.sync = _durability == Durability::Sync;
+
+    return options;
+  }
 
+  // For writes persisted by a later synced write of the same thread
+  rocksdb::WriteOptions makeUnsyncedWriteOptions() {
+    auto options = makeWriteOptions();
+    options.sync = false;
     return options;
   }
 
   size_t GetMaxSize() { return _conv.GetMaxId() - _max_thread_number + 1; }
 
   rocksdb::DB* _db;
+  rocksdb::ColumnFamilyHandle* _column_family;
   size_t _max_thread_number;
+  Durability _durability;
+  size_t _checkpoint_interval;
+  size_t _range_delete_min_count;
+  RecoveryInfo _recovery_info;
+
+  // Keys carry `prefixValue`, unless a `QueueRegistry` sets the prefix at runtime
+  PrefixedNumericalKeyConverter<TKey, TPrefix> _conv = {prefixValue};
+
+  // Consumers update the head and producers the tail, each is on its own cache line
+  char _head_padding_front[ShardedCounter<size_t>::cache_line_size] = {};
   std::atomic<TKey> _head;
+  char _head_padding_back[ShardedCounter<size_t>::cache_line_size] = {};
   std::atomic<TKey> _next_tail;
+  char _next_tail_padding_back[ShardedCounter<size_t>::cache_line_size] = {};
+
+  std::mutex _wait_mutex;
+  std::condition_variable _wait_condition;
+  std::atomic<size_t> _waiter_number = {0};
+
+  GroupCommit _group_commit;
+
+  HotRingCache<TKey> _hot_cache;
+
+  // Counts IDs reserved by producers when the hot cache is enabled, orders values of
+  // reused IDs in the cache
+  std::atomic<uint64_t> _push_sequence = {0};
+
+  size_t _drain_chunk_size = 1024;
+  size_t _drain_readahead_size = 0;
+
+  // Stream IDs of `PushStream`, independent of item IDs
+  size_t _stream_chunk_size = 1 << 20;
+  std::atomic<uint64_t> _next_stream_id = {0};
+
+  // Compaction of consumed IDs, `_compacted_*` are used by the maintenance thread only
+  size_t _compaction_threshold = 0;
+  std::chrono::milliseconds _compaction_check_interval = {};
+  std::atomic<size_t> _consumed_number = {0};
+  size_t _compacted_number = 0;
+  TKey _compacted_head = 0;
+  bool _is_maintenance_stopped = false;
+  std::mutex _maintenance_mutex;
+  std::condition_variable _maintenance_condition;
+  std::thread _maintenance_thread;
+
+  // Leased IDs and their deadlines
+  std::mutex _lease_mutex;
+  LeaseDeadlines _lease_deadlines;
+  Leases _leases;
 
 #if defined(perq_WITH_STATS)
   Stats _stats = {};
 #endif
 
-  static constexpr PrefixedNumericalKeyConverter<TKey, TPrefix> _conv = {prefixValue};
-
   static constexpr size_t default_max_thread_number
-    = (_conv.GetMaxId() > 100000) ? 100000 : 10000;
+    = (PrefixedNumericalKeyConverter<TKey, TPrefix>::GetMaxId() > 100000) ? 100000
+                                                                          : 10000;
 
-  static constexpr std::uint_fast8_t _yield_after = 10;
+  static constexpr size_t _relocation_batch_size = 4 << 20;
 };
 
-template <typename TKey,
-          typename TPrefix,
-          typename std::conditional<std::is_same<TPrefix, NoPrefix>::value,
-                                    typename NoPrefix::Type,
-                                    TPrefix>::type prefixValue>
-constexpr PrefixedNumericalKeyConverter<TKey, TPrefix>
-  PersistentQueue<TKey, TPrefix, prefixValue>::_conv;
+namespace internal {
+
+/*
+ * Internals of `PersistentQueue` used by the queues built on it, `QueueRegistry`,
+ * `PriorityPersistentQueue`, `ShardedPersistentQueue` and `PackedPersistentQueue`.
+ */
+struct QueueAccess {
+  // Initializes a queue with `prefix` recovered by the owner's iterator, see the private
+  // `PersistentQueue::Initialize`
+  template <typename TQueue, typename TPrefix>
+  static void Initialize(TQueue& queue,
+                         rocksdb::DB* db,
+                         rocksdb::ColumnFamilyHandle* column_family,
+                         PersistentQueueOptions const& options,
+                         TPrefix prefix,
+                         rocksdb::Iterator& it) {
+    queue.Initialize(db, column_family, options, prefix, it);
+  }
+
+  template <typename TQueue>
+  static uint64_t HeadId(TQueue& queue) {
+    return queue._head.load(std::memory_order_acquire);
+  }
+
+  // Reads the auxiliary record `tag` of `queue`, returns `false` if there is none
+  template <typename TQueue>
+  static bool ReadRecord(TQueue& queue, char tag, std::string& value) {
+    const auto status = queue.CallDb([&] {
+      return queue._db->Get(
+        rocksdb::ReadOptions(), queue._column_family, queue.ToAuxiliaryKey(tag), &value);
+    });
+    if (status.IsNotFound())
+      return false;
+    if (!status.ok())
+      throw Exception("Fatal error in RocksDB at `RocksDB::Get`: " + status.ToString(),
+                      CurrentLocation);
+    return true;
+  }
+
+  // Durably writes `value` into the auxiliary record `tag` of `queue`
+  template <typename TQueue>
+  static void WriteRecord(TQueue& queue, char tag, rocksdb::Slice const& value) {
+    const auto status = queue.CallDb([&] {
+      return queue._db->Put(
+        queue.makeWriteOptions(), queue._column_family, queue.ToAuxiliaryKey(tag), value);
+    });
+    if (!status.ok())
+      throw Exception("Fatal error in RocksDB at `RocksDB::Put`: " + status.ToString(),
+                      CurrentLocation);
+
+    queue.CommitWrite();
+  }
+
+  /*
+   * Pops the head item and in the same write puts `value` into the auxiliary record
+   * `tag`, or deletes the record if `value` is null. Returns `false` if the queue is
+   * empty.
+   */
+  template <typename TQueue>
+  static bool PopWithRecord(TQueue& queue, char tag, rocksdb::Slice const* value) {
+    rocksdb::WriteBatch batch;
+    if (value)
+      batch.Put(queue._column_family, queue.ToAuxiliaryKey(tag), *value);
+    else
+      batch.Delete(queue._column_family, queue.ToAuxiliaryKey(tag));
+    return queue.ConsumeOne(nullptr, &batch);
+  }
+
+  // Passes the values of all items from the head to `function(rocksdb::Slice value)`
+  template <typename TQueue, typename TFunction>
+  static void ForEachValue(TQueue& queue, TFunction&& function) {
+    const auto number = queue.Size();
+    if (number == 0)
+      return;
+
+    auto it = std::unique_ptr<rocksdb::Iterator>(
+      queue._db->NewIterator(rocksdb::ReadOptions(), queue._column_family));
+    if (!queue.SeekInRing(*it, queue._head.load(std::memory_order_acquire)))
+      throw Exception("Fatal logic failure: failed to seek a key that must exist",
+                      CurrentLocation);
+    for (size_t i = 0; i < number; ++i) {
+      if (i > 0 && !queue.NextInRing(*it))
+        throw Exception("Fatal logic failure: failed to find a key that must exist",
+                        CurrentLocation);
+      function(it->value());
+    }
+  }
+};
+}
 }
 
 #undef CurrentLocation
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+
+namespace perq {
+
+enum class Durability {
+  // Writes return once they are in the OS, a power loss can lose the latest writes
+  Async,
+  // Every write syncs the write-ahead log to the disk before it returns
+  Sync,
+  // Writes of concurrent callers are synced together with one sync of the write-ahead
+  // log, every caller returns once its write is on the disk
+  GroupCommit
+};
+
+struct PersistentQueueOptions {
+  // Maximum number of IDs that can be reserved concurrently, see `PersistentQueue.hpp`.
+  // Zero selects a default for the key type.
+  size_t max_thread_number = 0;
+
+  // Applies to every write of `Push`, `Pop`, `Poll` and leases
+  Durability durability = Durability::Async;
+
+  // A checkpoint of the head and the tail is written every `checkpoint_interval` pushed
+  // IDs and at the end of `Initialize`, so a restart after a crash checks only the IDs
+  // around them. Zero disables periodic checkpoints, `PersistentQueue::Checkpoint` can
+  // still be called explicitly.
+  size_t checkpoint_interval = 0;
+
+  // Consumed runs of at least this many IDs are deleted with one `DeleteRange` instead of
+  // a tombstone per key. Zero, the default, disables range deletes. Range tombstones slow
+  // down later reads and iterators over them, measure with the `push_poll_batch` workload
+  // of `perq_bench` before enabling them.
+  size_t range_delete_min_count = 0;
+
+  // A background thread compacts the consumed key range every time the head has moved
+  // over this many IDs, so reads of the head do not skip piles of tombstones. The thread
+  // checks the head every `compaction_check_interval`. Zero disables the thread, the
+  // queue must be destroyed before the database is closed otherwise.
+  size_t compaction_threshold = 0;
+  std::chrono::milliseconds compaction_check_interval = std::chrono::seconds(1);
+
+  // Number of recently pushed values kept in memory for `Top`/`Poll`/`Pop`, rounded up to
+  // a power of two. Zero disables the cache.
+  size_t hot_cache_capacity = 0;
+
+  // Values larger than this are not cached
+  size_t hot_cache_max_value_size = 4096;
+
+  // `Drain` moves the head and deletes consumed items once per this many items, at most
+  // `max_thread_number`, and reads ahead this many bytes of the key range
+  size_t drain_chunk_size = 1024;
+  size_t drain_readahead_size = 2 << 20;
+
+  // `PushStream` splits values into chunks of this many bytes, each under its own key
+  size_t stream_chunk_size = 1 << 20;
+};
+}
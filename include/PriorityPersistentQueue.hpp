@@ -0,0 +1,271 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <rocksdb/db.h>
+
+#include "Exception.hpp"
+#include "PersistentQueue.hpp"
+
+/*
+ * Queue with several priority levels, every level is a `PersistentQueue` with its own
+ * prefix in the same column family. Level 0 has the highest priority. Items of one level
+ * keep their order, items of different levels do not.
+ *
+ * `Strict` polls a level only when all levels above it are empty. `Weighted` goes
+ * through a schedule in which every level comes first `weights[level]` times out of
+ * `sum(weights)` polls, so a backlog of a low level still gets its share. Both skip
+ * empty levels, whether a level is empty is decided from its head and tail in memory,
+ * no RocksDB reads are issued for it.
+ *
+ */
+
+#define CurrentLocation perq_SourceLocation_CurrentLocation("PriorityPersistentQueue.hpp")
+
+namespace perq {
+
+enum class PriorityPolicy { Strict, Weighted };
+
+struct PriorityOptions {
+  PriorityPolicy policy = PriorityPolicy::Strict;
+
+  // Weights of levels for `Weighted`, highest priority first. Empty gives every level
+  // the same weight.
+  std::vector<size_t> weights;
+
+  // Applies to the queue of every level
+  PersistentQueueOptions queue_options;
+};
+
+template <typename TKey, typename TPrefix = uint8_t, typename TBackoff = YieldBackoff<>>
+class PriorityPersistentQueue {
+
+  static_assert(!std::is_same<TPrefix, NoPrefix>(), "Levels are told apart by prefixes");
+
+public:
+  using Queue = PersistentQueue<TKey, TPrefix, 0, TBackoff>;
+
+  PriorityPersistentQueue() : _db(), _next_ticket(0) {}
+
+  // `prefixes` are prefixes of levels, highest priority first
+  PriorityPersistentQueue(rocksdb::DB* db,
+                          std::vector<TPrefix> const& prefixes,
+                          PriorityOptions const& options = PriorityOptions())
+    : PriorityPersistentQueue() {
+    Initialize(db, prefixes, options);
+  }
+
+  PriorityPersistentQueue(rocksdb::DB* db,
+                          rocksdb::ColumnFamilyHandle* column_family,
+                          std::vector<TPrefix> const& prefixes,
+                          PriorityOptions const& options = PriorityOptions())
+    : PriorityPersistentQueue() {
+    Initialize(db, column_family, prefixes, options);
+  }
+
+  PriorityPersistentQueue(PriorityPersistentQueue const&) = delete;
+  PriorityPersistentQueue& operator=(PriorityPersistentQueue const&) = delete;
+
+  void Initialize(rocksdb::DB* db,
+                  std::vector<TPrefix> const& prefixes,
+                  PriorityOptions const& options = PriorityOptions()) {
+    Initialize(db, db->DefaultColumnFamily(), prefixes, options);
+  }
+
+  void Initialize(rocksdb::DB* db,
+                  rocksdb::ColumnFamilyHandle* column_family,
+                  std::vector<TPrefix> const& prefixes,
+                  PriorityOptions const& options = PriorityOptions()) {
+    if (_db)
+      throw Exception(
+        "Fatal error: attempt to initialize PriorityPersistentQueue for a second time",
+        CurrentLocation);
+
+    if (prefixes.empty())
+      throw Exception("At least one priority level is required", CurrentLocation);
+
+    for (size_t i = 0; i < prefixes.size(); ++i) {
+      for (size_t j = 0; j < i; ++j) {
+        if (prefixes[i] == prefixes[j])
+          throw Exception("Prefix " + std::to_string(prefixes[i])
+                            + " is used by two priority levels",
+                          CurrentLocation);
+      }
+    }
+
+    _policy = options.policy;
+    if (_policy == PriorityPolicy::Weighted)
+      _schedule = MakeSchedule(prefixes.size(), options.weights);
+
+    rocksdb::ReadOptions read_options;
+    read_options.total_order_seek = true;
+    auto it = std::unique_ptr<rocksdb::Iterator>(
+      db->NewIterator(read_options, column_family));
+
+    for (auto prefix : prefixes) {
+      _levels.emplace_back(new Queue());
+      internal::QueueAccess::Initialize(
+        *_levels.back(), db, column_family, options.queue_options, prefix, *it);
+    }
+
+    _db = db;
+  }
+
+  size_t LevelNumber() const { return _levels.size(); }
+
+  Queue& Level(size_t level) { return *_levels.at(level); }
+
+  size_t Size() {
+    size_t size = 0;
+    for (auto& level : _levels)
+      size += level->Size();
+    return size;
+  }
+
+  template <typename TValue>
+  bool Push(size_t level, TValue&& value) {
+    return _levels.at(level)->Push(std::forward<TValue>(value));
+  }
+
+  template <typename TRange>
+  bool PushBatch(size_t level, TRange const& values) {
+    return _levels.at(level)->PushBatch(values);
+  }
+
+  std::pair<std::string, bool> Poll() {
+    auto ret = std::pair<std::string, bool>();
+    ret.second = Poll(ret.first);
+    return ret;
+  }
+
+  // Polls into `value` reusing its capacity, `level` receives the level of the item
+  bool Poll(std::string& value, size_t* level = nullptr) {
+    const auto first = FirstLevel();
+    if (first != _levels.size() && PollLevel(first, value, level))
+      return true;
+
+    for (size_t i = 0; i < _levels.size(); ++i) {
+      if (i != first && PollLevel(i, value, level))
+        return true;
+    }
+
+    value.clear();
+    return false;
+  }
+
+  /*
+   * Polls up to `max_number` items, higher levels first. With `Weighted` every level
+   * first gets its share of `max_number`, shares of levels without enough items go to
+   * the other levels by priority.
+   */
+  std::vector<std::string> PollBatch(size_t max_number) {
+    std::vector<std::string> values;
+    auto left = max_number;
+
+    if (_policy == PriorityPolicy::Weighted) {
+      std::vector<size_t> shares(_levels.size(), 0);
+      for (auto level : _schedule)
+        ++shares[level];
+      for (size_t i = 0; i < _levels.size() && left > 0; ++i) {
+        const auto share = (max_number * shares[i] + _schedule.size() - 1)
+          / _schedule.size();
+        left -= PollLevelBatch(i, std::min(share, left), values);
+      }
+    }
+
+    for (size_t i = 0; i < _levels.size() && left > 0; ++i)
+      left -= PollLevelBatch(i, left, values);
+
+    return values;
+  }
+
+private:
+  // The level to try first, `LevelNumber()` if all levels seem empty
+  size_t FirstLevel() {
+    if (_policy == PriorityPolicy::Strict) {
+      for (size_t i = 0; i < _levels.size(); ++i) {
+        if (_levels[i]->Size() > 0)
+          return i;
+      }
+      return _levels.size();
+    }
+
+    const auto ticket = _next_ticket.fetch_add(1, std::memory_order_relaxed);
+    return _schedule[ticket % _schedule.size()];
+  }
+
+  bool PollLevel(size_t level, std::string& value, size_t* polled_level) {
+    auto& queue = *_levels[level];
+    if (queue.Size() == 0 || !queue.Poll(value))
+      return false;
+    if (polled_level)
+      *polled_level = level;
+    return true;
+  }
+
+  size_t PollLevelBatch(size_t level,
+                        size_t max_number,
+                        std::vector<std::string>& values) {
+    auto& queue = *_levels[level];
+    if (max_number == 0 || queue.Size() == 0)
+      return 0;
+    return queue.PollBatch(max_number, std::back_inserter(values));
+  }
+
+  /*
+   * Smooth weighted round robin: every level gains its weight on every step, the level
+   * with the most credit goes next and pays the sum of weights. Levels are interleaved
+   * instead of being polled in runs.
+   */
+  static std::vector<size_t> MakeSchedule(size_t level_number,
+                                          std::vector<size_t> weights) {
+    if (weights.empty())
+      weights.assign(level_number, 1);
+
+    if (weights.size() != level_number)
+      throw Exception("Number of weights (" + std::to_string(weights.size())
+                        + ") != the number of priority levels ("
+                        + std::to_string(level_number)
+                        + ")",
+                      CurrentLocation);
+
+    size_t total = 0;
+    for (auto weight : weights) {
+      if (weight == 0)
+        throw Exception("Weights of priority levels must be positive", CurrentLocation);
+      total += weight;
+    }
+
+    std::vector<size_t> schedule;
+    std::vector<long long> credits(level_number, 0);
+    for (size_t step = 0; step < total; ++step) {
+      size_t next = 0;
+      for (size_t i = 0; i < level_number; ++i) {
+        credits[i] += static_cast<long long>(weights[i]);
+        if (credits[i] > credits[next])
+          next = i;
+      }
+      credits[next] -= static_cast<long long>(total);
+      schedule.push_back(next);
+    }
+    return schedule;
+  }
+
+  rocksdb::DB* _db;
+  PriorityPolicy _policy = PriorityPolicy::Strict;
+  std::vector<std::unique_ptr<Queue>> _levels;
+
+  // Levels to try first, one entry per poll of a weighted round
+  std::vector<size_t> _schedule;
+  std::atomic<size_t> _next_ticket;
+};
+}
+
+#undef CurrentLocation
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include <rocksdb/cache.h>
+#include <rocksdb/convenience.h>
+#include <rocksdb/db.h>
+#include <rocksdb/filter_policy.h>
+#include <rocksdb/options.h>
+#include <rocksdb/slice_transform.h>
+#include <rocksdb/table.h>
+
+#include "Exception.hpp"
+#include "TypeHelpers.hpp"
+
+/*
+ * RocksDB options tuned for queues. Queue keys are big-endian IDs behind a fixed size
+ * prefix, they are written in order, read mostly at the head, and deleted soon after
+ * they were written. Every profile therefore uses level compaction with dynamic level
+ * sizes, so consumed ranges are dropped early, and a prefix extractor that matches the
+ * queue prefix, so seeks of one queue skip the files of the other queues.
+ *
+ * The prefix extractor is only set for a non-empty `TPrefix` and assumes that every key
+ * of the column family starts with a prefix of that size. Keys of other lengths are
+ * allowed, they fall out of the prefix domain.
+ *
+ * Profiles that compress use LZ4 only if RocksDB is built with it, and no compression
+ * otherwise. `Latency` is the default profile, it does not compress at all.
+ *
+ */
+
+#define CurrentLocation perq_SourceLocation_CurrentLocation("QueueDbOptions.hpp")
+
+namespace perq {
+
+enum class QueueProfile {
+  // Large memtables and background parallelism for bulk pushes and polls
+  Throughput,
+  // No compression, small blocks and pinned filters to keep every call short
+  Latency,
+  // Small memtables and block cache for many small queues or constrained hosts
+  LowMemory
+};
+
+namespace internal {
+// `preferred` if RocksDB is built with it, `kNoCompression` otherwise
+inline rocksdb::CompressionType SupportedCompression(rocksdb::CompressionType preferred) {
+  for (auto type : rocksdb::GetSupportedCompressions()) {
+    if (type == preferred)
+      return preferred;
+  }
+  return rocksdb::kNoCompression;
+}
+}
+
+inline rocksdb::DBOptions MakeQueueDbOptions(QueueProfile profile
+                                             = QueueProfile::Latency) {
+  rocksdb::DBOptions options;
+  options.create_if_missing = true;
+  options.create_missing_column_families = true;
+  // Consumed data is deleted soon, flushes and syncs are spread over small steps
+  options.bytes_per_sync = 1 << 20;
+  options.wal_bytes_per_sync = 1 << 20;
+
+  switch (profile) {
+  case QueueProfile::Throughput:
+    options.max_background_jobs = 4;
+    options.enable_pipelined_write = true;
+    options.max_total_wal_size = 512 << 20;
+    break;
+  case QueueProfile::Latency:
+    options.max_background_jobs = 4;
+    options.max_total_wal_size = 256 << 20;
+    break;
+  case QueueProfile::LowMemory:
+    options.max_background_jobs = 2;
+    options.max_total_wal_size = 64 << 20;
+    options.db_write_buffer_size = 32 << 20;
+    options.max_open_files = 256;
+    break;
+  }
+
+  return options;
+}
+
+template <typename TPrefix = NoPrefix>
+rocksdb::ColumnFamilyOptions MakeQueueColumnFamilyOptions(QueueProfile profile
+                                                          = QueueProfile::Latency) {
+  rocksdb::ColumnFamilyOptions options;
+  rocksdb::BlockBasedTableOptions table_options;
+
+  options.compaction_style = rocksdb::kCompactionStyleLevel;
+  options.level_compaction_dynamic_level_bytes = true;
+  if (internal::PrefixSize<TPrefix>::size > 0) {
+    options.prefix_extractor.reset(
+      rocksdb::NewFixedPrefixTransform(internal::PrefixSize<TPrefix>::size));
+  }
+
+  // Whole key filters serve `Get` of the head, the prefix ones serve seeks
+  table_options.filter_policy.reset(rocksdb::NewBloomFilterPolicy(10, false));
+  table_options.whole_key_filtering = true;
+  table_options.cache_index_and_filter_blocks = true;
+  table_options.pin_l0_filter_and_index_blocks_in_cache = true;
+
+  switch (profile) {
+  case QueueProfile::Throughput:
+    options.write_buffer_size = 128 << 20;
+    options.max_write_buffer_number = 4;
+    options.min_write_buffer_number_to_merge = 2;
+    options.target_file_size_base = 128 << 20;
+    options.max_bytes_for_level_base = 512 << 20;
+    options.compression = internal::SupportedCompression(rocksdb::kLZ4Compression);
+    table_options.block_size = 16 << 10;
+    table_options.block_cache = rocksdb::NewLRUCache(256 << 20);
+    break;
+  case QueueProfile::Latency:
+    options.write_buffer_size = 64 << 20;
+    options.max_write_buffer_number = 4;
+    options.level0_file_num_compaction_trigger = 2;
+    options.compression = rocksdb::kNoCompression;
+    options.memtable_prefix_bloom_size_ratio = 0.1;
+    table_options.block_size = 4 << 10;
+    table_options.block_cache = rocksdb::NewLRUCache(128 << 20);
+    break;
+  case QueueProfile::LowMemory:
+    options.write_buffer_size = 8 << 20;
+    options.max_write_buffer_number = 2;
+    options.target_file_size_base = 16 << 20;
+    options.max_bytes_for_level_base = 64 << 20;
+    options.compression = internal::SupportedCompression(rocksdb::kLZ4Compression);
+    table_options.block_size = 16 << 10;
+    table_options.block_cache = rocksdb::NewLRUCache(8 << 20);
+    break;
+  }
+
+  options.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
+  return options;
+}
+
+template <typename TPrefix = NoPrefix>
+rocksdb::Options MakeQueueOptions(QueueProfile profile = QueueProfile::Latency) {
+  return rocksdb::Options(MakeQueueDbOptions(profile),
+                          MakeQueueColumnFamilyOptions<TPrefix>(profile));
+}
+
+/*
+ * Opens or creates the database at `path` with `MakeQueueOptions`, throws `Exception` on
+ * failure.
+ */
+template <typename TPrefix = NoPrefix>
+std::unique_ptr<rocksdb::DB>
+  OpenQueueDb(std::string const& path, QueueProfile profile = QueueProfile::Latency) {
+  auto db = (rocksdb::DB*){};
+  const auto status = rocksdb::DB::Open(MakeQueueOptions<TPrefix>(profile), path, &db);
+  if (!status.ok()) {
+    throw Exception("Failed to open the queue database at '" + path
+                      + "': " + status.ToString(),
+                    CurrentLocation);
+  }
+  return std::unique_ptr<rocksdb::DB>(db);
+}
+}
+
+#undef CurrentLocation
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+#include <boost/endian/conversion.hpp>
+
+#include <rocksdb/db.h>
+
+#include "Exception.hpp"
+#include "PersistentQueue.hpp"
+
+/*
+ * Queues of many topics sharing one column family, every topic is a `PersistentQueue`
+ * whose prefix is the topic ID given at runtime instead of a template parameter. Topic
+ * keys are the same as keys of `PersistentQueue<TKey, TPrefix, topic>`, so both can
+ * open the same data.
+ *
+ * `Initialize` recovers all topics found in the column family in one ordered pass: a
+ * single iterator seeks the first key of the next prefix, the topic of that prefix is
+ * recovered with the same iterator, and the pass continues after its key range. Every
+ * key of the column family must therefore belong to a topic.
+ *
+ * Topics are looked up by their ID in a table of all prefix values, so the prefix type
+ * may have at most 16 bits. The registry owns the queues, it must be destroyed before
+ * its database is closed.
+ *
+ */
+
+#define CurrentLocation perq_SourceLocation_CurrentLocation("QueueRegistry.hpp")
+
+namespace perq {
+template <typename TKey, typename TPrefix, typename TBackoff = YieldBackoff<>>
+class QueueRegistry {
+
+  static_assert(!std::is_same<TPrefix, NoPrefix>(), "Topics are told apart by prefixes");
+  static_assert(sizeof(TPrefix) <= 2, "Prefix type must have at most 16 bits");
+
+public:
+  using Queue = PersistentQueue<TKey, TPrefix, 0, TBackoff>;
+
+  QueueRegistry() : _db(), _column_family(), _queues(topic_number) {}
+
+  QueueRegistry(rocksdb::DB* db,
+                PersistentQueueOptions const& options = PersistentQueueOptions())
+    : QueueRegistry() {
+    Initialize(db, options);
+  }
+
+  QueueRegistry(rocksdb::DB* db,
+                rocksdb::ColumnFamilyHandle* column_family,
+                PersistentQueueOptions const& options = PersistentQueueOptions())
+    : QueueRegistry() {
+    Initialize(db, column_family, options);
+  }
+
+  QueueRegistry(QueueRegistry const&) = delete;
+  QueueRegistry& operator=(QueueRegistry const&) = delete;
+
+  void Initialize(rocksdb::DB* db,
+                  PersistentQueueOptions const& options = PersistentQueueOptions()) {
+    Initialize(db, db->DefaultColumnFamily(), options);
+  }
+
+  // `options` apply to every topic, including topics opened later with `Open`
+  void Initialize(rocksdb::DB* db,
+                  rocksdb::ColumnFamilyHandle* column_family,
+                  PersistentQueueOptions const& options = PersistentQueueOptions()) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (_db)
+      throw Exception(
+        "Fatal error: attempt to initialize QueueRegistry for a second time",
+        CurrentLocation);
+
+    _db = db;
+    _column_family = column_family;
+    _options = options;
+
+    auto it = NewIterator();
+    size_t next_topic = 0;
+    while (next_topic < topic_number) {
+      auto seek_key = boost::endian::native_to_big(static_cast<TPrefix>(next_topic));
+      it->Seek(rocksdb::Slice(reinterpret_cast<char const*>(&seek_key), sizeof(TPrefix)));
+      if (!it->Valid()) {
+        if (!it->status().ok())
+          throw Exception(
+            "Fatal error in RocksDB at `Iterator`: " + it->status().ToString(),
+            CurrentLocation);
+        break;
+      }
+
+      if (it->key().size() < sizeof(TKey))
+        throw Exception("Fatal queue data state: a found key size ("
+                          + std::to_string(it->key().size())
+                          + ") is less than the key size ("
+                          + std::to_string(sizeof(TKey))
+                          + ")",
+                        CurrentLocation);
+
+      TPrefix topic;
+      std::memcpy(&topic, it->key().data(), sizeof(TPrefix));
+      topic = boost::endian::big_to_native(topic);
+
+      Add(topic, *it);
+      next_topic = static_cast<size_t>(topic) + 1;
+    }
+  }
+
+  // The queue of `topic`, `nullptr` if the topic is not open
+  Queue* Find(TPrefix topic) { return _queues[topic].load(std::memory_order_acquire); }
+
+  // The queue of `topic`, throws if the topic is not open
+  Queue& Get(TPrefix topic) {
+    auto queue = Find(topic);
+    if (!queue)
+      throw Exception("Topic " + std::to_string(topic) + " is not open", CurrentLocation);
+    return *queue;
+  }
+
+  // The queue of `topic`, a topic that is not open yet is recovered with its own scan
+  Queue& Open(TPrefix topic) {
+    if (auto queue = Find(topic))
+      return *queue;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_db)
+      throw Exception("QueueRegistry is not initialized", CurrentLocation);
+
+    if (auto queue = _queues[topic].load(std::memory_order_relaxed))
+      return *queue;
+
+    auto it = NewIterator();
+    return Add(topic, *it);
+  }
+
+  // IDs of open topics in ascending order
+  std::vector<TPrefix> Topics() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::vector<TPrefix> topics;
+    topics.reserve(_owned_queues.size());
+    for (size_t topic = 0; topic < topic_number; ++topic) {
+      if (_queues[topic].load(std::memory_order_relaxed))
+        topics.push_back(static_cast<TPrefix>(topic));
+    }
+    return topics;
+  }
+
+  size_t TopicNumber() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _owned_queues.size();
+  }
+
+private:
+  // `_mutex` must be locked
+  Queue& Add(TPrefix topic, rocksdb::Iterator& it) {
+    auto queue = std::unique_ptr<Queue>(new Queue());
+    internal::QueueAccess::Initialize(*queue, _db, _column_family, _options, topic, it);
+    _owned_queues.push_back(std::move(queue));
+    _queues[topic].store(_owned_queues.back().get(), std::memory_order_release);
+    return *_owned_queues.back();
+  }
+
+  // The pass goes over the prefixes of all topics, prefix seeks would stop at the first
+  std::unique_ptr<rocksdb::Iterator> NewIterator() {
+    rocksdb::ReadOptions options;
+    options.total_order_seek = true;
+    return std::unique_ptr<rocksdb::Iterator>(_db->NewIterator(options, _column_family));
+  }
+
+  static constexpr size_t topic_number = size_t(1) << (sizeof(TPrefix) * 8);
+
+  rocksdb::DB* _db;
+  rocksdb::ColumnFamilyHandle* _column_family;
+  PersistentQueueOptions _options;
+
+  // Guards opening of topics, lookups go without it
+  std::mutex _mutex;
+  std::vector<std::atomic<Queue*>> _queues;
+  std::vector<std::unique_ptr<Queue>> _owned_queues;
+};
+}
+
+#undef CurrentLocation
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "Stats.hpp"
+
+namespace perq {
+
+/*
+ * State of a queue at one moment, see `PersistentQueue::Snapshot`. `Delta` of two
+ * snapshots gives the stats counts of the interval between them, the other fields are
+ * kept as they are in the later snapshot.
+ */
+struct QueueSnapshot {
+  std::chrono::steady_clock::time_point time = {};
+  // Length of the interval of a delta, zero for a snapshot
+  std::chrono::steady_clock::duration interval = {};
+
+  size_t size = 0;
+  uint64_t head = 0;
+  uint64_t tail = 0;
+  size_t lease_size = 0;
+
+  // Properties of the RocksDB column family, shared by all queues in it. Zero if the
+  // database does not provide them.
+  uint64_t pending_compaction_bytes = 0;
+  uint64_t memtable_bytes = 0;
+  // Deletes in the active and immutable memtables, tombstones that are not flushed yet
+  uint64_t memtable_delete_number = 0;
+  uint64_t estimated_key_number = 0;
+
+  // Stats are zero unless the queue is built with `perq_WITH_STATS`
+  bool is_with_stats = false;
+  StatsSnapshot stats;
+
+  QueueSnapshot Delta(QueueSnapshot const& previous) const {
+    auto delta = *this;
+    delta.interval = time - previous.time;
+    delta.stats = stats.Delta(previous.stats);
+    return delta;
+  }
+};
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+
+namespace perq {
+
+// Describes what `PersistentQueue::Initialize` had to do to find the head and the tail
+struct RecoveryInfo {
+  // Whether the head and the tail were found from a checkpoint instead of a full scan
+  bool is_from_checkpoint = false;
+
+  // Number of items moved to close gaps left by a crash
+  size_t moved_number = 0;
+
+  std::chrono::steady_clock::duration duration = {};
+};
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <type_traits>
+
+/*
+ * Counter for statistics updated by many threads. Every thread adds to one of
+ * `shard_number` shards, each on its own cache line, so concurrent updates do not bounce
+ * a shared line between cores. Reads sum all shards and are therefore slower than
+ * updates; a read concurrent with updates sees some of them.
+ *
+ * Shards are padded instead of aligned, so containing objects need no over-aligned
+ * allocation.
+ *
+ */
+
+namespace perq {
+namespace internal {
+// Index of the calling thread, assigned on the first call
+inline size_t ThreadIndex() {
+  static std::atomic<size_t> next_index = {0};
+  thread_local const size_t index = next_index.fetch_add(1, std::memory_order_relaxed);
+  return index;
+}
+}
+
+template <typename T>
+class ShardedCounter {
+  static_assert(std::is_integral<T>(), "Counter type must be integral");
+
+public:
+  static constexpr size_t shard_number = 16;
+  static constexpr size_t cache_line_size = 64;
+
+  ShardedCounter() = default;
+  ShardedCounter(ShardedCounter const&) = delete;
+  ShardedCounter& operator=(ShardedCounter const&) = delete;
+
+  void fetch_add(T value, std::memory_order order = std::memory_order_relaxed) {
+    GetShard().value.fetch_add(value, order);
+  }
+
+  ShardedCounter& operator+=(T value) {
+    fetch_add(value);
+    return *this;
+  }
+
+  ShardedCounter& operator++() {
+    fetch_add(1);
+    return *this;
+  }
+
+  T load(std::memory_order order = std::memory_order_relaxed) const {
+    T sum = 0;
+    for (auto const& shard : _shards)
+      sum += shard.value.load(order);
+    return sum;
+  }
+
+  operator T() const { return load(); }
+
+  void Reset() {
+    for (auto& shard : _shards)
+      shard.value.store(0, std::memory_order_relaxed);
+  }
+
+private:
+  struct Shard {
+    std::atomic<T> value = {0};
+    char padding[cache_line_size - sizeof(std::atomic<T>)];
+  };
+
+  Shard& GetShard() { return _shards[internal::ThreadIndex() % shard_number]; }
+
+  Shard _shards[shard_number];
+};
+}
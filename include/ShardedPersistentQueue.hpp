@@ -0,0 +1,183 @@
+#pragma once
+
+#include <iterator>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <rocksdb/db.h>
+
+#include "Exception.hpp"
+#include "PersistentQueue.hpp"
+#include "ShardedCounter.hpp"
+
+/*
+ * Queue split into shards, every shard is a `PersistentQueue` with its own prefix, head
+ * and tail in the same column family, so producers and consumers of different shards do
+ * not contend for the same atomics.
+ *
+ * A thread pushes to its own shard, chosen by the thread's index, and goes to the next
+ * shards only when its shard is full. A consumer polls its own shard first and steals
+ * from the next shards when it is empty. Items keep their order within a shard only.
+ * Whether a shard is empty is decided from its head and tail in memory.
+ *
+ */
+
+#define CurrentLocation perq_SourceLocation_CurrentLocation("ShardedPersistentQueue.hpp")
+
+namespace perq {
+template <typename TKey, typename TPrefix = uint8_t, typename TBackoff = YieldBackoff<>>
+class ShardedPersistentQueue {
+
+  static_assert(!std::is_same<TPrefix, NoPrefix>(), "Shards are told apart by prefixes");
+
+public:
+  using Queue = PersistentQueue<TKey, TPrefix, 0, TBackoff>;
+
+  ShardedPersistentQueue() : _db() {}
+
+  // `prefixes` are prefixes of shards, one per shard
+  ShardedPersistentQueue(rocksdb::DB* db,
+                         std::vector<TPrefix> const& prefixes,
+                         PersistentQueueOptions const& options = PersistentQueueOptions())
+    : ShardedPersistentQueue() {
+    Initialize(db, prefixes, options);
+  }
+
+  ShardedPersistentQueue(rocksdb::DB* db,
+                         rocksdb::ColumnFamilyHandle* column_family,
+                         std::vector<TPrefix> const& prefixes,
+                         PersistentQueueOptions const& options = PersistentQueueOptions())
+    : ShardedPersistentQueue() {
+    Initialize(db, column_family, prefixes, options);
+  }
+
+  ShardedPersistentQueue(ShardedPersistentQueue const&) = delete;
+  ShardedPersistentQueue& operator=(ShardedPersistentQueue const&) = delete;
+
+  void Initialize(rocksdb::DB* db,
+                  std::vector<TPrefix> const& prefixes,
+                  PersistentQueueOptions const& options = PersistentQueueOptions()) {
+    Initialize(db, db->DefaultColumnFamily(), prefixes, options);
+  }
+
+  // `options` apply to every shard
+  void Initialize(rocksdb::DB* db,
+                  rocksdb::ColumnFamilyHandle* column_family,
+                  std::vector<TPrefix> const& prefixes,
+                  PersistentQueueOptions const& options = PersistentQueueOptions()) {
+    if (_db)
+      throw Exception(
+        "Fatal error: attempt to initialize ShardedPersistentQueue for a second time",
+        CurrentLocation);
+
+    if (prefixes.empty())
+      throw Exception("At least one shard is required", CurrentLocation);
+
+    for (size_t i = 0; i < prefixes.size(); ++i) {
+      for (size_t j = 0; j < i; ++j) {
+        if (prefixes[i] == prefixes[j])
+          throw Exception(
+            "Prefix " + std::to_string(prefixes[i]) + " is used by two shards",
+            CurrentLocation);
+      }
+    }
+
+    rocksdb::ReadOptions read_options;
+    read_options.total_order_seek = true;
+    auto it = std::unique_ptr<rocksdb::Iterator>(
+      db->NewIterator(read_options, column_family));
+
+    for (auto prefix : prefixes) {
+      _shards.emplace_back(new Queue());
+      internal::QueueAccess::Initialize(
+        *_shards.back(), db, column_family, options, prefix, *it);
+    }
+
+    _db = db;
+  }
+
+  size_t ShardNumber() const { return _shards.size(); }
+
+  Queue& Shard(size_t shard) { return *_shards.at(shard); }
+
+  // Sum of the sizes of all shards, shards are read one after another
+  size_t Size() {
+    size_t size = 0;
+    for (auto& shard : _shards)
+      size += shard->Size();
+    return size;
+  }
+
+  // Returns `false` only if all shards are full
+  template <typename TValue>
+  bool Push(TValue const& value) {
+    const auto first = OwnShard();
+    for (size_t i = 0; i < _shards.size(); ++i) {
+      if (_shards[(first + i) % _shards.size()]->Push(value))
+        return true;
+    }
+    return false;
+  }
+
+  // Pushes all values to one shard, so they keep their order
+  template <typename TRange>
+  bool PushBatch(TRange const& values) {
+    const auto first = OwnShard();
+    for (size_t i = 0; i < _shards.size(); ++i) {
+      if (_shards[(first + i) % _shards.size()]->PushBatch(values))
+        return true;
+    }
+    return false;
+  }
+
+  std::pair<std::string, bool> Poll() {
+    auto ret = std::pair<std::string, bool>();
+    ret.second = Poll(ret.first);
+    return ret;
+  }
+
+  bool Poll(std::string& value) {
+    const auto first = OwnShard();
+    for (size_t i = 0; i < _shards.size(); ++i) {
+      auto& shard = *_shards[(first + i) % _shards.size()];
+      if (shard.Size() > 0 && shard.Poll(value))
+        return true;
+    }
+    value.clear();
+    return false;
+  }
+
+  bool Pop() {
+    const auto first = OwnShard();
+    for (size_t i = 0; i < _shards.size(); ++i) {
+      auto& shard = *_shards[(first + i) % _shards.size()];
+      if (shard.Size() > 0 && shard.Pop())
+        return true;
+    }
+    return false;
+  }
+
+  // Polls up to `max_number` items, the own shard first
+  std::vector<std::string> PollBatch(size_t max_number) {
+    std::vector<std::string> values;
+    const auto first = OwnShard();
+    for (size_t i = 0; i < _shards.size() && values.size() < max_number; ++i) {
+      auto& shard = *_shards[(first + i) % _shards.size()];
+      if (shard.Size() > 0)
+        shard.PollBatch(max_number - values.size(), std::back_inserter(values));
+    }
+    return values;
+  }
+
+private:
+  size_t OwnShard() { return internal::ThreadIndex() % _shards.size(); }
+
+  rocksdb::DB* _db;
+  std::vector<std::unique_ptr<Queue>> _shards;
+};
+}
+
+#undef CurrentLocation
@@ -1,59 +1,265 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
+
+#include "Histogram.hpp"
+#include "ShardedCounter.hpp"
 
 #if defined(perq_WITH_STATS) && !defined(preq_DISABLE_STATS_OPERATIONS)
 #define perq_LocalStats LocalStats perq_local_stats = {0};
 #define perq_IncrementLocalCasRepetitionCount ++perq_local_stats.cas_repetition_count;
 #define perq_IncrementLocalYieldCount ++perq_local_stats.yield_count;
 #define perq_IncrementLocalGetMissCount ++perq_local_stats.get_miss_count;
+#define perq_IncrementLocalHotCacheHitCount ++perq_local_stats.hot_cache_hit_count;
+#define perq_IncrementLocalHotCacheMissCount ++perq_local_stats.hot_cache_miss_count;
 #define perq_IncrementShiftUpCount ++_stats.shift_up_count;
+#define perq_IncrementRangeDeleteCount ++_stats.range_delete_count;
+#define perq_IncrementCompactionFailureCount ++_stats.compaction_failure_count;
+#define perq_AddCompactionStats(compacted_id_number)                                     \
+  ++_stats.compaction_count;                                                             \
+  _stats.compacted_id_count += compacted_id_number;
 #define perq_MergeLocalStatsForTop _stats.MergeLocalStatsForTop(perq_local_stats);
 #define perq_MergeLocalStatsForPop _stats.MergeLocalStatsForPop(perq_local_stats);
 #define perq_MergeLocalStatsForPoll _stats.MergeLocalStatsForPoll(perq_local_stats);
 #define perq_MergeLocalStatsForPush _stats.MergeLocalStatsForPush(perq_local_stats);
+#define perq_TimeOperation(histograms)                                                  \
+  OperationTimer perq_operation_timer(histograms);
+#define perq_RecordValueSize(size) _stats.value_size_histogram.Record(size);
 #else
 #define perq_LocalStats (void)0;
 #define perq_IncrementLocalCasRepetitionCount (void)0;
 #define perq_IncrementLocalYieldCount (void)0;
 #define perq_IncrementLocalGetMissCount (void)0;
+#define perq_IncrementLocalHotCacheHitCount (void)0;
+#define perq_IncrementLocalHotCacheMissCount (void)0;
 #define perq_IncrementShiftUpCount (void)0;
+#define perq_IncrementRangeDeleteCount (void)0;
+#define perq_IncrementCompactionFailureCount (void)0;
+#define perq_AddCompactionStats(compacted_id_number) (void)0;
 #define perq_MergeLocalStatsForTop (void)0;
 #define perq_MergeLocalStatsForPop (void)0;
 #define perq_MergeLocalStatsForPoll (void)0;
 #define perq_MergeLocalStatsForPush (void)0;
+#define perq_TimeOperation(histograms) (void)0;
+#define perq_RecordValueSize(size) (void)0;
 #endif
 
 namespace perq {
+namespace internal {
+// Time the calling thread has spent in RocksDB, see `PersistentQueue::CallDb`
+inline uint64_t& DbNanoseconds() {
+  thread_local uint64_t nanoseconds = 0;
+  return nanoseconds;
+}
+}
+
+struct OperationHistogramsSnapshot {
+  HistogramSnapshot latency;
+  HistogramSnapshot queue_latency;
+  HistogramSnapshot db_latency;
+
+  OperationHistogramsSnapshot Delta(OperationHistogramsSnapshot const& previous) const {
+    return {latency.Delta(previous.latency),
+            queue_latency.Delta(previous.queue_latency),
+            db_latency.Delta(previous.db_latency)};
+  }
+};
+
+/*
+ * Plain copy of `Stats`. `Delta` gives the counts of an interval between two snapshots,
+ * maxima are kept as they are.
+ */
+struct StatsSnapshot {
+  size_t top_yield_count = 0;
+  size_t top_get_miss_count = 0;
+
+  size_t pop_cas_repetion_count = 0;
+  size_t pop_yield_count = 0;
+  size_t pop_get_miss_count = 0;
+
+  size_t poll_cas_repetion_count = 0;
+  size_t poll_yield_count = 0;
+  size_t poll_get_miss_count = 0;
+
+  size_t push_cas_repetion_count = 0;
+  size_t push_yield_count = 0;
+
+  size_t shift_up_count = 0;
+
+  size_t range_delete_count = 0;
+  size_t compaction_count = 0;
+  size_t compacted_id_count = 0;
+  size_t compaction_failure_count = 0;
+
+  size_t hot_cache_hit_count = 0;
+  size_t hot_cache_miss_count = 0;
+
+  size_t push_cas_repetion_max_count = 0;
+  size_t push_cas_yield_max_count = 0;
+
+  OperationHistogramsSnapshot top_histograms;
+  OperationHistogramsSnapshot pop_histograms;
+  OperationHistogramsSnapshot poll_histograms;
+  OperationHistogramsSnapshot push_histograms;
+  OperationHistogramsSnapshot push_batch_histograms;
+  OperationHistogramsSnapshot poll_batch_histograms;
+  OperationHistogramsSnapshot pop_batch_histograms;
+  OperationHistogramsSnapshot drain_histograms;
+  OperationHistogramsSnapshot lease_histograms;
+  HistogramSnapshot value_size_histogram;
+
+  StatsSnapshot Delta(StatsSnapshot const& previous) const {
+    auto delta = *this;
+    delta.top_yield_count -= previous.top_yield_count;
+    delta.top_get_miss_count -= previous.top_get_miss_count;
+    delta.pop_cas_repetion_count -= previous.pop_cas_repetion_count;
+    delta.pop_yield_count -= previous.pop_yield_count;
+    delta.pop_get_miss_count -= previous.pop_get_miss_count;
+    delta.poll_cas_repetion_count -= previous.poll_cas_repetion_count;
+    delta.poll_yield_count -= previous.poll_yield_count;
+    delta.poll_get_miss_count -= previous.poll_get_miss_count;
+    delta.push_cas_repetion_count -= previous.push_cas_repetion_count;
+    delta.push_yield_count -= previous.push_yield_count;
+    delta.shift_up_count -= previous.shift_up_count;
+    delta.range_delete_count -= previous.range_delete_count;
+    delta.compaction_count -= previous.compaction_count;
+    delta.compacted_id_count -= previous.compacted_id_count;
+    delta.compaction_failure_count -= previous.compaction_failure_count;
+    delta.hot_cache_hit_count -= previous.hot_cache_hit_count;
+    delta.hot_cache_miss_count -= previous.hot_cache_miss_count;
+    delta.top_histograms = top_histograms.Delta(previous.top_histograms);
+    delta.pop_histograms = pop_histograms.Delta(previous.pop_histograms);
+    delta.poll_histograms = poll_histograms.Delta(previous.poll_histograms);
+    delta.push_histograms = push_histograms.Delta(previous.push_histograms);
+    delta.push_batch_histograms
+      = push_batch_histograms.Delta(previous.push_batch_histograms);
+    delta.poll_batch_histograms
+      = poll_batch_histograms.Delta(previous.poll_batch_histograms);
+    delta.pop_batch_histograms
+      = pop_batch_histograms.Delta(previous.pop_batch_histograms);
+    delta.drain_histograms = drain_histograms.Delta(previous.drain_histograms);
+    delta.lease_histograms = lease_histograms.Delta(previous.lease_histograms);
+    delta.value_size_histogram
+      = value_size_histogram.Delta(previous.value_size_histogram);
+    return delta;
+  }
+};
+
+/*
+ * Latencies of one operation in nanoseconds: of the whole call, of the RocksDB calls made
+ * by it and of the rest, which is the queue protocol (CAS loops, yields, caches).
+ */
+struct OperationHistograms {
+  Histogram latency;
+  Histogram queue_latency;
+  Histogram db_latency;
+
+  OperationHistogramsSnapshot Snapshot() const {
+    return {latency.Snapshot(), queue_latency.Snapshot(), db_latency.Snapshot()};
+  }
+
+  void Record(uint64_t nanoseconds, uint64_t db_nanoseconds) {
+    latency.Record(nanoseconds);
+    db_latency.Record(db_nanoseconds);
+    queue_latency.Record(nanoseconds > db_nanoseconds ? nanoseconds - db_nanoseconds : 0);
+  }
+};
+
+// Records the lifetime of the timer into `histograms`
+class OperationTimer {
+public:
+  explicit OperationTimer(OperationHistograms& histograms)
+    : _histograms(histograms), _start(std::chrono::steady_clock::now()),
+      _db_start(internal::DbNanoseconds()) {}
+
+  OperationTimer(OperationTimer const&) = delete;
+  OperationTimer& operator=(OperationTimer const&) = delete;
+
+  ~OperationTimer() {
+    const auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - _start);
+    _histograms.Record(static_cast<uint64_t>(duration.count()),
+                       internal::DbNanoseconds() - _db_start);
+  }
+
+private:
+  OperationHistograms& _histograms;
+  std::chrono::steady_clock::time_point _start;
+  uint64_t _db_start;
+};
+
 struct LocalStats {
   size_t cas_repetition_count = 0;
   size_t yield_count = 0;
   size_t get_miss_count = 0;
+  size_t hot_cache_hit_count = 0;
+  size_t hot_cache_miss_count = 0;
 };
 
+/*
+ * Counters and histograms are sharded per thread and read by summing the shards, see
+ * `ShardedCounter.hpp` and `Histogram.hpp`. Operations still count into `LocalStats`
+ * first and merge it once per call.
+ *
+ * A histogram allocates 8 shards of about 4 KiB, 32 KiB, when it records its first
+ * value. A queue built with stats that uses every operation holds 28 histograms, about
+ * 900 KiB, one that only pushes and polls holds 7, about 220 KiB. Budget for that per
+ * queue, e.g. with many queues in a `QueueRegistry`.
+ */
 struct Stats {
-  std::atomic<size_t> top_yield_count = {};
-  std::atomic<size_t> top_get_miss_count = {};
+  ShardedCounter<size_t> top_yield_count;
+  ShardedCounter<size_t> top_get_miss_count;
+
+  ShardedCounter<size_t> pop_cas_repetion_count;
+  ShardedCounter<size_t> pop_yield_count;
+  ShardedCounter<size_t> pop_get_miss_count;
 
-  std::atomic<size_t> pop_cas_repetion_count = {};
-  std::atomic<size_t> pop_yield_count = {};
-  std::atomic<size_t> pop_get_miss_count = {};
+  ShardedCounter<size_t> poll_cas_repetion_count;
+  ShardedCounter<size_t> poll_yield_count;
+  ShardedCounter<size_t> poll_get_miss_count;
 
-  std::atomic<size_t> poll_cas_repetion_count = {};
-  std::atomic<size_t> poll_yield_count = {};
-  std::atomic<size_t> poll_get_miss_count = {};
+  ShardedCounter<size_t> push_cas_repetion_count;
+  ShardedCounter<size_t> push_yield_count;
 
-  std::atomic<size_t> push_cas_repetion_count = {};
-  std::atomic<size_t> push_yield_count = {};
+  // Maxima are written rarely, they are kept off the cache lines of the counters
+  char max_count_padding_front[ShardedCounter<size_t>::cache_line_size] = {};
   std::atomic<size_t> push_cas_repetion_max_count = {};
   std::atomic<size_t> push_cas_yield_max_count = {};
+  char max_count_padding_back[ShardedCounter<size_t>::cache_line_size] = {};
 
-  std::atomic<size_t> shift_up_count = {};
+  ShardedCounter<size_t> shift_up_count;
+
+  ShardedCounter<size_t> range_delete_count;
+  ShardedCounter<size_t> compaction_count;
+  ShardedCounter<size_t> compacted_id_count;
+  ShardedCounter<size_t> compaction_failure_count;
+
+  ShardedCounter<size_t> hot_cache_hit_count;
+  ShardedCounter<size_t> hot_cache_miss_count;
+
+  OperationHistograms top_histograms;
+  OperationHistograms pop_histograms;
+  OperationHistograms poll_histograms;
+  OperationHistograms push_histograms;
+
+  // Batch calls record one latency per call, `drain_histograms` one per chunk without
+  // the callback
+  OperationHistograms push_batch_histograms;
+  OperationHistograms poll_batch_histograms;
+  OperationHistograms pop_batch_histograms;
+  OperationHistograms drain_histograms;
+  OperationHistograms lease_histograms;
+
+  // Sizes of pushed values in bytes
+  Histogram value_size_histogram;
 
   void MergeLocalStatsForTop(LocalStats const& stats) {
     top_yield_count += stats.yield_count;
     top_get_miss_count += stats.get_miss_count;
+    MergeHotCacheStats(stats);
   }
 
   void MergeLocalStatsForPop(LocalStats const& stats) {
@@ -61,6 +267,7 @@ struct Stats {
       pop_cas_repetion_count += stats.cas_repetition_count - 1;
     pop_yield_count += stats.yield_count;
     pop_get_miss_count += stats.get_miss_count;
+    MergeHotCacheStats(stats);
   }
 
   void MergeLocalStatsForPoll(LocalStats const& stats) {
@@ -68,6 +275,7 @@ struct Stats {
       poll_cas_repetion_count += stats.cas_repetition_count - 1;
     poll_yield_count += stats.yield_count;
     poll_get_miss_count += stats.get_miss_count;
+    MergeHotCacheStats(stats);
   }
 
   void MergeLocalStatsForPush(LocalStats const& stats) {
@@ -87,6 +295,50 @@ struct Stats {
       push_cas_yield_max_count.store(stats.cas_repetition_count,
                                      std::memory_order_relaxed);
   }
+
+  StatsSnapshot Snapshot() const {
+    StatsSnapshot snapshot;
+    snapshot.top_yield_count = top_yield_count.load();
+    snapshot.top_get_miss_count = top_get_miss_count.load();
+    snapshot.pop_cas_repetion_count = pop_cas_repetion_count.load();
+    snapshot.pop_yield_count = pop_yield_count.load();
+    snapshot.pop_get_miss_count = pop_get_miss_count.load();
+    snapshot.poll_cas_repetion_count = poll_cas_repetion_count.load();
+    snapshot.poll_yield_count = poll_yield_count.load();
+    snapshot.poll_get_miss_count = poll_get_miss_count.load();
+    snapshot.push_cas_repetion_count = push_cas_repetion_count.load();
+    snapshot.push_yield_count = push_yield_count.load();
+    snapshot.shift_up_count = shift_up_count.load();
+    snapshot.range_delete_count = range_delete_count.load();
+    snapshot.compaction_count = compaction_count.load();
+    snapshot.compacted_id_count = compacted_id_count.load();
+    snapshot.compaction_failure_count = compaction_failure_count.load();
+    snapshot.hot_cache_hit_count = hot_cache_hit_count.load();
+    snapshot.hot_cache_miss_count = hot_cache_miss_count.load();
+    snapshot.push_cas_repetion_max_count
+      = push_cas_repetion_max_count.load(std::memory_order_relaxed);
+    snapshot.push_cas_yield_max_count
+      = push_cas_yield_max_count.load(std::memory_order_relaxed);
+    snapshot.top_histograms = top_histograms.Snapshot();
+    snapshot.pop_histograms = pop_histograms.Snapshot();
+    snapshot.poll_histograms = poll_histograms.Snapshot();
+    snapshot.push_histograms = push_histograms.Snapshot();
+    snapshot.push_batch_histograms = push_batch_histograms.Snapshot();
+    snapshot.poll_batch_histograms = poll_batch_histograms.Snapshot();
+    snapshot.pop_batch_histograms = pop_batch_histograms.Snapshot();
+    snapshot.drain_histograms = drain_histograms.Snapshot();
+    snapshot.lease_histograms = lease_histograms.Snapshot();
+    snapshot.value_size_histogram = value_size_histogram.Snapshot();
+    return snapshot;
+  }
+
+  void MergeHotCacheStats(LocalStats const& stats) {
+    if (stats.hot_cache_hit_count)
+      hot_cache_hit_count.fetch_add(stats.hot_cache_hit_count, std::memory_order_relaxed);
+    if (stats.hot_cache_miss_count)
+      hot_cache_miss_count.fetch_add(stats.hot_cache_miss_count,
+                                     std::memory_order_relaxed);
+  }
 };
 
 bool operator==(Stats const& lhs, Stats const& rhs) {
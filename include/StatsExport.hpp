@@ -0,0 +1,314 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "QueueSnapshot.hpp"
+
+/*
+ * Exporters of `QueueSnapshot` in the Prometheus text exposition format and in JSON.
+ *
+ * Prometheus gets cumulative snapshots, rates are computed by the scraper. Latencies are
+ * exported as summaries in seconds with the 0.5, 0.99 and 0.999 quantiles. Several
+ * queues are written with one call, so every metric family is written once with a
+ * `queue` label per queue.
+ *
+ * JSON gets a snapshot or a delta, `interval_seconds` is non-zero for the latter.
+ *
+ */
+
+namespace perq {
+namespace internal {
+
+struct CounterExport {
+  char const* name;
+  char const* metric;
+  char const* operation;
+  char const* help;
+  size_t StatsSnapshot::*value;
+};
+
+// Sorted by `metric`, every metric is one Prometheus family
+inline std::vector<CounterExport> const& CounterExports() {
+  static const std::vector<CounterExport> exports = {
+    {"top_yield_count", "perq_yields_total", "top", "Yields in busy loops",
+     &StatsSnapshot::top_yield_count},
+    {"pop_yield_count", "perq_yields_total", "pop", "", &StatsSnapshot::pop_yield_count},
+    {"poll_yield_count", "perq_yields_total", "poll", "",
+     &StatsSnapshot::poll_yield_count},
+    {"push_yield_count", "perq_yields_total", "push", "",
+     &StatsSnapshot::push_yield_count},
+    {"top_get_miss_count", "perq_get_misses_total", "top",
+     "Reads of IDs that were not written yet or deleted already",
+     &StatsSnapshot::top_get_miss_count},
+    {"pop_get_miss_count", "perq_get_misses_total", "pop", "",
+     &StatsSnapshot::pop_get_miss_count},
+    {"poll_get_miss_count", "perq_get_misses_total", "poll", "",
+     &StatsSnapshot::poll_get_miss_count},
+    {"pop_cas_repetion_count", "perq_cas_repetitions_total", "pop",
+     "Repeated compare-and-swap attempts", &StatsSnapshot::pop_cas_repetion_count},
+    {"poll_cas_repetion_count", "perq_cas_repetitions_total", "poll", "",
+     &StatsSnapshot::poll_cas_repetion_count},
+    {"push_cas_repetion_count", "perq_cas_repetitions_total", "push", "",
+     &StatsSnapshot::push_cas_repetion_count},
+    {"shift_up_count", "perq_shift_ups_total", nullptr,
+     "Items moved up to close gaps on startup", &StatsSnapshot::shift_up_count},
+    {"range_delete_count", "perq_range_deletes_total", nullptr,
+     "Range deletes of consumed IDs", &StatsSnapshot::range_delete_count},
+    {"compaction_count", "perq_compactions_total", nullptr,
+     "Compactions of consumed IDs", &StatsSnapshot::compaction_count},
+    {"compacted_id_count", "perq_compacted_ids_total", nullptr, "Compacted consumed IDs",
+     &StatsSnapshot::compacted_id_count},
+    {"compaction_failure_count", "perq_compaction_failures_total", nullptr,
+     "Failed compactions of consumed IDs", &StatsSnapshot::compaction_failure_count},
+    {"hot_cache_hit_count", "perq_hot_cache_hits_total", nullptr, "Hot cache hits",
+     &StatsSnapshot::hot_cache_hit_count},
+    {"hot_cache_miss_count", "perq_hot_cache_misses_total", nullptr, "Hot cache misses",
+     &StatsSnapshot::hot_cache_miss_count}};
+  return exports;
+}
+
+struct OperationExport {
+  char const* name;
+  OperationHistogramsSnapshot StatsSnapshot::*histograms;
+};
+
+inline std::vector<OperationExport> const& OperationExports() {
+  static const std::vector<OperationExport> exports
+    = {{"top", &StatsSnapshot::top_histograms},
+       {"pop", &StatsSnapshot::pop_histograms},
+       {"poll", &StatsSnapshot::poll_histograms},
+       {"push", &StatsSnapshot::push_histograms},
+       {"push_batch", &StatsSnapshot::push_batch_histograms},
+       {"poll_batch", &StatsSnapshot::poll_batch_histograms},
+       {"pop_batch", &StatsSnapshot::pop_batch_histograms},
+       {"drain", &StatsSnapshot::drain_histograms},
+       {"lease", &StatsSnapshot::lease_histograms}};
+  return exports;
+}
+
+inline std::string EscapeLabel(std::string const& value) {
+  std::string escaped;
+  for (auto c : value) {
+    if (c == '\\' || c == '"')
+      escaped += '\\';
+    if (c == '\n') {
+      escaped += "\\n";
+      continue;
+    }
+    escaped += c;
+  }
+  return escaped;
+}
+
+class PrometheusWriter {
+public:
+  using Queues = std::vector<std::pair<std::string, QueueSnapshot>>;
+
+  PrometheusWriter(std::ostream& out, Queues const& queues)
+    : _out(out), _queues(queues) {}
+
+  void WriteHeader(char const* metric, char const* help, char const* type) {
+    _out << "# HELP " << metric << ' ' << help << "\n# TYPE " << metric << ' ' << type
+         << '\n';
+  }
+
+  // `labels` are appended to the queue label, e.g. `,operation="push"`
+  template <typename TValue>
+  void WriteSamples(std::string const& metric, std::string const& labels, TValue value) {
+    for (auto const& queue : _queues) {
+      if (!IsIncluded(metric, queue.second))
+        continue;
+      _out << metric << "{queue=\"" << EscapeLabel(queue.first) << '"' << labels << "} "
+           << value(queue.second) << '\n';
+    }
+  }
+
+  // Summary of `histogram` scaled by `scale`, e.g. nanoseconds to seconds
+  template <typename THistogram>
+  void WriteSummary(std::string const& metric,
+                    std::string const& labels,
+                    double scale,
+                    THistogram histogram) {
+    for (auto quantile : {"0.5", "0.99", "0.999"}) {
+      const auto quantile_labels = labels + ",quantile=\"" + quantile + '"';
+      WriteSamples(metric, quantile_labels, [&](QueueSnapshot const& s) {
+        return histogram(s).Percentile(std::stod(quantile)) * scale;
+      });
+    }
+    WriteSamples(metric + "_sum", labels, [&](QueueSnapshot const& s) {
+      return histogram(s).sum * scale;
+    });
+    WriteSamples(metric + "_count", labels, [&](QueueSnapshot const& s) {
+      return histogram(s).Count();
+    });
+  }
+
+private:
+  // Stats metrics are left out for queues without stats
+  static bool IsIncluded(std::string const& metric, QueueSnapshot const& snapshot) {
+    return snapshot.is_with_stats || metric.compare(0, 11, "perq_queue_") == 0
+      || metric.compare(0, 13, "perq_rocksdb_") == 0;
+  }
+
+  std::ostream& _out;
+  Queues const& _queues;
+};
+
+inline void WriteJsonHistogram(std::ostream& out, HistogramSnapshot const& histogram) {
+  out << "{\"count\": " << histogram.Count() << ", \"sum\": " << histogram.sum
+      << ", \"mean\": " << histogram.Mean() << ", \"p50\": " << histogram.Percentile(0.5)
+      << ", \"p99\": " << histogram.Percentile(0.99)
+      << ", \"p999\": " << histogram.Percentile(0.999) << ", \"max\": " << histogram.Max()
+      << '}';
+}
+}
+
+/*
+ * Writes the snapshots of several queues, `queues` pairs a queue name, used as the
+ * `queue` label, with its snapshot.
+ */
+inline void
+  WritePrometheus(std::ostream& out,
+                  std::vector<std::pair<std::string, QueueSnapshot>> const& queues) {
+  const auto precision = out.precision(9);
+  auto writer = internal::PrometheusWriter(out, queues);
+
+  using Gauge = uint64_t (*)(QueueSnapshot const&);
+  const std::tuple<char const*, char const*, Gauge> gauges[] = {
+    std::make_tuple("perq_queue_size",
+                    "Number of items in the queue",
+                    [](QueueSnapshot const& s) -> uint64_t { return s.size; }),
+    std::make_tuple("perq_queue_head_id",
+                    "ID of the head item",
+                    [](QueueSnapshot const& s) -> uint64_t { return s.head; }),
+    std::make_tuple("perq_queue_tail_id",
+                    "ID the next pushed item receives",
+                    [](QueueSnapshot const& s) -> uint64_t { return s.tail; }),
+    std::make_tuple("perq_queue_lease_size",
+                    "Number of leased items",
+                    [](QueueSnapshot const& s) -> uint64_t { return s.lease_size; }),
+    std::make_tuple(
+      "perq_rocksdb_pending_compaction_bytes",
+      "Estimated bytes compaction needs to rewrite",
+      [](QueueSnapshot const& s) -> uint64_t { return s.pending_compaction_bytes; }),
+    std::make_tuple("perq_rocksdb_memtable_bytes",
+                    "Size of all memtables",
+                    [](QueueSnapshot const& s) -> uint64_t { return s.memtable_bytes; }),
+    std::make_tuple(
+      "perq_rocksdb_memtable_deletes",
+      "Delete tombstones in the memtables",
+      [](QueueSnapshot const& s) -> uint64_t { return s.memtable_delete_number; }),
+    std::make_tuple(
+      "perq_rocksdb_estimated_keys",
+      "Estimated number of keys",
+      [](QueueSnapshot const& s) -> uint64_t { return s.estimated_key_number; })};
+  for (auto const& gauge : gauges) {
+    writer.WriteHeader(std::get<0>(gauge), std::get<1>(gauge), "gauge");
+    writer.WriteSamples(std::get<0>(gauge), "", std::get<2>(gauge));
+  }
+
+  std::string metric;
+  for (auto const& counter : internal::CounterExports()) {
+    if (metric != counter.metric) {
+      metric = counter.metric;
+      writer.WriteHeader(counter.metric, counter.help, "counter");
+    }
+    const auto labels = counter.operation
+      ? std::string(",operation=\"") + counter.operation + '"'
+      : std::string();
+    const auto member = counter.value;
+    writer.WriteSamples(
+      metric, labels, [member](QueueSnapshot const& s) { return s.stats.*member; });
+  }
+
+  writer.WriteHeader("perq_push_cas_repetitions_max",
+                     "Most compare-and-swap attempts of one push",
+                     "gauge");
+  writer.WriteSamples("perq_push_cas_repetitions_max", "", [](QueueSnapshot const& s) {
+    return s.stats.push_cas_repetion_max_count;
+  });
+  writer.WriteHeader("perq_push_yields_max", "Most yields of one push", "gauge");
+  writer.WriteSamples("perq_push_yields_max", "", [](QueueSnapshot const& s) {
+    return s.stats.push_cas_yield_max_count;
+  });
+
+  writer.WriteHeader("perq_operation_latency_seconds",
+                     "Latency of queue operations, `part` splits it into RocksDB calls "
+                     "and the queue protocol",
+                     "summary");
+  using Part = HistogramSnapshot OperationHistogramsSnapshot::*;
+  const std::pair<char const*, Part> parts[]
+    = {{"total", &OperationHistogramsSnapshot::latency},
+       {"queue", &OperationHistogramsSnapshot::queue_latency},
+       {"db", &OperationHistogramsSnapshot::db_latency}};
+  for (auto const& operation : internal::OperationExports()) {
+    for (auto const& part : parts) {
+      const auto histograms = operation.histograms;
+      const auto histogram = part.second;
+      const auto labels = std::string(",operation=\"") + operation.name + "\",part=\""
+        + part.first + '"';
+      writer.WriteSummary("perq_operation_latency_seconds",
+                          labels,
+                          1e-9,
+                          [histograms, histogram](QueueSnapshot const& s) {
+                            return s.stats.*histograms.*histogram;
+                          });
+    }
+  }
+
+  writer.WriteHeader("perq_value_size_bytes", "Sizes of pushed values", "summary");
+  writer.WriteSummary("perq_value_size_bytes", "", 1, [](QueueSnapshot const& s) {
+    return s.stats.value_size_histogram;
+  });
+
+  out.precision(precision);
+}
+
+inline void WritePrometheus(std::ostream& out,
+                            std::string const& name,
+                            QueueSnapshot const& snapshot) {
+  WritePrometheus(out, {{name, snapshot}});
+}
+
+inline void WriteJson(std::ostream& out, QueueSnapshot const& snapshot) {
+  const auto interval = std::chrono::duration<double>(snapshot.interval).count();
+  out << "{\"interval_seconds\": " << interval << ", \"size\": " << snapshot.size
+      << ", \"head\": " << snapshot.head << ", \"tail\": " << snapshot.tail
+      << ", \"lease_size\": " << snapshot.lease_size << ", \"rocksdb\": {"
+      << "\"pending_compaction_bytes\": " << snapshot.pending_compaction_bytes
+      << ", \"memtable_bytes\": " << snapshot.memtable_bytes
+      << ", \"memtable_deletes\": " << snapshot.memtable_delete_number
+      << ", \"estimated_keys\": " << snapshot.estimated_key_number << '}';
+
+  if (snapshot.is_with_stats) {
+    auto const& stats = snapshot.stats;
+    out << ", \"stats\": {";
+    for (auto const& counter : internal::CounterExports())
+      out << '"' << counter.name << "\": " << stats.*counter.value << ", ";
+    out << "\"push_cas_repetion_max_count\": " << stats.push_cas_repetion_max_count
+        << ", \"push_cas_yield_max_count\": " << stats.push_cas_yield_max_count;
+
+    for (auto const& operation : internal::OperationExports()) {
+      auto const& histograms = stats.*operation.histograms;
+      out << ", \"" << operation.name << "_latency_ns\": ";
+      internal::WriteJsonHistogram(out, histograms.latency);
+      out << ", \"" << operation.name << "_queue_latency_ns\": ";
+      internal::WriteJsonHistogram(out, histograms.queue_latency);
+      out << ", \"" << operation.name << "_db_latency_ns\": ";
+      internal::WriteJsonHistogram(out, histograms.db_latency);
+    }
+    out << ", \"value_size_bytes\": ";
+    internal::WriteJsonHistogram(out, stats.value_size_histogram);
+    out << '}';
+  }
+
+  out << '}';
+}
+}
@@ -1,6 +1,13 @@
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <memory>
 #include <random>
+#include <sstream>
+#include <stdexcept>
 #include <string>
 
 #include <boost/endian/conversion.hpp>
@@ -13,7 +20,14 @@
 
 #define perq_WITH_STATS
 // #define preq_DISABLE_STATS_OPERATIONS
+#include <AsyncPersistentQueue.hpp>
+#include <PackedPersistentQueue.hpp>
 #include <PersistentQueue.hpp>
+#include <PriorityPersistentQueue.hpp>
+#include <QueueDbOptions.hpp>
+#include <QueueRegistry.hpp>
+#include <ShardedPersistentQueue.hpp>
+#include <StatsExport.hpp>
 
 namespace fs = boost::filesystem;
 
@@ -334,6 +348,193 @@ TEST_CASE("PersistentQueueIdCorrector basic", "[PersistentQueueIdCorrector][basi
     "Severe misuse of `PersistentQueueIdCorrector::FeedNext`: the queue is over then end for the second time");
 }
 
+TEST_CASE("GroupCommit", "[GroupCommit]") {
+  GroupCommit group_commit;
+  std::atomic<size_t> sync_number = {0};
+  std::atomic<bool> is_syncing = {false};
+  std::atomic<size_t> concurrent_sync_number = {0};
+  auto sync = [&]() {
+    if (is_syncing.exchange(true))
+      ++concurrent_sync_number;
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+    ++sync_number;
+    is_syncing = false;
+    return rocksdb::Status::OK();
+  };
+
+  SECTION("Single thread") {
+    for (size_t i = 0; i < 10; ++i)
+      REQUIRE(group_commit.Commit(sync).ok());
+    REQUIRE(sync_number == 10);
+  }
+
+  SECTION("Concurrent commits") {
+    const size_t thread_number = 8;
+    const size_t commit_number = 100;
+    std::atomic<size_t> failed_number = {0};
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < thread_number; ++t) {
+      threads.emplace_back([&] {
+        for (size_t i = 0; i < commit_number; ++i) {
+          if (!group_commit.Commit(sync).ok())
+            ++failed_number;
+        }
+      });
+    }
+    for (auto& thread : threads)
+      thread.join();
+
+    REQUIRE(failed_number == 0);
+    REQUIRE(concurrent_sync_number == 0);
+    REQUIRE(sync_number >= commit_number);
+    REQUIRE(sync_number <= thread_number * commit_number);
+  }
+
+  SECTION("Failed sync") {
+    REQUIRE(group_commit.Commit([]() { return rocksdb::Status::IOError("disk"); })
+              .IsIOError());
+    REQUIRE(group_commit.Commit(sync).ok());
+    REQUIRE(sync_number == 1);
+  }
+}
+
+TEST_CASE("Histogram", "[Histogram]") {
+  SECTION("Buckets") {
+    for (uint64_t value = 0; value < 100000; ++value) {
+      const auto index = Histogram::ToIndex(value);
+      REQUIRE(index < size_t(Histogram::bucket_number));
+      REQUIRE(Histogram::ToUpperBound(index) >= value);
+      if (index > 0)
+        REQUIRE(Histogram::ToUpperBound(index - 1) < value);
+      REQUIRE(Histogram::ToUpperBound(index) - value
+              <= value / Histogram::sub_bucket_number);
+    }
+    const auto max = std::numeric_limits<uint64_t>::max();
+    REQUIRE(Histogram::ToIndex(max) == Histogram::bucket_number - 1);
+    REQUIRE(Histogram::ToUpperBound(Histogram::bucket_number - 1) == max);
+  }
+
+  SECTION("Percentiles") {
+    Histogram histogram;
+    REQUIRE(histogram.Percentile(0.99) == 0);
+    REQUIRE(histogram.Max() == 0);
+
+    for (uint64_t value = 1; value <= 1000; ++value)
+      histogram.Record(value);
+    REQUIRE(histogram.Count() == 1000);
+    REQUIRE(histogram.Sum() == 500500);
+    REQUIRE(histogram.Mean() == Approx(500.5));
+    REQUIRE(histogram.Percentile(0.5) >= 500);
+    REQUIRE(histogram.Percentile(0.5) <= 500 + 500 / Histogram::sub_bucket_number);
+    REQUIRE(histogram.Percentile(0.99) >= 990);
+    REQUIRE(histogram.Percentile(0.99) <= 990 + 990 / Histogram::sub_bucket_number);
+    REQUIRE(histogram.Percentile(1) == histogram.Max());
+    REQUIRE(histogram.Max() >= 1000);
+
+    histogram.Reset();
+    REQUIRE(histogram.Count() == 0);
+    REQUIRE(histogram.Sum() == 0);
+  }
+
+  SECTION("Concurrent records") {
+    Histogram histogram;
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < 4; ++t) {
+      threads.emplace_back([&] {
+        for (uint64_t i = 0; i < 10000; ++i)
+          histogram.Record(i);
+      });
+    }
+    for (auto& thread : threads)
+      thread.join();
+    REQUIRE(histogram.Count() == 40000);
+  }
+}
+
+TEST_CASE("ShardedCounter", "[ShardedCounter]") {
+  ShardedCounter<size_t> counter;
+  REQUIRE(counter == 0);
+
+  const size_t thread_number = 2 * ShardedCounter<size_t>::shard_number;
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < thread_number; ++t) {
+    threads.emplace_back([&] {
+      for (size_t i = 0; i < 1000; ++i) {
+        ++counter;
+        counter += 2;
+      }
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+
+  REQUIRE(counter.load() == thread_number * 3000);
+  counter.Reset();
+  REQUIRE(counter == 0);
+}
+
+TEST_CASE("Backoff", "[Backoff]") {
+  SECTION("Yield") {
+    auto backoff = YieldBackoff<3>();
+    REQUIRE(!backoff.Wait());
+    REQUIRE(!backoff.Wait());
+    REQUIRE(!backoff.Wait());
+    REQUIRE(backoff.Wait());
+    REQUIRE(!backoff.Wait());
+    REQUIRE(!backoff.Wait());
+    REQUIRE(backoff.Wait());
+  }
+
+  SECTION("Spin") {
+    auto backoff = SpinBackoff<3>();
+    REQUIRE(!backoff.Wait());
+    REQUIRE(!backoff.Wait());
+    REQUIRE(!backoff.Wait());
+    REQUIRE(backoff.Wait());
+    REQUIRE(!backoff.Wait());
+    REQUIRE(!backoff.Wait());
+    REQUIRE(backoff.Wait());
+  }
+
+  SECTION("Exponential") {
+    auto backoff = ExponentialBackoff<1, 4>();
+    REQUIRE(!backoff.Wait());
+    REQUIRE(!backoff.Wait());
+    REQUIRE(!backoff.Wait());
+    REQUIRE(backoff.Wait());
+    REQUIRE(backoff.Wait());
+  }
+
+  SECTION("Park") {
+    auto backoff = ParkBackoff<2, 1, 2>();
+    REQUIRE(!backoff.Wait());
+    REQUIRE(!backoff.Wait());
+    REQUIRE(!backoff.Wait());
+    REQUIRE(backoff.Wait());
+    REQUIRE(backoff.Wait());
+  }
+}
+
+// Removes the database of a previous test, returns its path
+fs::path removeTestDb() {
+  auto path = fs::temp_directory_path() / "perq";
+  if (fs::exists(path))
+    fs::remove_all(path);
+  return path;
+}
+
+// Opens the database of the tests with `options`, a new one unless `is_reopened`
+std::unique_ptr<rocksdb::DB> openTestDb(rocksdb::Options options = rocksdb::Options(),
+                                        bool is_reopened = false) {
+  const auto path = is_reopened ? fs::temp_directory_path() / "perq" : removeTestDb();
+  options.create_if_missing = true;
+  auto db = (rocksdb::DB*){};
+  const auto status = rocksdb::DB::Open(options, path.string(), &db);
+  if (!status.ok())
+    REQUIRE(false);
+  return std::unique_ptr<rocksdb::DB>(db);
+}
+
 template <typename TKey, typename TPrefix>
 PersistentQueue<TKey, TPrefix, 231> createQueue(rocksdb::DB* db,
                                                 size_t max_thread_number
@@ -357,20 +558,7 @@ PersistentQueue<TKey> createQueue(rocksdb::DB* db,
 template <typename TKey>
 void PersistentQueueBasicTest(size_t max_thread_number
                               = std::numeric_limits<size_t>::max()) {
-  auto temp_directory_path = fs::temp_directory_path() / "perq";
-  if (fs::exists(temp_directory_path)) {
-    fs::remove_all(temp_directory_path);
-  }
-
-  std::unique_ptr<rocksdb::DB> db;
-  auto temp_db = (rocksdb::DB*){};
-  rocksdb::Options options;
-  options.create_if_missing = true;
-  rocksdb::Status status
-    = rocksdb::DB::Open(options, temp_directory_path.string(), &temp_db);
-  if (!status.ok())
-    REQUIRE(false);
-  db.reset(temp_db);
+  auto db = openTestDb();
 
   SECTION("New queue") {
     auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
@@ -429,6 +617,43 @@ void PersistentQueueBasicTest(size_t max_thread_number
     REQUIRE(queue.Pop());
     REQUIRE(IsEmpty(queue));
 
+    // Zero-copy Top and buffer reusing Poll test
+    value = makeRandomString();
+    REQUIRE(queue.Push(value));
+    rocksdb::PinnableSlice pinned_value;
+    REQUIRE(queue.Top(pinned_value));
+    REQUIRE(pinned_value.ToString() == value);
+    REQUIRE(queue.Top(pinned_value));
+    REQUIRE(pinned_value.ToString() == value);
+    pinned_value.Reset();
+    auto buffer = std::string();
+    buffer.reserve(4000);
+    const auto buffer_data = buffer.data();
+    REQUIRE(queue.Poll(buffer));
+    REQUIRE(buffer == value);
+    REQUIRE(buffer.data() == buffer_data);
+    REQUIRE(!queue.Poll(buffer));
+    REQUIRE(buffer.empty());
+    REQUIRE(!queue.Top(pinned_value));
+    REQUIRE(IsEmpty(queue));
+
+    // Push overloads test
+    value1 = makeRandomString();
+    value2 = makeRandomString();
+    REQUIRE(queue.Push(rocksdb::Slice(value1)));
+    REQUIRE(queue.Push(value2.data(), value2.size()));
+    REQUIRE(queue.Push(std::string(value1)));
+    rocksdb::Slice parts[] = {rocksdb::Slice(value1), rocksdb::Slice(value2)};
+    REQUIRE(queue.Push(rocksdb::SliceParts(parts, 2)));
+    REQUIRE(queue.Push(rocksdb::SliceParts(parts, 0)));
+    REQUIRE(IsSize(queue, 5));
+    REQUIRE(queue.Poll() == std::pair<std::string, bool>(value1, true));
+    REQUIRE(queue.Poll() == std::pair<std::string, bool>(value2, true));
+    REQUIRE(queue.Poll() == std::pair<std::string, bool>(value1, true));
+    REQUIRE(queue.Poll() == std::pair<std::string, bool>(value1 + value2, true));
+    REQUIRE(queue.Poll() == std::pair<std::string, bool>("", true));
+    REQUIRE(IsEmpty(queue));
+
     // Fill the queue
     for (size_t i = 0; i < 100; ++i) {
       value = makeRandomString();
@@ -446,11 +671,7 @@ void PersistentQueueBasicTest(size_t max_thread_number
     }
 
     db.reset(nullptr);
-    status = rocksdb::DB::Open(options, temp_directory_path.string(), &temp_db);
-    if (!status.ok())
-      REQUIRE(false);
-
-    db.reset(temp_db);
+    db = openTestDb(rocksdb::Options(), true);
 
     REQUIRE(queue.stats() == Stats());
   }
@@ -485,11 +706,7 @@ void PersistentQueueBasicTest(size_t max_thread_number
     }
 
     db.reset(nullptr);
-    status = rocksdb::DB::Open(options, temp_directory_path.string(), &temp_db);
-    if (!status.ok())
-      REQUIRE(false);
-
-    db.reset(temp_db);
+    db = openTestDb(rocksdb::Options(), true);
 
     REQUIRE(queue.stats() == Stats());
   }
@@ -539,26 +756,74 @@ void PersistentQueueBasicTest(size_t max_thread_number
 
     REQUIRE(queue.stats() == Stats());
   }
+
+  SECTION("Latency histograms") {
+    auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+    while (queue.Pop())
+      ;
+    REQUIRE(queue.Push(std::string(100, 'a')));
+    REQUIRE(queue.PushBatch(std::vector<std::string>{"b", "c"}));
+    REQUIRE(queue.Top().second);
+    REQUIRE(queue.Poll().second);
+    REQUIRE(queue.Pop());
+    REQUIRE(queue.Poll().second);
+    REQUIRE(!queue.Poll().second);
+
+#if defined(perq_WITH_STATS) && !defined(preq_DISABLE_STATS_OPERATIONS)
+    auto const& stats = queue.stats();
+    REQUIRE(stats.push_histograms.latency.Count() == 1);
+    REQUIRE(stats.top_histograms.latency.Count() == 1);
+    REQUIRE(stats.poll_histograms.latency.Count() == 3);
+    // 99 items and the empty queue before the pushes
+    REQUIRE(stats.pop_histograms.latency.Count() == 101);
+    REQUIRE(stats.push_histograms.db_latency.Count() == 1);
+    REQUIRE(stats.push_histograms.db_latency.Sum() > 0);
+    REQUIRE(stats.push_histograms.db_latency.Sum()
+            <= stats.push_histograms.latency.Sum());
+    REQUIRE(stats.push_histograms.latency.Percentile(0.5)
+            >= stats.push_histograms.queue_latency.Percentile(0.5));
+    REQUIRE(stats.value_size_histogram.Count() == 3);
+    REQUIRE(stats.value_size_histogram.Sum() == 102);
+    REQUIRE(stats.value_size_histogram.Max() >= 100);
+#endif
+  }
+
+  SECTION("Batch latency histograms") {
+    auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+    while (queue.Pop())
+      ;
+    const auto values = std::vector<std::string>{"a", "b", "c", "d", "e", "f"};
+    REQUIRE(queue.PushBatch(values));
+    REQUIRE(queue.PushBatch(values));
+    REQUIRE(queue.PollBatch(2).size() == 2);
+    REQUIRE(queue.PopN(2) == 2);
+    REQUIRE(queue.Lease(2, std::chrono::seconds(60)).size() == 2);
+    REQUIRE(queue.Drain([](rocksdb::Slice const&) {}) == 6);
+
+#if defined(perq_WITH_STATS) && !defined(preq_DISABLE_STATS_OPERATIONS)
+    auto const& stats = queue.stats();
+    REQUIRE(stats.push_batch_histograms.latency.Count() == 2);
+    REQUIRE(stats.push_batch_histograms.db_latency.Sum() > 0);
+    REQUIRE(stats.push_histograms.latency.Count() == 0);
+    REQUIRE(stats.value_size_histogram.Count() == 12);
+    REQUIRE(stats.poll_batch_histograms.latency.Count() == 1);
+    REQUIRE(stats.pop_batch_histograms.latency.Count() == 1);
+    REQUIRE(stats.lease_histograms.latency.Count() == 1);
+    REQUIRE(stats.drain_histograms.latency.Count() >= 1);
+    REQUIRE(stats.poll_histograms.latency.Count() == 0);
+
+    // Histograms that record nothing are empty
+    REQUIRE(stats.top_histograms.latency.Count() == 0);
+    REQUIRE(stats.top_histograms.latency.Snapshot().Max() == 0);
+#endif
+  }
 }
 
 template <typename TKey>
 void PersistentQueueParallelTest(size_t operation_number,
                                  size_t max_thread_number
                                  = std::numeric_limits<size_t>::max()) {
-  auto temp_directory_path = fs::temp_directory_path() / "perq";
-  if (fs::exists(temp_directory_path)) {
-    fs::remove_all(temp_directory_path);
-  }
-
-  std::unique_ptr<rocksdb::DB> db;
-  auto temp_db = (rocksdb::DB*){};
-  rocksdb::Options options;
-  options.create_if_missing = true;
-  rocksdb::Status status
-    = rocksdb::DB::Open(options, temp_directory_path.string(), &temp_db);
-  if (!status.ok())
-    REQUIRE(false);
-  db.reset(temp_db);
+  auto db = openTestDb();
 
   SECTION("Parallel Top") {
     auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
@@ -722,8 +987,9 @@ void PersistentQueueParallelTest(size_t operation_number,
     std::cerr << "Parallel Push and Pop" << std::endl;
     std::cerr << "Pop get miss count: " << queue.stats().pop_get_miss_count << std::endl;
 
+    // A single consumer yields only while waiting for a value being pushed
     REQUIRE(queue.stats().pop_cas_repetion_count == 0);
-    REQUIRE(queue.stats().pop_yield_count == 0);
+    REQUIRE(queue.stats().pop_yield_count <= queue.stats().pop_get_miss_count);
     REQUIRE(queue.stats().push_cas_repetion_count == 0);
     REQUIRE(queue.stats().push_yield_count == 0);
     REQUIRE(queue.stats().push_cas_repetion_max_count == 0);
@@ -740,8 +1006,12 @@ void PersistentQueueParallelTest(size_t operation_number,
     });
     std::thread thread_two([&]() {
       for (size_t i = 0; i < operation_number / 2;) {
-        if (queue.Poll().second)
+        auto ret = queue.Poll();
+        if (ret.second) {
+          if (ret.first != "small")
+            throw std::runtime_error("Invalid value");
           ++i;
+        }
       }
     });
     thread_one.join();
@@ -753,14 +1023,38 @@ void PersistentQueueParallelTest(size_t operation_number,
     std::cerr << "Poll get miss count: " << queue.stats().poll_get_miss_count
               << std::endl;
 
+    // A single consumer yields only while waiting for a value being pushed
     REQUIRE(queue.stats().poll_cas_repetion_count == 0);
-    REQUIRE(queue.stats().poll_yield_count == 0);
+    REQUIRE(queue.stats().poll_yield_count <= queue.stats().poll_get_miss_count);
     REQUIRE(queue.stats().push_cas_repetion_count == 0);
     REQUIRE(queue.stats().push_yield_count == 0);
     REQUIRE(queue.stats().push_cas_repetion_max_count == 0);
     REQUIRE(queue.stats().push_cas_yield_max_count == 0);
   }
 
+  SECTION("Parallel Push batch and Poll batch") {
+    auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+    REQUIRE(IsEmpty(queue));
+
+    auto values = std::vector<std::string>(5, "small");
+    const auto number = operation_number / 2 / values.size() * values.size();
+
+    std::thread thread_one([&]() {
+      for (size_t i = 0; i < number;) {
+        if (queue.PushBatch(values))
+          i += values.size();
+      }
+    });
+    std::thread thread_two([&]() {
+      for (size_t i = 0; i < number;)
+        i += queue.PollBatch(7).size();
+    });
+    thread_one.join();
+    thread_two.join();
+
+    REQUIRE(IsEmpty(queue));
+  }
+
   SECTION("Parallel Push And Poll And Size") {
     auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
     REQUIRE(IsEmpty(queue));
@@ -797,26 +1091,1716 @@ void PersistentQueueParallelTest(size_t operation_number,
   }
 }
 
-TEST_CASE("PersistentQueue 16 basic", "[PersistentQueue][16][basic]") {
-  PersistentQueueBasicTest<uint16_t>(20);
-}
+template <typename TKey>
+void PersistentQueueBatchTest(size_t max_thread_number) {
+  auto db = openTestDb();
+
+  SECTION("Push batch") {
+    auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+    REQUIRE(IsEmpty(queue));
+
+    REQUIRE(queue.PushBatch(std::vector<std::string>()));
+    REQUIRE(IsEmpty(queue));
+
+    // Goes over the maximum ID for small keys
+    auto values = std::vector<std::string>(10);
+    for (size_t round = 0; round < 100; ++round) {
+      for (auto& value : values)
+        value = makeRandomString();
+      REQUIRE(queue.PushBatch(values));
+      REQUIRE(IsSize(queue, values.size()));
+      for (auto& value : values)
+        REQUIRE(queue.Poll() == std::pair<std::string, bool>(value, true));
+      REQUIRE(IsEmpty(queue));
+    }
+
+    REQUIRE_THROWS(queue.PushBatch(std::vector<std::string>(max_thread_number + 1)));
+    REQUIRE(IsEmpty(queue));
+
+    REQUIRE(queue.stats() == Stats());
+  }
+
+  SECTION("Push batch into full queue") {
+    if (sizeof(TKey) > 2)
+      return;
+
+    auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+    auto values = std::vector<std::string>(10, "small");
+    size_t size = 0;
+    while (queue.PushBatch(values))
+      size += values.size();
+
+    REQUIRE(IsSize(queue, size));
+    REQUIRE(queue.Push("small"));
+    REQUIRE(IsSize(queue, size + 1));
+    REQUIRE(!queue.PushBatch(values));
+    REQUIRE(IsSize(queue, size + 1));
+  }
+
+  SECTION("Poll batch") {
+    auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+    REQUIRE(queue.PollBatch(10).empty());
+    REQUIRE(queue.PopN(10) == 0);
+
+    auto values = std::vector<std::string>(25);
+    for (size_t round = 0; round < 30; ++round) {
+      for (auto& value : values)
+        value = makeRandomString();
+      REQUIRE(queue.PushBatch(values.begin(), values.begin() + 10));
+      REQUIRE(queue.PushBatch(values.begin() + 10, values.end()));
+      REQUIRE(IsSize(queue, 25));
+
+      REQUIRE(queue.PollBatch(0).empty());
+      REQUIRE(queue.PopN(0) == 0);
+
+      REQUIRE(queue.PollBatch(10)
+              == std::vector<std::string>(values.begin(), values.begin() + 10));
+      REQUIRE(IsSize(queue, 15));
+      REQUIRE(queue.PopN(1) == 1);
+      REQUIRE(IsSize(queue, 14));
+
+      auto polled = std::deque<std::string>();
+      REQUIRE(queue.PollBatch(9, std::back_inserter(polled)) == 9);
+      REQUIRE(std::equal(polled.begin(), polled.end(), values.begin() + 11));
+      REQUIRE(IsSize(queue, 5));
+      REQUIRE(queue.Top() == std::pair<std::string, bool>(values[20], true));
+
+      REQUIRE(queue.PopN(100) == 5);
+      REQUIRE(IsEmpty(queue));
+    }
+
+    // One claim moves the head over at most `max_thread_number` IDs
+    for (size_t i = 0; i < max_thread_number + 5; ++i)
+      REQUIRE(queue.Push("a"));
+    REQUIRE(queue.PollBatch(max_thread_number + 5).size() == max_thread_number);
+    REQUIRE(queue.PopN(max_thread_number + 5) == 5);
+    REQUIRE(IsEmpty(queue));
+
+    REQUIRE(queue.stats() == Stats());
+  }
+
+  SECTION("Partially written batches") {
+    std::vector<std::string> batches[3];
+    {
+      auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+      for (auto& batch : batches) {
+        for (size_t i = 0; i < 5; ++i)
+          batch.push_back(makeRandomString());
+        REQUIRE(queue.PushBatch(batch.begin(), batch.end()));
+      }
+      REQUIRE(IsSize(queue, 15));
+    }
+
+    // Simulates a crash, where the second batch was not written
+    auto converter = PrefixedNumericalKeyConverter<TKey, uint8_t>(231);
+    for (TKey id = 5; id < 10; ++id) {
+      auto key = converter.ToKey(id);
+      REQUIRE(
+        db->Delete(rocksdb::WriteOptions(),
+                   rocksdb::Slice(reinterpret_cast<char const*>(&key), sizeof(TKey)))
+          .ok());
+    }
 
-TEST_CASE("PersistentQueue 32 basic", "[PersistentQueue][32][basic]") {
-  PersistentQueueBasicTest<uint32_t>();
+    auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+    REQUIRE(IsSize(queue, 10));
+    for (auto& value : batches[0])
+      REQUIRE(queue.Poll() == std::pair<std::string, bool>(value, true));
+    for (auto& value : batches[2])
+      REQUIRE(queue.Poll() == std::pair<std::string, bool>(value, true));
+    REQUIRE(IsEmpty(queue));
+  }
 }
 
-TEST_CASE("PersistentQueue 64 basic", "[PersistentQueue][64][basic]") {
-  PersistentQueueBasicTest<uint64_t>();
+template <typename TKey>
+void PersistentQueueWaitTest(size_t operation_number, size_t max_thread_number) {
+  auto db = openTestDb();
+
+  SECTION("Wait timeout") {
+    auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+
+    auto start = std::chrono::steady_clock::now();
+    REQUIRE(!queue.PollWait(std::chrono::milliseconds(20)).second);
+    REQUIRE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(20));
+
+    start = std::chrono::steady_clock::now();
+    REQUIRE(!queue.TopWait(std::chrono::milliseconds(20)).second);
+    REQUIRE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(20));
+
+    REQUIRE(queue.Push("small"));
+    REQUIRE(queue.TopWait(std::chrono::hours(1))
+            == std::pair<std::string, bool>("small", true));
+    REQUIRE(queue.PollWait(std::chrono::hours(1))
+            == std::pair<std::string, bool>("small", true));
+    REQUIRE(IsEmpty(queue));
+  }
+
+  SECTION("Wait for Push") {
+    auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+
+    std::pair<std::string, bool> top;
+    std::pair<std::string, bool> poll;
+    std::thread thread_one([&]() {
+      top = queue.TopWait(std::chrono::hours(1));
+      poll = queue.PollWait(std::chrono::hours(1));
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    REQUIRE(queue.Push("small"));
+    thread_one.join();
+
+    REQUIRE(top == std::pair<std::string, bool>("small", true));
+    REQUIRE(poll == std::pair<std::string, bool>("small", true));
+
+    REQUIRE(IsEmpty(queue));
+  }
+
+  SECTION("Parallel wait") {
+    auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+
+    std::atomic<size_t> poll_number(0);
+    auto consume = [&]() {
+      while (poll_number < operation_number) {
+        if (queue.PollWait(std::chrono::milliseconds(10)).second)
+          ++poll_number;
+      }
+    };
+    std::thread thread_one(consume);
+    std::thread thread_two(consume);
+    std::thread thread_three([&]() {
+      for (size_t i = 0; i < operation_number;) {
+        if (i % 2 == 0 && queue.Push("small"))
+          ++i;
+        else if (i % 2 == 1 && queue.PushBatch(std::vector<std::string>(1, "small")))
+          ++i;
+      }
+    });
+    thread_one.join();
+    thread_two.join();
+    thread_three.join();
+
+    REQUIRE(poll_number == operation_number);
+    REQUIRE(IsEmpty(queue));
+  }
 }
 
-TEST_CASE("PersistentQueue 16 parallel", "[PersistentQueue][16][parallel]") {
-  PersistentQueueParallelTest<uint16_t>(234, 20);
+template <typename TKey>
+void PersistentQueueKeySpaceTest(size_t max_thread_number) {
+  auto db = openTestDb();
+
+  SECTION("Prefixed queues") {
+    auto queue_a = PersistentQueue<TKey, uint8_t, 231>(db.get(), max_thread_number);
+    auto queue_b = PersistentQueue<TKey, uint8_t, 232>(db.get(), max_thread_number);
+    auto queue_c = PersistentQueue<TKey, uint8_t, 230>(db.get(), max_thread_number);
+
+    for (size_t i = 0; i < 10; ++i) {
+      REQUIRE(queue_a.Push("a"));
+      REQUIRE(queue_b.Push("b"));
+      REQUIRE(queue_c.Push("c"));
+    }
+
+    auto queue_d = PersistentQueue<TKey, uint8_t, 231>(db.get(), max_thread_number);
+    REQUIRE(IsSize(queue_d, 10));
+    REQUIRE(queue_d.PopN(10) == 10);
+    REQUIRE(IsEmpty(queue_d));
+
+    auto queue_e = PersistentQueue<TKey, uint8_t, 232>(db.get(), max_thread_number);
+    REQUIRE(IsSize(queue_e, 10));
+    REQUIRE(queue_e.Top() == std::pair<std::string, bool>("b", true));
+
+    auto queue_f = PersistentQueue<TKey, uint8_t, 230>(db.get(), max_thread_number);
+    REQUIRE(IsSize(queue_f, 10));
+    REQUIRE(queue_f.Top() == std::pair<std::string, bool>("c", true));
+
+    auto queue_g = PersistentQueue<TKey, uint8_t, 231>(db.get(), max_thread_number);
+    REQUIRE(IsEmpty(queue_g));
+  }
+
+  SECTION("Column family queues") {
+    rocksdb::ColumnFamilyHandle* temp_handle;
+    REQUIRE(
+      db->CreateColumnFamily(rocksdb::ColumnFamilyOptions(), "a", &temp_handle).ok());
+    auto handle_a = std::unique_ptr<rocksdb::ColumnFamilyHandle>(temp_handle);
+    REQUIRE(
+      db->CreateColumnFamily(rocksdb::ColumnFamilyOptions(), "b", &temp_handle).ok());
+    auto handle_b = std::unique_ptr<rocksdb::ColumnFamilyHandle>(temp_handle);
+
+    {
+      auto queue_a = PersistentQueue<TKey>(db.get(), handle_a.get(), max_thread_number);
+      auto queue_b = PersistentQueue<TKey>(db.get(), handle_b.get(), max_thread_number);
+      auto queue_c = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+      REQUIRE(IsEmpty(queue_a));
+      REQUIRE(IsEmpty(queue_b));
+      REQUIRE(IsEmpty(queue_c));
+
+      for (size_t i = 0; i < 10; ++i) {
+        REQUIRE(queue_a.Push("a"));
+        REQUIRE(queue_b.PushBatch(std::vector<std::string>(2, "b")));
+        REQUIRE(queue_c.Push("c"));
+      }
+
+      REQUIRE(IsSize(queue_a, 10));
+      REQUIRE(IsSize(queue_b, 20));
+      REQUIRE(IsSize(queue_c, 10));
+      REQUIRE(queue_a.Poll() == std::pair<std::string, bool>("a", true));
+      REQUIRE(queue_b.PollBatch(2) == std::vector<std::string>(2, "b"));
+      REQUIRE(queue_c.Poll() == std::pair<std::string, bool>("c", true));
+    }
+
+    auto queue_a = PersistentQueue<TKey>(db.get(), handle_a.get(), max_thread_number);
+    auto queue_b = PersistentQueue<TKey>(db.get(), handle_b.get(), max_thread_number);
+    auto queue_c = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+    REQUIRE(IsSize(queue_a, 9));
+    REQUIRE(IsSize(queue_b, 18));
+    REQUIRE(IsSize(queue_c, 9));
+    REQUIRE(queue_a.PopN(100) == 9);
+    REQUIRE(queue_b.PopN(100) == 18);
+    REQUIRE(queue_c.PopN(100) == 9);
+    REQUIRE(IsEmpty(queue_a));
+    REQUIRE(IsEmpty(queue_b));
+    REQUIRE(IsEmpty(queue_c));
+  }
 }
 
-TEST_CASE("PersistentQueue 32 parallel", "[PersistentQueue][32][parallel]") {
-  PersistentQueueParallelTest<uint32_t>(100000);
+template <typename TKey>
+void PersistentQueueHotCacheTest(size_t operation_number, size_t max_thread_number) {
+  auto db = openTestDb();
+
+  auto queue_options = PersistentQueueOptions();
+  queue_options.max_thread_number = max_thread_number;
+  queue_options.hot_cache_capacity = 16;
+  queue_options.hot_cache_max_value_size = 8;
+
+  SECTION("Hot cache") {
+    auto queue = PersistentQueue<TKey>(db.get(), queue_options);
+    REQUIRE(queue.Push("small"));
+    REQUIRE(queue.Push("too large value"));
+    REQUIRE(queue.PushBatch(std::vector<std::string>{"a", "b"}));
+
+    REQUIRE(queue.Top() == std::pair<std::string, bool>("small", true));
+    REQUIRE(queue.Poll() == std::pair<std::string, bool>("small", true));
+    REQUIRE(queue.Top() == std::pair<std::string, bool>("too large value", true));
+    REQUIRE(queue.Pop());
+    REQUIRE(queue.Poll() == std::pair<std::string, bool>("a", true));
+    REQUIRE(queue.PollBatch(10) == std::vector<std::string>{"b"});
+    REQUIRE(IsEmpty(queue));
+
+#if defined(perq_WITH_STATS) && !defined(preq_DISABLE_STATS_OPERATIONS)
+    REQUIRE(queue.stats().hot_cache_hit_count == 3);
+    REQUIRE(queue.stats().hot_cache_miss_count == 2);
+#endif
+
+    // Values are still in RocksDB
+    REQUIRE(queue.Push("persisted"));
+    auto queue_reopened = PersistentQueue<TKey>(db.get(), queue_options);
+    REQUIRE(queue_reopened.Poll() == std::pair<std::string, bool>("persisted", true));
+  }
+
+  SECTION("Stale Put") {
+    auto cache = HotRingCache<TKey>();
+    cache.Reset(16, 8);
+    const auto is_valid = [] { return true; };
+    std::string value;
+
+    cache.Put(3, 20, rocksdb::Slice("new"), is_valid);
+    cache.Put(3, 4, rocksdb::Slice("stale"), is_valid);
+    REQUIRE(cache.Get(3, value));
+    REQUIRE(value == "new");
+
+    // A consumed value keeps its sequence, a stalled producer cannot put back an older
+    // one
+    cache.Erase(3);
+    cache.Put(3, 4, rocksdb::Slice("stale"), is_valid);
+    REQUIRE(!cache.Contains(3));
+
+    cache.Put(3, 21, rocksdb::Slice("stale"), [] { return false; });
+    REQUIRE(!cache.Contains(3));
+  }
+
+  SECTION("Wraparound") {
+    auto queue = PersistentQueue<TKey>(db.get(), queue_options);
+    for (size_t i = 0; i < operation_number; ++i) {
+      const auto value = std::to_string(i % 1000);
+      REQUIRE(queue.Push(value));
+      REQUIRE(queue.Push(value));
+      REQUIRE(queue.Poll() == std::pair<std::string, bool>(value, true));
+      REQUIRE(queue.Poll() == std::pair<std::string, bool>(value, true));
+      REQUIRE(IsEmpty(queue));
+    }
+  }
+
+  SECTION("Parallel Push and Poll") {
+    auto queue = PersistentQueue<TKey>(db.get(), queue_options);
+    const size_t thread_number = 4;
+    const size_t push_number = std::min<size_t>(operation_number, 1000);
+    std::atomic<size_t> poll_number = {0};
+    std::atomic<size_t> wrong_number = {0};
+    std::vector<std::thread> threads;
+
+    for (size_t t = 0; t < thread_number; ++t) {
+      threads.emplace_back([&, t] {
+        for (size_t i = 0; i < push_number;) {
+          if (queue.Push(std::to_string(t)))
+            ++i;
+        }
+      });
+      threads.emplace_back([&] {
+        while (poll_number < push_number * thread_number) {
+          auto value = queue.Poll();
+          if (!value.second)
+            continue;
+          ++poll_number;
+          if (value.first.size() != 1 || value.first[0] < '0' || value.first[0] > '3')
+            ++wrong_number;
+        }
+      });
+    }
+
+    for (auto& thread : threads)
+      thread.join();
+
+    REQUIRE(wrong_number == 0);
+    REQUIRE(IsEmpty(queue));
+  }
 }
 
-TEST_CASE("PersistentQueue 64 parallel", "[PersistentQueue][64][parallel]") {
-  PersistentQueueParallelTest<uint64_t>(100000);
+template <typename TKey>
+void PersistentQueueLeaseTest(size_t operation_number, size_t max_thread_number) {
+  auto db = openTestDb();
+
+  using Items = std::vector<std::pair<TKey, std::string>>;
+  const auto timeout = std::chrono::seconds(60);
+
+  SECTION("Lease and Ack") {
+    auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+    REQUIRE(queue.Lease(10, timeout).empty());
+    REQUIRE(queue.PushBatch(std::vector<std::string>{"a", "b", "c"}));
+
+    auto items = queue.Lease(2, timeout);
+    REQUIRE(items == Items{{0, "a"}, {1, "b"}});
+    REQUIRE(IsSize(queue, 1));
+    REQUIRE(queue.LeaseSize() == 2);
+
+    REQUIRE(queue.Ack(0));
+    REQUIRE(!queue.Ack(0));
+    REQUIRE(queue.Ack(1));
+    REQUIRE(!queue.Nack(1));
+    REQUIRE(queue.LeaseSize() == 0);
+
+    REQUIRE(queue.Poll() == std::pair<std::string, bool>("c", true));
+    REQUIRE(IsEmpty(queue));
+
+    auto queue_reopened = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+    REQUIRE(IsEmpty(queue_reopened));
+    REQUIRE(queue_reopened.LeaseSize() == 0);
+  }
+
+  SECTION("Nack") {
+    auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+    REQUIRE(queue.PushBatch(std::vector<std::string>{"a", "b"}));
+
+    auto items = queue.Lease(1, timeout);
+    REQUIRE(items == Items{{0, "a"}});
+    REQUIRE(queue.Nack(0));
+    REQUIRE(!queue.Ack(0));
+    REQUIRE(IsSize(queue, 2));
+
+    REQUIRE(queue.Lease(10, timeout) == Items{{1, "b"}, {2, "a"}});
+    REQUIRE(queue.Ack(1));
+    REQUIRE(queue.Ack(2));
+    REQUIRE(IsEmpty(queue));
+  }
+
+  SECTION("Expired lease") {
+    auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+    REQUIRE(queue.Push("a"));
+
+    REQUIRE(queue.Lease(1, std::chrono::milliseconds(0)) == Items{{0, "a"}});
+    REQUIRE(IsEmpty(queue));
+
+    REQUIRE(queue.Lease(1, timeout) == Items{{1, "a"}});
+    REQUIRE(!queue.Ack(0));
+    REQUIRE(queue.Ack(1));
+    REQUIRE(queue.LeaseSize() == 0);
+  }
+
+  SECTION("Reclaim expired leases") {
+    auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+    REQUIRE(queue.PushBatch(std::vector<std::string>{"a", "b"}));
+
+    REQUIRE(queue.Lease(1, std::chrono::milliseconds(0)) == Items{{0, "a"}});
+    REQUIRE(queue.ReclaimExpiredLeases() == 1);
+    REQUIRE(queue.ReclaimExpiredLeases() == 0);
+    REQUIRE(queue.LeaseSize() == 0);
+    REQUIRE(!queue.Nack(0));
+
+    REQUIRE(queue.Poll() == std::pair<std::string, bool>("b", true));
+    REQUIRE(queue.Poll() == std::pair<std::string, bool>("a", true));
+    REQUIRE(IsEmpty(queue));
+  }
+
+  SECTION("Leases after restart") {
+    {
+      auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+      REQUIRE(queue.PushBatch(std::vector<std::string>{"a", "b", "c"}));
+      REQUIRE(queue.Lease(2, timeout).size() == 2);
+      REQUIRE(queue.Ack(1));
+    }
+
+    // Leases of the previous run are pushed again when the queue is opened
+    auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+    REQUIRE(IsSize(queue, 2));
+    REQUIRE(queue.LeaseSize() == 0);
+    REQUIRE(queue.Lease(10, timeout) == Items{{2, "c"}, {3, "a"}});
+    REQUIRE(queue.Ack(2));
+    REQUIRE(queue.Ack(3));
+    REQUIRE(IsEmpty(queue));
+    REQUIRE(queue.LeaseSize() == 0);
+  }
+
+  SECTION("Parallel Lease") {
+    auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+    const size_t thread_number = 4;
+    std::atomic<size_t> ack_number = {0};
+    std::atomic<size_t> nack_number = {0};
+    std::vector<std::thread> threads;
+
+    for (size_t t = 0; t < thread_number; ++t) {
+      threads.emplace_back([&] {
+        for (size_t i = 0; i < operation_number;) {
+          if (queue.Push("small"))
+            ++i;
+        }
+      });
+      threads.emplace_back([&] {
+        while (ack_number < operation_number * thread_number) {
+          for (auto& item : queue.Lease(3, timeout)) {
+            // Every 7th item is returned to the queue once
+            if (item.first % 7 == 0 && nack_number < operation_number) {
+              ++nack_number;
+              queue.Nack(item.first);
+            }
+            else if (queue.Ack(item.first) && item.second == "small") {
+              ++ack_number;
+            }
+          }
+        }
+      });
+    }
+
+    for (auto& thread : threads)
+      thread.join();
+
+    REQUIRE(ack_number == operation_number * thread_number);
+    REQUIRE(IsEmpty(queue));
+    REQUIRE(queue.LeaseSize() == 0);
+  }
 }
+
+template <typename TKey>
+void PersistentQueueDurabilityTest(size_t operation_number, size_t max_thread_number) {
+  auto db = openTestDb();
+
+  auto queue_options = PersistentQueueOptions();
+  queue_options.max_thread_number = max_thread_number;
+
+  auto check = [&](Durability durability) {
+    queue_options.durability = durability;
+    {
+      auto queue = PersistentQueue<TKey>(db.get(), queue_options);
+      REQUIRE(queue.Push("a"));
+      REQUIRE(queue.PushBatch(std::vector<std::string>{"b", "c", "d"}));
+      REQUIRE(queue.Pop());
+      REQUIRE(queue.Poll() == std::pair<std::string, bool>("b", true));
+      REQUIRE(queue.PollBatch(1) == std::vector<std::string>{"c"});
+      auto items = queue.Lease(1, std::chrono::seconds(60));
+      REQUIRE(items.size() == 1);
+      REQUIRE(queue.Nack(items.front().first));
+    }
+
+    auto queue = PersistentQueue<TKey>(db.get(), queue_options);
+    REQUIRE(queue.Poll() == std::pair<std::string, bool>("d", true));
+    REQUIRE(IsEmpty(queue));
+  };
+
+  SECTION("Async") { check(Durability::Async); }
+
+  SECTION("Sync") { check(Durability::Sync); }
+
+  SECTION("Group commit") { check(Durability::GroupCommit); }
+
+  SECTION("Parallel group commit") {
+    queue_options.durability = Durability::GroupCommit;
+    auto queue = PersistentQueue<TKey>(db.get(), queue_options);
+    const size_t thread_number = 4;
+    std::atomic<size_t> poll_number = {0};
+    std::atomic<size_t> wrong_number = {0};
+    std::vector<std::thread> threads;
+
+    for (size_t t = 0; t < thread_number; ++t) {
+      threads.emplace_back([&] {
+        for (size_t i = 0; i < operation_number;) {
+          if (queue.Push("small"))
+            ++i;
+        }
+      });
+      threads.emplace_back([&] {
+        while (poll_number < operation_number * thread_number) {
+          auto value = queue.Poll();
+          if (!value.second)
+            continue;
+          ++poll_number;
+          if (value.first != "small")
+            ++wrong_number;
+        }
+      });
+    }
+
+    for (auto& thread : threads)
+      thread.join();
+
+    REQUIRE(wrong_number == 0);
+    REQUIRE(IsEmpty(queue));
+  }
+}
+
+template <typename TKey>
+void PersistentQueueCheckpointTest(size_t max_thread_number) {
+  auto db = openTestDb();
+
+  using Queue = PersistentQueue<TKey, uint8_t, 231>;
+  auto converter = PrefixedNumericalKeyConverter<TKey, uint8_t>(231);
+  auto remove = [&](TKey id) {
+    auto key = converter.ToKey(id);
+    REQUIRE(db->Delete(rocksdb::WriteOptions(),
+                       rocksdb::Slice(reinterpret_cast<char const*>(&key), sizeof(TKey)))
+              .ok());
+  };
+
+  auto queue_options = PersistentQueueOptions();
+  queue_options.max_thread_number = max_thread_number;
+
+  SECTION("Checkpoint") {
+    {
+      auto queue = Queue(db.get(), queue_options);
+      for (size_t i = 0; i < 100; ++i)
+        REQUIRE(queue.Push(std::to_string(i)));
+      REQUIRE(queue.PopN(10) == 10);
+      queue.Checkpoint();
+    }
+
+    auto queue = Queue(db.get(), queue_options);
+    REQUIRE(queue.recovery_info().is_from_checkpoint);
+    REQUIRE(queue.recovery_info().moved_number == 0);
+    REQUIRE(IsSize(queue, 90));
+    for (size_t i = 10; i < 100; ++i)
+      REQUIRE(queue.Poll() == std::pair<std::string, bool>(std::to_string(i), true));
+    REQUIRE(IsEmpty(queue));
+    queue.Checkpoint();
+
+    auto queue_empty = Queue(db.get(), queue_options);
+    REQUIRE(IsEmpty(queue_empty));
+    REQUIRE(queue_empty.Push("a"));
+    REQUIRE(queue_empty.Poll() == std::pair<std::string, bool>("a", true));
+  }
+
+  SECTION("Stale checkpoint") {
+    const size_t number = std::min<size_t>(converter.GetMaxId(), 100000);
+    {
+      auto queue = Queue(db.get(), queue_options);
+      REQUIRE(queue.Push("first"));
+      queue.Checkpoint();
+      for (size_t i = 0; i < number; ++i) {
+        REQUIRE(queue.Push(std::to_string(i)));
+        REQUIRE(queue.Pop());
+      }
+      REQUIRE(queue.PushBatch(std::vector<std::string>{"a", "b"}));
+    }
+
+    auto queue = Queue(db.get(), queue_options);
+    REQUIRE(IsSize(queue, 3));
+    REQUIRE(queue.PollBatch(3)
+            == std::vector<std::string>{std::to_string(number - 1), "a", "b"});
+  }
+
+  SECTION("Periodic checkpoints with crash gaps") {
+    queue_options.checkpoint_interval = 7;
+    {
+      auto queue = Queue(db.get(), queue_options);
+      for (size_t i = 0; i < 100; ++i)
+        REQUIRE(queue.Push(std::to_string(i)));
+      REQUIRE(queue.PopN(3) == 3);
+    }
+
+    // Simulates a crash, where pushes and the first pops were not written
+    remove(95);
+    remove(97);
+    remove(4);
+
+    auto queue = Queue(db.get(), queue_options);
+    REQUIRE(queue.recovery_info().is_from_checkpoint);
+    REQUIRE(queue.recovery_info().moved_number > 0);
+    REQUIRE(IsSize(queue, 94));
+    for (size_t i = 3; i < 100; ++i) {
+      if (i != 95 && i != 97 && i != 4)
+        REQUIRE(queue.Poll() == std::pair<std::string, bool>(std::to_string(i), true));
+    }
+    REQUIRE(IsEmpty(queue));
+  }
+
+  SECTION("Corrupted checkpoint") {
+    {
+      auto queue = Queue(db.get(), queue_options);
+      REQUIRE(queue.PushBatch(std::vector<std::string>{"a", "b"}));
+      queue.Checkpoint();
+    }
+
+    auto max_key = converter.ToKey(converter.GetMaxId());
+    auto checkpoint_key
+      = std::string(reinterpret_cast<char const*>(&max_key), sizeof(TKey)) + "C";
+    REQUIRE(db->Put(rocksdb::WriteOptions(), checkpoint_key, "x").ok());
+
+    auto queue = Queue(db.get(), queue_options);
+    REQUIRE(!queue.recovery_info().is_from_checkpoint);
+    REQUIRE(queue.PollBatch(10) == std::vector<std::string>{"a", "b"});
+  }
+}
+
+template <typename TKey>
+void PersistentQueueRecoveryTest(size_t max_thread_number) {
+  auto db = openTestDb();
+
+  auto converter = PrefixedNumericalKeyConverter<TKey, uint8_t>(231);
+  auto remove = [&](TKey id) {
+    auto key = converter.ToKey(id);
+    REQUIRE(db->Delete(rocksdb::WriteOptions(),
+                       rocksdb::Slice(reinterpret_cast<char const*>(&key), sizeof(TKey)))
+              .ok());
+  };
+  const auto number = std::min<size_t>(converter.GetMaxId() / 2, 1000);
+
+  auto check = [&](std::vector<size_t> const& expected, size_t moved_number) {
+    auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+    REQUIRE(!queue.recovery_info().is_from_checkpoint);
+    REQUIRE(queue.recovery_info().moved_number == moved_number);
+    REQUIRE(IsSize(queue, expected.size()));
+    for (auto value : expected)
+      REQUIRE(queue.Poll() == std::pair<std::string, bool>(std::to_string(value), true));
+    REQUIRE(IsEmpty(queue));
+  };
+
+  SECTION("Many gaps") {
+    {
+      auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+      for (size_t i = 0; i < number; ++i)
+        REQUIRE(queue.Push(std::to_string(i)));
+    }
+
+    std::vector<size_t> expected;
+    size_t moved_number = 0;
+    size_t removed_number = 0;
+    for (size_t i = 0; i < number; ++i) {
+      if (i % 7 == 3) {
+        remove(static_cast<TKey>(i));
+        ++removed_number;
+      }
+      else {
+        expected.push_back(i);
+        if (removed_number)
+          ++moved_number;
+      }
+    }
+
+    check(expected, moved_number);
+  }
+
+  SECTION("Gaps over the end") {
+    // The tail is over the end, items after the end are visited twice by the scan
+    const auto head = static_cast<TKey>(converter.GetMaxId() - number / 2 + 1);
+    for (size_t i = 0; i < number; ++i) {
+      auto key = converter.ToKey(static_cast<TKey>(head + i));
+      REQUIRE(db->Put(rocksdb::WriteOptions(),
+                      rocksdb::Slice(reinterpret_cast<char const*>(&key), sizeof(TKey)),
+                      std::to_string(i))
+                .ok());
+    }
+
+    remove(0);
+    remove(2);
+
+    std::vector<size_t> expected;
+    for (size_t i = 0; i < number; ++i) {
+      if (i != number / 2 && i != number / 2 + 2)
+        expected.push_back(i);
+    }
+
+    check(expected, 2 * (number - number / 2 - 3) + 1);
+  }
+}
+
+template <typename TKey>
+void PersistentQueueTombstoneTest(size_t max_thread_number) {
+  auto db = openTestDb();
+
+  using Queue = PersistentQueue<TKey, uint8_t, 231>;
+  auto queue_options = PersistentQueueOptions();
+  queue_options.max_thread_number = max_thread_number;
+  const auto max_id = PrefixedNumericalKeyConverter<TKey, uint8_t>::GetMaxId();
+
+  // Also puts the head close to the maximum ID for small keys
+  auto fill = [&](Queue& queue) {
+    std::vector<std::string> values;
+    for (size_t i = 0; i < 10; ++i)
+      values.push_back(std::to_string(i));
+    if (max_id < 1000) {
+      for (size_t i = 0; i < max_id - 5; ++i) {
+        REQUIRE(queue.Push("x"));
+        REQUIRE(queue.Pop());
+      }
+    }
+    REQUIRE(queue.PushBatch(values));
+    return values;
+  };
+
+  SECTION("Range deletes") {
+    queue_options.range_delete_min_count = 3;
+    {
+      auto queue = Queue(db.get(), queue_options);
+      auto values = fill(queue);
+      REQUIRE(queue.PollBatch(2) == std::vector<std::string>{"0", "1"});
+      const auto rest = std::vector<std::string>(values.begin() + 2, values.end());
+      REQUIRE(queue.PollBatch(8) == rest);
+      REQUIRE(IsEmpty(queue));
+      REQUIRE(queue.Push("a"));
+      REQUIRE(queue.Push("b"));
+
+#if defined(perq_WITH_STATS) && !defined(preq_DISABLE_STATS_OPERATIONS)
+      REQUIRE(queue.stats().range_delete_count == ((max_id < 1000) ? 2 : 1));
+#endif
+    }
+
+    auto queue = Queue(db.get(), queue_options);
+    REQUIRE(queue.PollBatch(10) == std::vector<std::string>{"a", "b"});
+  }
+
+  SECTION("No range deletes by default") {
+    REQUIRE(PersistentQueueOptions().range_delete_min_count == 0);
+    queue_options.range_delete_min_count = 0;
+    auto queue = Queue(db.get(), queue_options);
+    auto values = fill(queue);
+    REQUIRE(queue.PollBatch(10) == values);
+
+#if defined(perq_WITH_STATS) && !defined(preq_DISABLE_STATS_OPERATIONS)
+    REQUIRE(queue.stats().range_delete_count == 0);
+#endif
+  }
+
+  SECTION("Compaction") {
+    queue_options.compaction_threshold = 5;
+    queue_options.compaction_check_interval = std::chrono::milliseconds(1);
+    auto queue = Queue(db.get(), queue_options);
+    auto values = fill(queue);
+    REQUIRE(queue.PollBatch(10) == values);
+
+#if defined(perq_WITH_STATS) && !defined(preq_DISABLE_STATS_OPERATIONS)
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (queue.stats().compacted_id_count < 10
+           && std::chrono::steady_clock::now() < deadline)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    REQUIRE(queue.stats().compaction_count > 0);
+    REQUIRE(queue.stats().compacted_id_count >= 10);
+    REQUIRE(queue.stats().compaction_failure_count == 0);
+#endif
+
+    // Moving the queue moves the maintenance thread too
+    auto moved_queue = std::move(queue);
+    REQUIRE(moved_queue.Push("a"));
+    REQUIRE(moved_queue.Poll() == std::pair<std::string, bool>("a", true));
+  }
+}
+
+template <typename TKey>
+void PersistentQueueDbOptionsTest(size_t max_thread_number) {
+  const auto path = removeTestDb().string();
+
+  auto queue_options = PersistentQueueOptions();
+  queue_options.max_thread_number = max_thread_number;
+
+  SECTION("Prefix extractor") {
+    REQUIRE(!MakeQueueColumnFamilyOptions<NoPrefix>().prefix_extractor);
+    REQUIRE(MakeQueueColumnFamilyOptions<uint8_t>().prefix_extractor);
+    REQUIRE(MakeQueueOptions<uint8_t>().create_if_missing);
+  }
+
+  for (auto profile :
+       {QueueProfile::Throughput, QueueProfile::Latency, QueueProfile::LowMemory}) {
+    SECTION("Profile " + std::to_string(static_cast<int>(profile))) {
+      std::vector<std::string> values;
+      for (size_t i = 0; i < 20; ++i)
+        values.push_back(makeRandomString());
+
+      {
+        auto db = OpenQueueDb<uint8_t>(path, profile);
+        auto queue_a = PersistentQueue<TKey, uint8_t, 32>(db.get(), queue_options);
+        auto queue_b = PersistentQueue<TKey, uint8_t, 231>(db.get(), queue_options);
+        REQUIRE(queue_a.PushBatch(values));
+        REQUIRE(queue_b.Push("b"));
+        REQUIRE(queue_a.PollBatch(10)
+                == std::vector<std::string>(values.begin(), values.begin() + 10));
+      }
+
+      auto db = OpenQueueDb<uint8_t>(path, profile);
+      auto queue_a = PersistentQueue<TKey, uint8_t, 32>(db.get(), queue_options);
+      auto queue_b = PersistentQueue<TKey, uint8_t, 231>(db.get(), queue_options);
+      REQUIRE(queue_a.PollBatch(20)
+              == std::vector<std::string>(values.begin() + 10, values.end()));
+      REQUIRE(queue_b.Poll() == std::pair<std::string, bool>("b", true));
+      REQUIRE(IsEmpty(queue_a));
+      REQUIRE(IsEmpty(queue_b));
+    }
+  }
+}
+
+template <typename TKey>
+void PersistentQueueExportTest(size_t max_thread_number) {
+  auto db = openTestDb(MakeQueueOptions());
+  auto queue = createQueue<TKey>(db.get(), max_thread_number);
+
+  std::vector<std::string> values;
+  for (size_t i = 0; i < 10; ++i)
+    values.push_back(makeRandomString());
+  REQUIRE(queue.PushBatch(values));
+
+  const auto previous = queue.Snapshot();
+  for (size_t i = 0; i < 4; ++i)
+    REQUIRE(queue.Poll() == std::make_pair(values[i], true));
+  const auto snapshot = queue.Snapshot();
+
+  SECTION("Snapshot") {
+    REQUIRE(previous.size == 10);
+    REQUIRE(snapshot.size == 6);
+    REQUIRE(snapshot.tail - snapshot.head == 6);
+    REQUIRE(snapshot.lease_size == 0);
+    REQUIRE(snapshot.is_with_stats);
+    REQUIRE(snapshot.time >= previous.time);
+  }
+
+#if defined(perq_WITH_STATS) && !defined(preq_DISABLE_STATS_OPERATIONS)
+  SECTION("Delta") {
+    const auto delta = snapshot.Delta(previous);
+    REQUIRE(delta.interval == snapshot.time - previous.time);
+    REQUIRE(delta.size == 6);
+    REQUIRE(previous.stats.value_size_histogram.Count() == 10);
+    REQUIRE(delta.stats.value_size_histogram.Count() == 0);
+    REQUIRE(delta.stats.poll_histograms.latency.Count() == 4);
+    REQUIRE(delta.stats.push_histograms.latency.Count() == 0);
+    REQUIRE(delta.stats.poll_histograms.latency.sum
+            == snapshot.stats.poll_histograms.latency.sum
+                 - previous.stats.poll_histograms.latency.sum);
+  }
+#endif
+
+  SECTION("Prometheus") {
+    std::ostringstream out;
+    WritePrometheus(out, {{"a", previous}, {"b\"", snapshot}});
+    const auto text = out.str();
+    REQUIRE(text.find("# TYPE perq_queue_size gauge\n") != std::string::npos);
+    REQUIRE(text.find("perq_queue_size{queue=\"a\"} 10\n") != std::string::npos);
+    REQUIRE(text.find("perq_queue_size{queue=\"b\\\"\"} 6\n") != std::string::npos);
+    REQUIRE(text.find("# TYPE perq_yields_total counter\n") != std::string::npos);
+    REQUIRE(text.find("perq_yields_total{queue=\"a\",operation=\"push\"}")
+            != std::string::npos);
+    REQUIRE(text.find("# TYPE perq_operation_latency_seconds summary\n")
+            != std::string::npos);
+    REQUIRE(text.find("perq_operation_latency_seconds{queue=\"a\",operation=\"poll\","
+                      "part=\"db\",quantile=\"0.99\"}")
+            != std::string::npos);
+    REQUIRE(text.find("perq_value_size_bytes_count{queue=\"a\"} 10\n")
+            != std::string::npos);
+    // Every family is written once for all queues
+    REQUIRE(text.find("# TYPE perq_queue_size") == text.rfind("# TYPE perq_queue_size"));
+  }
+
+  SECTION("JSON") {
+    std::ostringstream out;
+    WriteJson(out, snapshot.Delta(previous));
+    const auto text = out.str();
+    REQUIRE(text.front() == '{');
+    REQUIRE(text.back() == '}');
+    REQUIRE(text.find("\"size\": 6,") != std::string::npos);
+    REQUIRE(text.find("\"memtable_deletes\": ") != std::string::npos);
+    REQUIRE(text.find("\"poll_latency_ns\": {\"count\": 4,") != std::string::npos);
+  }
+}
+
+template <typename TKey, typename TBackoff>
+void CheckBackoff(rocksdb::DB* db, size_t operation_number, size_t max_thread_number) {
+  auto queue = PersistentQueue<TKey, uint8_t, 231, TBackoff>(db, max_thread_number);
+  REQUIRE(IsEmpty(queue));
+
+  const size_t thread_number = 4;
+  std::atomic<size_t> poll_count = {0};
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < thread_number; ++t) {
+    threads.emplace_back([&]() {
+      for (size_t i = 0; i < operation_number / thread_number;)
+        if (queue.Push("small"))
+          ++i;
+    });
+    threads.emplace_back([&]() {
+      while (poll_count < operation_number / thread_number * thread_number) {
+        auto ret = queue.Poll();
+        if (ret.second) {
+          if (ret.first != "small")
+            throw std::runtime_error("Invalid value");
+          ++poll_count;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+
+  REQUIRE(poll_count == operation_number / thread_number * thread_number);
+  REQUIRE(IsEmpty(queue));
+}
+
+template <typename TKey>
+void PersistentQueueBackoffTest(size_t operation_number, size_t max_thread_number) {
+  auto db = openTestDb(MakeQueueOptions());
+
+  SECTION("Yield") {
+    CheckBackoff<TKey, YieldBackoff<>>(db.get(), operation_number, max_thread_number);
+  }
+
+  SECTION("Spin") {
+    CheckBackoff<TKey, SpinBackoff<>>(db.get(), operation_number, max_thread_number);
+  }
+
+  SECTION("Exponential") {
+    CheckBackoff<TKey, ExponentialBackoff<>>(
+      db.get(), operation_number, max_thread_number);
+  }
+
+  SECTION("Park") {
+    CheckBackoff<TKey, ParkBackoff<>>(db.get(), operation_number, max_thread_number);
+  }
+}
+
+template <typename TKey>
+void PersistentQueueRegistryTest(size_t max_thread_number) {
+  auto db = openTestDb(MakeQueueOptions<uint8_t>());
+  auto options = PersistentQueueOptions();
+  options.max_thread_number = max_thread_number;
+
+  const std::vector<uint8_t> topics = {0, 17, 230, 231, 255};
+  {
+    QueueRegistry<TKey, uint8_t> registry(db.get(), options);
+    REQUIRE(registry.TopicNumber() == 0);
+    REQUIRE(registry.Find(17) == nullptr);
+    REQUIRE_THROWS_AS(registry.Get(17), Exception);
+
+    for (auto topic : topics) {
+      auto& queue = registry.Open(topic);
+      REQUIRE(&registry.Open(topic) == &queue);
+      REQUIRE(registry.Find(topic) == &queue);
+      for (size_t i = 0; i <= topic % 7; ++i)
+        REQUIRE(queue.Push(std::to_string(topic) + "/" + std::to_string(i)));
+    }
+    REQUIRE(registry.Topics() == topics);
+
+    // A topic without items is found by its checkpoint
+    registry.Get(17).Checkpoint();
+    REQUIRE(registry.Get(17).PopN(10) == 17 % 7 + 1);
+  }
+
+  SECTION("Recovery") {
+    QueueRegistry<TKey, uint8_t> registry(db.get(), options);
+    REQUIRE(registry.Topics() == topics);
+    for (auto topic : topics) {
+      auto& queue = registry.Get(topic);
+      const size_t size = (topic == 17) ? 0 : topic % 7 + 1;
+      REQUIRE(queue.Size() == size);
+      for (size_t i = 0; i < size; ++i)
+        REQUIRE(queue.Poll()
+                == std::make_pair(std::to_string(topic) + "/" + std::to_string(i), true));
+      REQUIRE(IsEmpty(queue));
+    }
+  }
+
+  SECTION("Compile-time prefix") {
+    {
+      auto queue = PersistentQueue<TKey, uint8_t, 231>(db.get(), max_thread_number);
+      REQUIRE(queue.Size() == 231 % 7 + 1);
+      REQUIRE(queue.Push("last"));
+    }
+
+    QueueRegistry<TKey, uint8_t> registry(db.get(), options);
+    auto& queue = registry.Get(231);
+    REQUIRE(queue.PopN(231 % 7 + 1) == 231 % 7 + 1);
+    REQUIRE(queue.Poll() == std::pair<std::string, bool>("last", true));
+  }
+
+  SECTION("Wraparound") {
+    {
+      QueueRegistry<TKey, uint8_t> registry(db.get(), options);
+      auto& queue = registry.Open(42);
+      for (size_t i = 0; i < 15 * max_thread_number; ++i) {
+        REQUIRE(queue.Push("a"));
+        REQUIRE(queue.Pop());
+      }
+      for (size_t i = 0; i < max_thread_number; ++i)
+        REQUIRE(queue.Push(std::to_string(i)));
+    }
+
+    QueueRegistry<TKey, uint8_t> registry(db.get(), options);
+    REQUIRE(registry.TopicNumber() == topics.size() + 1);
+    auto& queue = registry.Get(42);
+    for (size_t i = 0; i < max_thread_number; ++i)
+      REQUIRE(queue.Poll() == std::make_pair(std::to_string(i), true));
+    REQUIRE(IsEmpty(queue));
+    REQUIRE(IsSize(registry.Get(0), 1));
+  }
+}
+
+template <typename TKey>
+void PersistentQueuePriorityTest(size_t max_thread_number) {
+  auto db = openTestDb(MakeQueueOptions<uint8_t>());
+  auto options = PriorityOptions();
+  options.queue_options.max_thread_number = max_thread_number;
+
+  SECTION("Strict") {
+    PriorityPersistentQueue<TKey> queue(db.get(), {10, 20, 30}, options);
+    REQUIRE(queue.LevelNumber() == 3);
+    REQUIRE(!queue.Poll().second);
+
+    for (size_t i = 0; i < 5; ++i) {
+      REQUIRE(queue.Push(2, "low " + std::to_string(i)));
+      REQUIRE(queue.Push(1, "normal " + std::to_string(i)));
+    }
+    REQUIRE(queue.Push(0, "urgent"));
+    REQUIRE(queue.Size() == 11);
+
+    std::string value;
+    size_t level;
+    REQUIRE(queue.Poll(value, &level));
+    REQUIRE(value == "urgent");
+    REQUIRE(level == 0);
+    REQUIRE(queue.Poll() == std::pair<std::string, bool>("normal 0", true));
+
+    auto values = queue.PollBatch(6);
+    REQUIRE(values.size() == 6);
+    REQUIRE(values[3] == "normal 4");
+    REQUIRE(values[4] == "low 0");
+    REQUIRE(values[5] == "low 1");
+    REQUIRE(queue.Size() == 3);
+  }
+
+  SECTION("Weighted") {
+    options.policy = PriorityPolicy::Weighted;
+    options.weights = {3, 1};
+    PriorityPersistentQueue<TKey> queue(db.get(), {10, 20}, options);
+
+    for (size_t i = 0; i < 8; ++i) {
+      REQUIRE(queue.Push(0, "high"));
+      REQUIRE(queue.Push(1, "low"));
+    }
+
+    size_t low_number = 0;
+    for (size_t i = 0; i < 8; ++i) {
+      size_t level;
+      std::string value;
+      REQUIRE(queue.Poll(value, &level));
+      low_number += level;
+    }
+    REQUIRE(low_number == 2);
+
+    // The high level runs out, the low one gets the rest
+    auto values = queue.PollBatch(4);
+    REQUIRE(values.size() == 4);
+    REQUIRE(std::count(values.begin(), values.end(), "high") == 2);
+
+    for (size_t i = 0; i < 4; ++i)
+      REQUIRE(queue.Push(0, "high"));
+    values = queue.PollBatch(4);
+    REQUIRE(std::count(values.begin(), values.end(), "low") == 1);
+
+    REQUIRE(queue.PollBatch(10).size() == 4);
+    REQUIRE(queue.Size() == 0);
+    REQUIRE(!queue.Poll().second);
+  }
+
+  SECTION("Levels are prefixed queues") {
+    {
+      PriorityPersistentQueue<TKey> queue(db.get(), {10, 20}, options);
+      REQUIRE(queue.Push(1, "low"));
+      REQUIRE(queue.Push(0, "high"));
+    }
+
+    {
+      auto low = PersistentQueue<TKey, uint8_t, 20>(db.get(), max_thread_number);
+      REQUIRE(low.Poll() == std::pair<std::string, bool>("low", true));
+      REQUIRE(low.Push("low again"));
+    }
+
+    PriorityPersistentQueue<TKey> queue(db.get(), {10, 20}, options);
+    REQUIRE(queue.PollBatch(10) == std::vector<std::string>({"high", "low again"}));
+  }
+
+  SECTION("Invalid levels") {
+    REQUIRE_THROWS_AS(PriorityPersistentQueue<TKey>(db.get(), {}, options), Exception);
+    REQUIRE_THROWS_AS(PriorityPersistentQueue<TKey>(db.get(), {10, 10}, options),
+                      Exception);
+    options.policy = PriorityPolicy::Weighted;
+    options.weights = {1};
+    REQUIRE_THROWS_AS(PriorityPersistentQueue<TKey>(db.get(), {10, 20}, options),
+                      Exception);
+  }
+}
+
+template <typename TKey>
+void PersistentQueueShardedTest(size_t operation_number, size_t max_thread_number) {
+  auto db = openTestDb(MakeQueueOptions<uint8_t>());
+  auto options = PersistentQueueOptions();
+  options.max_thread_number = max_thread_number;
+  const std::vector<uint8_t> prefixes = {40, 41, 42, 43};
+
+  SECTION("Work stealing") {
+    ShardedPersistentQueue<TKey> queue(db.get(), prefixes, options);
+    REQUIRE(queue.ShardNumber() == 4);
+    REQUIRE(!queue.Poll().second);
+
+    for (size_t i = 0; i < 4; ++i)
+      REQUIRE(queue.Shard(i).Push(std::to_string(i)));
+    REQUIRE(queue.Size() == 4);
+
+    std::vector<std::string> values;
+    for (size_t i = 0; i < 3; ++i) {
+      auto ret = queue.Poll();
+      REQUIRE(ret.second);
+      values.push_back(ret.first);
+    }
+    REQUIRE(queue.Pop());
+    REQUIRE(!queue.Pop());
+    REQUIRE(queue.Size() == 0);
+
+    for (size_t i = 0; i < 4; ++i)
+      REQUIRE(queue.Shard(i).PushBatch(std::vector<std::string>{"a", "b"}));
+    REQUIRE(queue.PollBatch(5).size() == 5);
+    REQUIRE(queue.PollBatch(5).size() == 3);
+  }
+
+  SECTION("Own shard") {
+    ShardedPersistentQueue<TKey> queue(db.get(), prefixes, options);
+    REQUIRE(queue.Push("first"));
+    REQUIRE(queue.PushBatch(std::vector<std::string>{"second", "third"}));
+
+    size_t shard = 0;
+    for (; shard < 4 && queue.Shard(shard).Size() == 0; ++shard)
+      ;
+    REQUIRE(queue.Shard(shard).Size() == 3);
+    REQUIRE(queue.PollBatch(3) == std::vector<std::string>({"first", "second", "third"}));
+  }
+
+  SECTION("Parallel Push and Poll") {
+    ShardedPersistentQueue<TKey> queue(db.get(), prefixes, options);
+    const size_t thread_number = 4;
+    const auto number = operation_number / thread_number * thread_number;
+    std::atomic<size_t> poll_count = {0};
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < thread_number; ++t) {
+      threads.emplace_back([&]() {
+        for (size_t i = 0; i < number / thread_number;)
+          if (queue.Push("small"))
+            ++i;
+      });
+      threads.emplace_back([&]() {
+        while (poll_count < number) {
+          auto ret = queue.Poll();
+          if (ret.second) {
+            if (ret.first != "small")
+              throw std::runtime_error("Invalid value");
+            ++poll_count;
+          }
+        }
+      });
+    }
+    for (auto& thread : threads)
+      thread.join();
+
+    REQUIRE(poll_count == number);
+    REQUIRE(queue.Size() == 0);
+  }
+
+  SECTION("Recovery") {
+    {
+      ShardedPersistentQueue<TKey> queue(db.get(), prefixes, options);
+      for (size_t i = 0; i < 4; ++i)
+        REQUIRE(queue.Shard(i).Push(std::to_string(i)));
+    }
+
+    ShardedPersistentQueue<TKey> queue(db.get(), prefixes, options);
+    REQUIRE(queue.Size() == 4);
+    for (size_t i = 0; i < 4; ++i)
+      REQUIRE(queue.Shard(i).Poll() == std::make_pair(std::to_string(i), true));
+  }
+}
+
+template <typename TKey>
+void PersistentQueueDrainTest(size_t max_thread_number) {
+  auto db = openTestDb(MakeQueueOptions<uint8_t>());
+  auto options = PersistentQueueOptions();
+  options.max_thread_number = max_thread_number;
+  options.drain_chunk_size = 7;
+  auto queue = PersistentQueue<TKey, uint8_t, 231>(db.get(), options);
+
+  std::vector<std::string> values;
+  for (size_t i = 0; i < 100; ++i)
+    values.push_back(makeRandomString(makeRandomNumber(0, 100)));
+
+  std::vector<std::string> drained;
+  auto collect
+    = [&](rocksdb::Slice const& value) { drained.push_back(value.ToString()); };
+  auto push = [&](size_t first, size_t last) {
+    for (auto i = first; i < last; ++i)
+      REQUIRE(queue.Push(values[i]));
+  };
+
+  SECTION("Drain") {
+    REQUIRE(queue.Drain(collect) == 0);
+    push(0, 50);
+    REQUIRE(queue.Drain(collect, 20) == 20);
+    REQUIRE(queue.Size() == 30);
+    push(50, 100);
+    REQUIRE(queue.Drain(collect) == 80);
+    REQUIRE(drained == values);
+    REQUIRE(IsEmpty(queue));
+
+    // Consumed items are gone after a restart
+    auto reopened = PersistentQueue<TKey, uint8_t, 231>(db.get(), options);
+    REQUIRE(IsEmpty(reopened));
+  }
+
+  SECTION("Wraparound") {
+    for (size_t round = 0; round < 6; ++round) {
+      push(0, 50);
+      REQUIRE(queue.Drain(collect) == 50);
+    }
+    REQUIRE(drained.size() == 300);
+    for (size_t i = 0; i < drained.size(); ++i)
+      REQUIRE(drained[i] == values[i % 50]);
+    REQUIRE(IsEmpty(queue));
+  }
+
+  SECTION("Parallel Poll") {
+    push(0, 100);
+    push(0, 100);
+
+    std::vector<std::string> polled;
+    std::thread thread([&]() {
+      for (auto value = queue.Poll(); value.second; value = queue.Poll())
+        polled.push_back(value.first);
+    });
+    queue.Drain(collect);
+    thread.join();
+
+    REQUIRE(drained.size() + polled.size() == 200);
+    REQUIRE(IsEmpty(queue));
+  }
+
+  SECTION("Chunk size") {
+    // A chunk moves the head over at most `max_thread_number` IDs
+    options.drain_chunk_size = max_thread_number + 5;
+    auto chunked = PersistentQueue<TKey, uint8_t, 232>(db.get(), options);
+    for (size_t i = 0; i < max_thread_number + 5; ++i)
+      REQUIRE(chunked.Push("a"));
+    REQUIRE_THROWS_AS(
+      chunked.Drain([](rocksdb::Slice const&) { throw std::runtime_error("failure"); }),
+      std::runtime_error);
+    REQUIRE(chunked.Size() == 5);
+  }
+}
+
+template <typename TKey>
+void PersistentQueueAsyncTest(size_t max_thread_number) {
+  auto db = openTestDb(MakeQueueOptions());
+  auto queue = createQueue<TKey, uint8_t>(db.get(), max_thread_number);
+
+  std::vector<std::string> values;
+  for (size_t i = 0; i < 100; ++i)
+    values.push_back(makeRandomString(makeRandomNumber(0, 100)));
+
+  SECTION("Push and Poll") {
+    AsyncPersistentQueue<decltype(queue)> async_queue(queue);
+
+    std::vector<std::future<bool>> pushes;
+    for (auto const& value : values)
+      pushes.push_back(async_queue.PushAsync(value));
+    for (auto& push : pushes)
+      REQUIRE(push.get());
+    REQUIRE(queue.Size() == values.size());
+
+    std::vector<std::future<std::pair<std::string, bool>>> polls;
+    for (size_t i = 0; i < values.size() + 10; ++i)
+      polls.push_back(async_queue.PollAsync());
+    for (size_t i = 0; i < polls.size(); ++i) {
+      const auto ret = polls[i].get();
+      if (i < values.size())
+        REQUIRE(ret == std::make_pair(values[i], true));
+      else
+        REQUIRE(!ret.second);
+    }
+    REQUIRE(IsEmpty(queue));
+  }
+
+  SECTION("Pending requests") {
+    std::vector<std::future<bool>> pushes;
+    {
+      AsyncPersistentQueue<decltype(queue)> async_queue(queue, 3);
+      for (auto const& value : values)
+        pushes.push_back(async_queue.PushAsync(value));
+    }
+    for (auto& push : pushes)
+      REQUIRE(push.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+    std::vector<std::string> polled;
+    while (queue.PollBatch(values.size(), std::back_inserter(polled)) > 0) {
+    }
+    REQUIRE(polled == values);
+  }
+
+  SECTION("Full queue") {
+    AsyncPersistentQueue<decltype(queue)> async_queue(queue);
+    const auto max_size = PrefixedNumericalKeyConverter<TKey, uint8_t>::GetMaxId()
+      - max_thread_number + 1;
+    if (max_size > 1000)
+      return;
+
+    size_t pushed = 0;
+    std::vector<std::future<bool>> pushes;
+    for (size_t i = 0; i < max_size + 10; ++i)
+      pushes.push_back(async_queue.PushAsync("small"));
+    for (auto& push : pushes)
+      pushed += push.get();
+    REQUIRE(pushed == max_size - 1);
+  }
+}
+
+template <typename TKey>
+void PersistentQueuePackedTest(size_t max_thread_number) {
+  auto db = openTestDb(MakeQueueOptions());
+  using Queue = PackedPersistentQueue<PersistentQueue<TKey, uint8_t>>;
+
+  PersistentQueueOptions options;
+  options.max_thread_number = max_thread_number;
+  PackingOptions packing_options;
+  packing_options.segment_max_number = 16;
+  packing_options.is_push_batched = true;
+
+  std::vector<std::string> values;
+  for (size_t i = 0; i < 100; ++i)
+    values.push_back(makeRandomString(makeRandomNumber(0, 100)));
+
+  SECTION("Durable Push") {
+    packing_options.is_push_batched = false;
+    Queue queue(db.get(), options, packing_options);
+    REQUIRE(queue.Push(values[0]));
+    REQUIRE(queue.queue().Size() == 1);
+
+    // Every `Push` returns after its segment is sealed, concurrent ones may share it
+    const size_t thread_number = 4;
+    std::atomic<size_t> pushed = {0};
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < thread_number; ++i) {
+      threads.emplace_back([&]() {
+        for (auto const& value : values)
+          pushed += queue.Push(value);
+      });
+    }
+    for (auto& thread : threads)
+      thread.join();
+
+    const auto number = 1 + thread_number * values.size();
+    REQUIRE(pushed == number - 1);
+    REQUIRE(queue.Size() == number);
+    REQUIRE(queue.queue().Size() <= number);
+
+    // Nothing is left in the open segment
+    const auto segment_number = queue.queue().Size();
+    REQUIRE(queue.Flush());
+    REQUIRE(queue.queue().Size() == segment_number);
+
+    for (size_t i = 0; i < number; ++i)
+      REQUIRE(queue.Pop());
+    REQUIRE(!queue.Pop());
+    REQUIRE(IsEmpty(queue.queue()));
+  }
+
+  SECTION("Push and Poll") {
+    Queue queue(db.get(), options, packing_options);
+    for (auto const& value : values)
+      REQUIRE(queue.Push(value));
+    REQUIRE(queue.Size() == values.size());
+    REQUIRE(queue.queue().Size() == values.size() / 16);
+    REQUIRE(queue.Flush());
+    REQUIRE(queue.queue().Size() == (values.size() + 15) / 16);
+
+    for (auto const& value : values)
+      REQUIRE(queue.Poll() == std::make_pair(value, true));
+    REQUIRE(!queue.Poll().second);
+    REQUIRE(queue.Size() == 0);
+    REQUIRE(IsEmpty(queue.queue()));
+
+    // The cursor is deleted together with the last segment
+    rocksdb::ReadOptions read_options;
+    read_options.total_order_seek = true;
+    auto it = std::unique_ptr<rocksdb::Iterator>(db->NewIterator(read_options));
+    it->SeekToFirst();
+    REQUIRE(!it->Valid());
+  }
+
+  SECTION("Direct consumer") {
+    Queue queue(db.get(), options, packing_options);
+    REQUIRE(queue.Push(values[0]));
+    REQUIRE(queue.Push(values[1]));
+    REQUIRE(queue.Flush());
+    REQUIRE(queue.Poll() == std::make_pair(values[0], true));
+    REQUIRE(queue.queue().Pop());
+    REQUIRE_THROWS_AS(queue.Pop(), Exception);
+  }
+
+  SECTION("Open segment") {
+    Queue queue(db.get(), options, packing_options);
+    REQUIRE(queue.Push(values[0]));
+    REQUIRE(queue.queue().Size() == 0);
+    REQUIRE(queue.Poll() == std::make_pair(values[0], true));
+    REQUIRE(queue.Size() == 0);
+  }
+
+  SECTION("Restart") {
+    {
+      Queue queue(db.get(), options, packing_options);
+      for (size_t i = 0; i < 40; ++i)
+        REQUIRE(queue.Push(values[i]));
+      for (size_t i = 0; i < 5; ++i)
+        REQUIRE(queue.Pop());
+      REQUIRE(queue.Poll() == std::make_pair(values[5], true));
+    }
+    {
+      Queue queue(db.get(), options, packing_options);
+      REQUIRE(queue.Size() == 34);
+      for (size_t i = 6; i < 40; ++i)
+        REQUIRE(queue.Poll() == std::make_pair(values[i], true));
+      REQUIRE(!queue.Poll().second);
+    }
+  }
+
+  SECTION("Wraparound") {
+    packing_options.segment_max_number = 4;
+    Queue queue(db.get(), options, packing_options);
+    for (size_t round = 0; round < 30; ++round) {
+      for (auto const& value : values)
+        REQUIRE(queue.Push(value));
+      for (auto const& value : values)
+        REQUIRE(queue.Poll() == std::make_pair(value, true));
+    }
+    REQUIRE(queue.Size() == 0);
+  }
+}
+
+template <typename TKey>
+void PersistentQueueStreamTest(size_t max_thread_number) {
+  auto db = openTestDb(MakeQueueOptions());
+  using Queue = PersistentQueue<TKey, uint8_t, 231>;
+
+  PersistentQueueOptions options;
+  options.max_thread_number = max_thread_number;
+  options.stream_chunk_size = 1000;
+
+  auto makeSource = [](std::string const& value) {
+    auto offset = std::make_shared<size_t>(0);
+    return [&value, offset](char* data, size_t size) {
+      // Fills less than asked for, `PushStream` must gather a whole chunk
+      size = std::min({size, value.size() - *offset, size_t(300)});
+      std::memcpy(data, value.data() + *offset, size);
+      *offset += size;
+      return size;
+    };
+  };
+
+  auto countKeys = [&db]() {
+    rocksdb::ReadOptions read_options;
+    read_options.total_order_seek = true;
+    auto it = std::unique_ptr<rocksdb::Iterator>(db->NewIterator(read_options));
+    size_t number = 0;
+    for (it->SeekToFirst(); it->Valid(); it->Next())
+      ++number;
+    return number;
+  };
+
+  std::vector<std::string> values;
+  for (auto size : {0, 1, 999, 1000, 1001, 3500})
+    values.push_back(makeRandomString(size));
+
+  SECTION("Push and Poll") {
+    Queue queue(db.get(), options);
+    for (auto const& value : values)
+      REQUIRE(queue.PushStream(makeSource(value)));
+    REQUIRE(queue.Size() == values.size());
+
+    for (auto const& value : values) {
+      std::string polled;
+      size_t chunk_number = 0;
+      REQUIRE(queue.PollStream([&](rocksdb::Slice const& chunk) {
+        REQUIRE(chunk.size() <= options.stream_chunk_size);
+        polled.append(chunk.data(), chunk.size());
+        ++chunk_number;
+      }));
+      REQUIRE(polled == value);
+      REQUIRE(chunk_number == (value.size() + 999) / 1000);
+    }
+    REQUIRE(!queue.PollStream([](rocksdb::Slice const&) {}));
+    REQUIRE(IsEmpty(queue));
+    REQUIRE(countKeys() == 0);
+  }
+
+  SECTION("Restart") {
+    {
+      Queue queue(db.get(), options);
+      for (auto const& value : values)
+        REQUIRE(queue.PushStream(makeSource(value)));
+    }
+    Queue queue(db.get(), options);
+    REQUIRE(queue.Size() == values.size());
+    for (auto const& value : values) {
+      std::string polled;
+      REQUIRE(queue.PollStream(
+        [&](rocksdb::Slice const& chunk) { polled.append(chunk.data(), chunk.size()); }));
+      REQUIRE(polled == value);
+    }
+    REQUIRE(queue.PushStream(makeSource(values.back())));
+    REQUIRE(queue.Size() == 1);
+  }
+
+  SECTION("Failures") {
+    Queue queue(db.get(), options);
+    auto failing_source = [](char*, size_t) -> size_t {
+      throw std::runtime_error("source failure");
+    };
+    REQUIRE_THROWS_AS(queue.PushStream(failing_source), std::runtime_error);
+    REQUIRE(queue.Size() == 0);
+
+    auto failing_sink
+      = [](rocksdb::Slice const&) { throw std::runtime_error("sink failure"); };
+    REQUIRE(queue.PushStream(makeSource(values.back())));
+    REQUIRE_THROWS_AS(queue.PollStream(failing_sink), std::runtime_error);
+    REQUIRE(IsEmpty(queue));
+    REQUIRE(countKeys() == 0);
+  }
+
+  SECTION("Not a stream item") {
+    Queue queue(db.get(), options);
+    const auto reference_like = std::string("\0perq:stream", 12) + std::string(20, '\0');
+    const auto items = std::vector<std::string>{std::string(20, 'a'), reference_like};
+    for (auto const& item : items) {
+      REQUIRE(queue.Push(item));
+      REQUIRE_THROWS_AS(queue.PollStream([](rocksdb::Slice const&) {}), Exception);
+      REQUIRE(queue.Size() == 1);
+      REQUIRE(queue.Poll() == std::make_pair(item, true));
+    }
+
+    // A copied reference does not refer to the stream
+    REQUIRE(queue.PushStream(makeSource(values.back())));
+    const auto reference = queue.Top().first;
+    REQUIRE(queue.Push(reference));
+    REQUIRE(queue.PollStream([](rocksdb::Slice const&) {}));
+    REQUIRE_THROWS_AS(queue.PollStream([](rocksdb::Slice const&) {}), Exception);
+    REQUIRE(queue.Poll() == std::make_pair(reference, true));
+    REQUIRE(countKeys() == 0);
+  }
+
+  SECTION("Other consumers") {
+    {
+      Queue queue(db.get(), options);
+      REQUIRE(queue.PushStream(makeSource(values.back())));
+      auto item = queue.Poll();
+      REQUIRE(item.second);
+      REQUIRE(item.first != values.back());
+      REQUIRE(IsEmpty(queue));
+      REQUIRE(countKeys() > 0);
+    }
+    // Chunks of the consumed stream are deleted on restart
+    Queue queue(db.get(), options);
+    REQUIRE(countKeys() == 0);
+  }
+}
+
+/*
+ * Test cases of `test` with 16, 32 and 64 bit keys. 16 bit keys get their own arguments,
+ * e.g. a smaller `max_thread_number` that leaves room in their ID space.
+ */
+#define perq_TEST_CASES_OF_KEY_SIZES(name, tag, test, arguments_16, arguments)           \
+  TEST_CASE("PersistentQueue 16 " name, "[PersistentQueue][16][" tag "]") {             \
+    test<uint16_t> arguments_16;                                                         \
+  }                                                                                      \
+                                                                                         \
+  TEST_CASE("PersistentQueue 32 " name, "[PersistentQueue][32][" tag "]") {             \
+    test<uint32_t> arguments;                                                            \
+  }                                                                                      \
+                                                                                         \
+  TEST_CASE("PersistentQueue 64 " name, "[PersistentQueue][64][" tag "]") {             \
+    test<uint64_t> arguments;                                                            \
+  }
+
+perq_TEST_CASES_OF_KEY_SIZES("basic", "basic", PersistentQueueBasicTest, (20), ())
+
+perq_TEST_CASES_OF_KEY_SIZES(
+  "parallel", "parallel", PersistentQueueParallelTest, (234, 20), (100000))
+
+perq_TEST_CASES_OF_KEY_SIZES("batch", "batch", PersistentQueueBatchTest, (20), (1000))
+
+perq_TEST_CASES_OF_KEY_SIZES(
+  "wait", "wait", PersistentQueueWaitTest, (234, 20), (10000, 1000))
+
+perq_TEST_CASES_OF_KEY_SIZES(
+  "key space", "key_space", PersistentQueueKeySpaceTest, (20), (1000))
+
+perq_TEST_CASES_OF_KEY_SIZES(
+  "hot cache", "hot_cache", PersistentQueueHotCacheTest, (40000, 20), (1000, 1000))
+
+perq_TEST_CASES_OF_KEY_SIZES(
+  "lease", "lease", PersistentQueueLeaseTest, (1000, 20), (1000, 1000))
+
+perq_TEST_CASES_OF_KEY_SIZES(
+  "durability", "durability", PersistentQueueDurabilityTest, (1000, 20), (1000, 1000))
+
+perq_TEST_CASES_OF_KEY_SIZES(
+  "checkpoint", "checkpoint", PersistentQueueCheckpointTest, (20), (1000))
+
+perq_TEST_CASES_OF_KEY_SIZES(
+  "recovery", "recovery", PersistentQueueRecoveryTest, (20), (1000))
+
+perq_TEST_CASES_OF_KEY_SIZES(
+  "tombstones", "tombstones", PersistentQueueTombstoneTest, (20), (1000))
+
+perq_TEST_CASES_OF_KEY_SIZES(
+  "db options", "db_options", PersistentQueueDbOptionsTest, (20), (1000))
+
+perq_TEST_CASES_OF_KEY_SIZES("export", "export", PersistentQueueExportTest, (20), (1000))
+
+perq_TEST_CASES_OF_KEY_SIZES(
+  "backoff", "backoff", PersistentQueueBackoffTest, (1000, 20), (10000, 1000))
+
+perq_TEST_CASES_OF_KEY_SIZES(
+  "registry", "registry", PersistentQueueRegistryTest, (20), (1000))
+
+perq_TEST_CASES_OF_KEY_SIZES(
+  "priority", "priority", PersistentQueuePriorityTest, (20), (1000))
+
+perq_TEST_CASES_OF_KEY_SIZES(
+  "sharded", "sharded", PersistentQueueShardedTest, (234, 20), (10000, 1000))
+
+perq_TEST_CASES_OF_KEY_SIZES("drain", "drain", PersistentQueueDrainTest, (20), (1000))
+
+perq_TEST_CASES_OF_KEY_SIZES("async", "async", PersistentQueueAsyncTest, (20), (1000))
+
+perq_TEST_CASES_OF_KEY_SIZES("packed", "packed", PersistentQueuePackedTest, (20), (1000))
+
+perq_TEST_CASES_OF_KEY_SIZES("stream", "stream", PersistentQueueStreamTest, (20), (1000))